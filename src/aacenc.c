@@ -11,6 +11,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 #include "aacenc.h"
 
 int aacenc_is_explicit_bw_compatible_sbr_signaling_available()
@@ -54,7 +57,14 @@ int aacenc_is_dual_rate_sbr(const aacenc_param_t *params)
     return 0;
 }
 
-void aacenc_get_lib_info(LIB_INFO *info)
+/*
+ * aacEncGetLibInfo() requires an array of FDK_MODULE_LAST entries.
+ * Since result never changes, probe it only once per process.
+ */
+static LIB_INFO aacenc_lib_info;
+
+static
+void probe_lib_info(void)
 {
     LIB_INFO *lib_info = 0;
     lib_info = calloc(FDK_MODULE_LAST, sizeof(LIB_INFO));
@@ -62,7 +72,7 @@ void aacenc_get_lib_info(LIB_INFO *info)
         int i;
         for (i = 0; i < FDK_MODULE_LAST; ++i) {
             if (lib_info[i].module_id == FDK_AACENC) {
-                memcpy(info, &lib_info[i], sizeof(LIB_INFO));
+                memcpy(&aacenc_lib_info, &lib_info[i], sizeof(LIB_INFO));
                 break;
             }
         }
@@ -70,6 +80,21 @@ void aacenc_get_lib_info(LIB_INFO *info)
     free(lib_info);
 }
 
+void aacenc_get_lib_info(LIB_INFO *info)
+{
+#if HAVE_PTHREAD_H
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, probe_lib_info);
+#else
+    static int probed = 0;
+    if (!probed) {
+        probe_lib_info();
+        probed = 1;
+    }
+#endif
+    memcpy(info, &aacenc_lib_info, sizeof(LIB_INFO));
+}
+
 static const unsigned aacenc_sampling_freq_tab[] = {
     96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 
     16000, 12000, 11025, 8000, 7350, 0, 0, 0
@@ -250,6 +275,21 @@ FAIL:
     return -1;
 }
 
+int aacenc_reset(HANDLE_AACENCODER encoder, AACENC_InfoStruct *info)
+{
+    if (aacEncoder_SetParam(encoder, AACENC_CONTROL_STATE,
+                            AACENC_INIT_ALL) != AACENC_OK ||
+        aacEncEncode(encoder, 0, 0, 0, 0) != AACENC_OK) {
+        fprintf(stderr, "ERROR: encoder initialization failed\n");
+        return -1;
+    }
+    if (aacEncInfo(encoder, info) != AACENC_OK) {
+        fprintf(stderr, "ERROR: cannot retrieve encoder info\n");
+        return -1;
+    }
+    return 0;
+}
+
 int aac_encode_frame(HANDLE_AACENCODER encoder,
                      const pcm_sample_description_t *format,
                      const INT_PCM *input, unsigned iframes,
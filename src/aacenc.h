@@ -48,6 +48,8 @@ int aacenc_init(HANDLE_AACENCODER *encoder, const aacenc_param_t *params,
                 const pcm_sample_description_t *format,
                 AACENC_InfoStruct *info);
 
+int aacenc_reset(HANDLE_AACENCODER encoder, AACENC_InfoStruct *info);
+
 int aac_encode_frame(HANDLE_AACENCODER encoder,
                      const pcm_sample_description_t *format,
                      const INT_PCM *input, unsigned iframes,
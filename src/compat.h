@@ -19,6 +19,8 @@
 #endif
 
 int64_t aacenc_timer(void);
+int64_t aacenc_timer_usec(void);
+void aacenc_sleep_usec(int64_t usec);
 FILE *aacenc_fopen(const char *name, const char *mode);
 #ifdef _WIN32
 void aacenc_getmainargs(int *argc, char ***argv);
@@ -33,5 +35,10 @@ int aacenc_fprintf(FILE *fp, const char *fmt, ...);
 #endif
 const char *aacenc_basename(const char *path);
 int aacenc_seekable(FILE *fp);
+unsigned aacenc_cpu_count(void);
+void aacenc_prefetch_file(const char *path);
+FILE *aacenc_tmpfile(const char *path);
+int64_t aacenc_copy_file_range(FILE *dst, FILE *src, int64_t offset,
+                               int64_t size);
 
 #endif
@@ -2,6 +2,8 @@
  * Copyright (C) 2013 nu774
  * For conditions of distribution and use, see copyright notice in COPYING
  */
+/* for copy_file_range() and splice() */
+#define _GNU_SOURCE
 #if HAVE_CONFIG_H
 #  include "config.h"
 #endif
@@ -12,7 +14,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <time.h>
 #include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 #include "compat.h"
 
 int64_t aacenc_timer(void)
@@ -22,6 +32,31 @@ int64_t aacenc_timer(void)
     return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
+/* monotonic when available, since it is used to measure intervals */
+int64_t aacenc_timer_usec(void)
+{
+#if HAVE_CLOCK_GETTIME && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+    {
+        struct timeval tv = { 0 };
+        gettimeofday(&tv, 0);
+        return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    }
+}
+
+void aacenc_sleep_usec(int64_t usec)
+{
+    struct timespec ts;
+
+    ts.tv_sec = usec / 1000000;
+    ts.tv_nsec = usec % 1000000 * 1000;
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
 FILE *aacenc_fopen(const char *name, const char *mode)
 {
     FILE *fp;
@@ -37,6 +72,101 @@ int aacenc_seekable(FILE *fp)
     return fseek(fp, 0, SEEK_CUR) == 0;
 }
 
+unsigned aacenc_cpu_count(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > 0)
+        return n;
+#endif
+    return 1;
+}
+
+/* Let the kernel start reading the file in background */
+void aacenc_prefetch_file(const char *path)
+{
+#if HAVE_POSIX_FADVISE
+    int fd;
+    if ((fd = open(path, O_RDONLY)) >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+#endif
+}
+
+/*
+ * Anonymous temporary file. Created next to path when given, so that
+ * aacenc_copy_file_range() to path can share blocks instead of copying them
+ * on file systems supporting reflink.
+ */
+FILE *aacenc_tmpfile(const char *path)
+{
+    FILE *fp = 0;
+#if HAVE_MKSTEMP
+    char *template;
+    int fd;
+
+    if (path && strcmp(path, "-") &&
+        (template = malloc(strlen(path) + 8)) != 0) {
+        sprintf(template, "%s.XXXXXX", path);
+        if ((fd = mkstemp(template)) >= 0) {
+            unlink(template);
+            if ((fp = fdopen(fd, "wb+")) == 0)
+                close(fd);
+        }
+        free(template);
+    }
+#endif
+    return fp ? fp : tmpfile();
+}
+
+/*
+ * Copies size bytes at offset of src to the current position of dst in the
+ * kernel: by copy_file_range() to a regular file, or by splice() to a pipe.
+ * Returns bytes copied, which is short (possibly 0) when they don't work.
+ */
+int64_t aacenc_copy_file_range(FILE *dst, FILE *src, int64_t offset,
+                               int64_t size)
+{
+    int64_t done = 0;
+#if HAVE_COPY_FILE_RANGE || HAVE_SPLICE
+    struct stat st;
+    loff_t off_in = offset;
+    ssize_t n;
+
+    if (fflush(src) == EOF || fflush(dst) == EOF ||
+        fstat(fileno(dst), &st) < 0)
+        return -1;
+#if HAVE_COPY_FILE_RANGE
+    if (S_ISREG(st.st_mode)) {
+        loff_t off_out = ftello(dst);
+        if (off_out < 0)
+            return -1;
+        for (; done < size; done += n) {
+            n = copy_file_range(fileno(src), &off_in, fileno(dst), &off_out,
+                                size - done < 1<<30 ? size - done : 1<<30, 0);
+            if (n <= 0)
+                break;
+        }
+        if (fseeko(dst, off_out, SEEK_SET) < 0)
+            return -1;
+    }
+#endif
+#if HAVE_SPLICE
+    if (S_ISFIFO(st.st_mode)) {
+        for (; done < size; done += n) {
+            n = splice(fileno(src), &off_in, fileno(dst), 0,
+                       size - done < 1<<30 ? size - done : 1<<30,
+                       SPLICE_F_MOVE);
+            if (n <= 0)
+                break;
+        }
+    }
+#endif
+#endif
+    return done;
+}
+
 /*
  * Different from POSIX basename() when path ends with /.
  * Since we use this only for a regular file, the difference doesn't matter.
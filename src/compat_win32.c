@@ -34,11 +34,49 @@ int64_t aacenc_timer(void)
     return (int64_t)tv.time * 1000 + tv.millitm;
 }
 
+int64_t aacenc_timer_usec(void)
+{
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return count.QuadPart / freq.QuadPart * 1000000
+         + count.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart;
+}
+
+void aacenc_sleep_usec(int64_t usec)
+{
+    Sleep((DWORD)((usec + 999) / 1000));
+}
+
 int aacenc_seekable(FILE *fp)
 {
     return GetFileType((HANDLE)_get_osfhandle(_fileno(fp))) == FILE_TYPE_DISK;
 }
 
+unsigned aacenc_cpu_count(void)
+{
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwNumberOfProcessors;
+}
+
+void aacenc_prefetch_file(const char *path)
+{
+    /* not implemented; file cache of Windows does read-ahead by itself */
+}
+
+FILE *aacenc_tmpfile(const char *path)
+{
+    return tmpfile();
+}
+
+int64_t aacenc_copy_file_range(FILE *dst, FILE *src, int64_t offset,
+                               int64_t size)
+{
+    /* not implemented; copied through read and write */
+    return 0;
+}
+
 static
 int codepage_decode_wchar(int codepage, const char *from, wchar_t **to)
 {
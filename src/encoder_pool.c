@@ -0,0 +1,210 @@
+/* 
+ * Copyright (C) 2013 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#if HAVE_CONFIG_H
+#  include "config.h"
+#endif
+#if HAVE_STDINT_H
+#  include <stdint.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#include "encoder_pool.h"
+
+typedef struct pool_key_t {
+    aacenc_param_t params;
+    uint32_t sample_rate;
+    uint32_t channels;
+    uint32_t channel_mask;
+} pool_key_t;
+
+typedef struct pool_entry_t {
+    struct pool_entry_t *next;
+    pool_key_t key;
+    HANDLE_AACENCODER encoder;
+    unsigned reused;
+} pool_entry_t;
+
+struct aacenc_pool_t {
+    pool_entry_t *idle;         /* most recently released first */
+    pool_entry_t *busy;
+    unsigned num_idle;
+    unsigned max_idle;
+    unsigned hits;
+    unsigned misses;
+#if HAVE_PTHREAD_H
+    pthread_mutex_t mutex;
+#endif
+};
+
+static
+void pool_lock(aacenc_pool_t *pool)
+{
+#if HAVE_PTHREAD_H
+    pthread_mutex_lock(&pool->mutex);
+#endif
+}
+
+static
+void pool_unlock(aacenc_pool_t *pool)
+{
+#if HAVE_PTHREAD_H
+    pthread_mutex_unlock(&pool->mutex);
+#endif
+}
+
+static
+void make_key(pool_key_t *key, const aacenc_param_t *params,
+              const pcm_sample_description_t *format)
+{
+    memset(key, 0, sizeof(pool_key_t));
+    memcpy(&key->params, params, sizeof(aacenc_param_t));
+    key->sample_rate = format->sample_rate;
+    key->channels = format->channels_per_frame;
+    key->channel_mask = format->channel_mask;
+}
+
+static
+void free_entries(pool_entry_t *entry)
+{
+    pool_entry_t *next;
+
+    for (; entry; entry = next) {
+        next = entry->next;
+        aacEncClose(&entry->encoder);
+        free(entry);
+    }
+}
+
+/*
+ * Unlinks the idle entry to be evicted: the least recently released one
+ * which has never been reused (except the one just released), or the least
+ * recently released one. Called with the lock held.
+ */
+static
+pool_entry_t *unlink_victim(aacenc_pool_t *pool)
+{
+    pool_entry_t *entry, **pp, **last = 0, **last_unused = 0;
+
+    for (pp = &pool->idle; (entry = *pp) != 0; pp = &entry->next) {
+        last = pp;
+        if (!entry->reused && entry != pool->idle)
+            last_unused = pp;
+    }
+    if (last_unused)
+        last = last_unused;
+    if (!last)
+        return 0;
+    entry = *last;
+    *last = entry->next;
+    entry->next = 0;
+    --pool->num_idle;
+    return entry;
+}
+
+aacenc_pool_t *aacenc_pool_create(unsigned max_idle)
+{
+    aacenc_pool_t *pool;
+
+    if ((pool = calloc(1, sizeof(aacenc_pool_t))) == 0)
+        return 0;
+    pool->max_idle = max_idle;
+#if HAVE_PTHREAD_H
+    pthread_mutex_init(&pool->mutex, 0);
+#endif
+    return pool;
+}
+
+void aacenc_pool_teardown(aacenc_pool_t **pool)
+{
+    free_entries((*pool)->idle);
+    free_entries((*pool)->busy);
+#if HAVE_PTHREAD_H
+    pthread_mutex_destroy(&(*pool)->mutex);
+#endif
+    free(*pool);
+    *pool = 0;
+}
+
+int aacenc_pool_acquire(aacenc_pool_t *pool, HANDLE_AACENCODER *encoder,
+                        const aacenc_param_t *params,
+                        const pcm_sample_description_t *format,
+                        AACENC_InfoStruct *info)
+{
+    pool_key_t key;
+    pool_entry_t *entry, **pp;
+
+    make_key(&key, params, format);
+
+    pool_lock(pool);
+    for (pp = &pool->idle; (entry = *pp) != 0; pp = &entry->next) {
+        if (!memcmp(&entry->key, &key, sizeof(pool_key_t))) {
+            *pp = entry->next;
+            --pool->num_idle;
+            break;
+        }
+    }
+    if (entry) {
+        ++entry->reused;
+        ++pool->hits;
+    } else
+        ++pool->misses;
+    pool_unlock(pool);
+
+    if (entry && aacenc_reset(entry->encoder, info) < 0) {
+        aacEncClose(&entry->encoder);
+        free(entry);
+        entry = 0;
+    }
+    if (!entry) {
+        if ((entry = calloc(1, sizeof(pool_entry_t))) == 0)
+            return -1;
+        memcpy(&entry->key, &key, sizeof(pool_key_t));
+        if (aacenc_init(&entry->encoder, params, format, info) < 0) {
+            free(entry);
+            return -1;
+        }
+    }
+    pool_lock(pool);
+    entry->next = pool->busy;
+    pool->busy = entry;
+    pool_unlock(pool);
+
+    *encoder = entry->encoder;
+    return 0;
+}
+
+void aacenc_pool_release(aacenc_pool_t *pool, HANDLE_AACENCODER encoder)
+{
+    pool_entry_t *entry, **pp, *victim = 0;
+
+    pool_lock(pool);
+    for (pp = &pool->busy; (entry = *pp) != 0; pp = &entry->next) {
+        if (entry->encoder == encoder) {
+            *pp = entry->next;
+            entry->next = pool->idle;
+            pool->idle = entry;
+            if (++pool->num_idle > pool->max_idle)
+                victim = unlink_victim(pool);
+            break;
+        }
+    }
+    pool_unlock(pool);
+    if (!entry)
+        aacEncClose(&encoder);
+    free_entries(victim);
+}
+
+void aacenc_pool_get_stats(aacenc_pool_t *pool, unsigned *hits,
+                           unsigned *misses)
+{
+    pool_lock(pool);
+    *hits = pool->hits;
+    *misses = pool->misses;
+    pool_unlock(pool);
+}
@@ -0,0 +1,35 @@
+/* 
+ * Copyright (C) 2013 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#ifndef ENCODER_POOL_H
+#define ENCODER_POOL_H
+
+#include "aacenc.h"
+
+/*
+ * Keeps initialized encoders for reuse.
+ * Encoders are keyed by aacenc_param_t and PCM format, and are reset by
+ * AACENC_INIT_ALL when reused. Thread safe.
+ * At most max_idle encoders are kept while not in use. When more are
+ * released, the least recently released one that has never been reused
+ * is closed, or the least recently released one if all have been reused.
+ */
+typedef struct aacenc_pool_t aacenc_pool_t;
+
+aacenc_pool_t *aacenc_pool_create(unsigned max_idle);
+
+void aacenc_pool_teardown(aacenc_pool_t **pool);
+
+/* same as aacenc_init(), but returns pooled one when available */
+int aacenc_pool_acquire(aacenc_pool_t *pool, HANDLE_AACENCODER *encoder,
+                        const aacenc_param_t *params,
+                        const pcm_sample_description_t *format,
+                        AACENC_InfoStruct *info);
+
+void aacenc_pool_release(aacenc_pool_t *pool, HANDLE_AACENCODER encoder);
+
+void aacenc_pool_get_stats(aacenc_pool_t *pool, unsigned *hits,
+                           unsigned *misses);
+
+#endif
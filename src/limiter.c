@@ -74,13 +74,15 @@ static int read_frames(pcm_reader_t *reader, void *buffer, unsigned nframes)
     size_t bytes = nframes * pcm_get_format(self->src)->bytes_per_frame;
     buffer_t *ibp = &self->buffers[nch];
     float *obp = buffer;
+    const void *input;
 
     do {
         if (reserve_buffer(ibp, bytes, 1) < 0)
            return -1;
-        res = pcm_read_frames(self->src, ibp->data, nframes);
+        res = pcm_acquire_frames(self->src, &input, ibp->data, nframes);
         for (n = 0; n < nch; ++n) {
-            float *ip = (float *)ibp->data, *x;
+            const float *ip = input;
+            float *x;
             buffer_t *bp = &self->buffers[n];
             unsigned end, limit;
             if (reserve_buffer(bp, bp->count + res, sizeof(float)) < 0)
@@ -103,14 +105,18 @@ static int read_frames(pcm_reader_t *reader, void *buffer, unsigned nframes)
                         break;
                 if (peak_pos == limit)
                     break;
+                /*
+                 * Half-wave is delimited by zero or sign change, so that
+                 * it never spans the limit, and the result doesn't depend
+                 * on how the input is split into reads.
+                 */
                 start = peak_pos;
                 peak = fabs(x[peak_pos]);
-                while (start > bp->head && x[peak_pos] * x[start] >= 0.0f)
+                while (start > bp->head && x[peak_pos] * x[start - 1] > 0.0f)
                     --start;
-                ++start;
                 for (end = peak_pos + 1; end < limit; ++end) {
                     float y;
-                    if (x[peak_pos] * x[end] < 0.0f)
+                    if (x[peak_pos] * x[end] <= 0.0f)
                         break;
                     y = fabs(x[end]);
                     if (y > peak) {
@@ -134,6 +140,7 @@ static int read_frames(pcm_reader_t *reader, void *buffer, unsigned nframes)
             }
             bp->head = limit;
         }
+        pcm_release_frames(self->src);
         res = nframes;
         for (n = 0; n < nch; ++n)
             if (self->buffers[n].head < res)
@@ -24,13 +24,38 @@
 #define m4af_realloc(memory,size) realloc(memory, size)
 #define m4af_free(memory) free(memory)
 #define m4af_max(a,b) ((a)<(b)?(b):(a))
+#define m4af_min(a,b) ((a)<(b)?(a):(b))
 
 #define M4AF_ATOM_WILD  0xffffffff
 
-typedef struct m4af_sample_entry_t {
-    uint32_t size;
+/* added to the estimated size of moov when reserving space for it */
+#define M4AF_MOOV_MARGIN 1024
+
+/*
+ * Sample sizes are kept in blocks of M4AF_SIZE_BLOCK_SAMPLES, which hold
+ * 16 bit sizes until a larger sample comes in. Blocks are allocated one by
+ * one instead of growing a table by realloc(), and are kept for reuse when
+ * the table is emptied for the next fragment.
+ * Durations are kept as runs of the same value, which is mostly a single
+ * run since AAC frames have fixed length.
+ */
+#define M4AF_SIZE_BLOCK_SAMPLES 8192
+
+typedef struct m4af_size_block_t {
+    uint16_t *size16;
+    uint32_t *size32;   /* replaces size16 when widened */
+} m4af_size_block_t;
+
+typedef struct m4af_delta_run_t {
+    uint32_t count;
     uint32_t delta;
-} m4af_sample_entry_t;
+} m4af_delta_run_t;
+
+/* position in delta runs, to visit samples in order */
+typedef struct m4af_delta_cursor_t {
+    uint32_t run;
+    uint32_t pos;       /* in the run */
+} m4af_delta_cursor_t;
 
 typedef struct m4af_chunk_entry_t {
     int64_t offset;
@@ -62,11 +87,24 @@ typedef struct m4af_track_t {
     uint32_t bufferSizeDB;
     uint32_t maxBitrate;
     uint32_t avgBitrate;
+    uint32_t bitrate_hint;      /* for fragmented moov */
+    uint32_t max_frame_size;
     int is_vbr;
+    uint32_t expected_samples;
 
-    m4af_sample_entry_t *sample_table;
     uint32_t num_samples;
-    uint32_t sample_table_capacity;
+    m4af_size_block_t *size_blocks;
+    uint32_t num_size_blocks;   /* allocated ones */
+    uint32_t size_blocks_capacity;
+    m4af_delta_run_t *delta_runs;
+    uint32_t num_delta_runs;
+    uint32_t delta_runs_capacity;
+
+    /* last one second of samples, for maxBitrate */
+    uint32_t window_start;      /* index of the first sample */
+    m4af_delta_cursor_t window_cursor;
+    uint32_t window_size;
+    uint32_t window_duration;
 
     m4af_chunk_entry_t *chunk_table;
     uint32_t num_chunks;
@@ -82,6 +120,10 @@ typedef struct m4af_track_t {
 
     uint64_t stts_pos;
     uint64_t stts_size;
+
+    /* fragmented */
+    int64_t fragment_start;     /* decode time of the fragment */
+    int64_t data_offset_pos;    /* temporary, to patch trun */
 } m4af_track_t;
 
 struct m4af_ctx_t {
@@ -92,6 +134,10 @@ struct m4af_ctx_t {
     int64_t mdat_size;
     int priming_mode;
     int last_error;
+    m4af_moov_stats_t moov_stats;
+    uint32_t fragment_duration; /* in ms, 0 when not fragmented */
+    m4af_fragment_callback fragment_callback;
+    void *fragment_cookie;
 
     m4af_itmf_entry_t *itmf_table;
     uint32_t num_tags;
@@ -100,8 +146,15 @@ struct m4af_ctx_t {
     m4af_io_callbacks_t io;
     void *io_cookie;
 
+    /* while spooling, io is the spool and these are the output */
+    m4af_io_callbacks_t output_io;
+    void *output_cookie;
+    m4af_io_callbacks_t spool_io;
+    void *spool_cookie;
+    m4af_copy_callback spool_copy;
+
     uint16_t num_tracks;
-    m4af_track_t track[2];
+    m4af_track_t *track;
 
     m4af_itmf_entry_t current_tag;
 };
@@ -158,6 +211,54 @@ uint32_t m4af_roundup(uint32_t n)
     return n;
 }
 
+/* growable memory sink, used to build moov in one piece */
+typedef struct m4af_membuf_t {
+    uint8_t *data;
+    uint32_t size;
+    uint32_t capacity;
+    uint32_t pos;
+} m4af_membuf_t;
+
+static
+int m4af_write_membuf_cb(void *cookie, const void *data, uint32_t size)
+{
+    m4af_membuf_t *buf = cookie;
+
+    if (buf->pos + size > buf->capacity) {
+        uint32_t capacity = m4af_roundup(buf->pos + size);
+        uint8_t *p;
+        if (capacity < 4096)
+            capacity = 4096;
+        if ((p = m4af_realloc(buf->data, capacity)) == 0)
+            return -1;
+        buf->data = p;
+        buf->capacity = capacity;
+    }
+    memcpy(buf->data + buf->pos, data, size);
+    buf->pos += size;
+    if (buf->size < buf->pos)
+        buf->size = buf->pos;
+    return 0;
+}
+static
+int m4af_seek_membuf_cb(void *cookie, int64_t off, int whence)
+{
+    m4af_membuf_t *buf = cookie;
+    if (off < 0 || off > buf->size)
+        return -1;
+    buf->pos = off; /* XXX: we use only SEEK_SET */
+    return 0;
+}
+static
+int64_t m4af_tell_membuf_cb(void *cookie)
+{
+    return ((m4af_membuf_t*)cookie)->pos;
+}
+
+static m4af_io_callbacks_t m4af_membuf_io_callbacks = {
+    0, m4af_write_membuf_cb, m4af_seek_membuf_cb, m4af_tell_membuf_cb
+};
+
 static
 int64_t m4af_tell(m4af_ctx_t *ctx)
 {
@@ -222,6 +323,43 @@ void m4af_write32_at(m4af_ctx_t *ctx, int64_t pos, uint32_t value)
     m4af_set_pos(ctx, current_pos);
 }
 
+/*
+ * For sample tables: entries are converted to big endian in a batch, and
+ * written by a single call.
+ */
+typedef struct m4af_batch_t {
+    uint8_t data[4096];
+    uint32_t size;
+} m4af_batch_t;
+
+static
+void m4af_batch_flush(m4af_ctx_t *ctx, m4af_batch_t *batch)
+{
+    if (batch->size)
+        m4af_write(ctx, batch->data, batch->size);
+    batch->size = 0;
+}
+
+static
+void m4af_batch_put32(m4af_ctx_t *ctx, m4af_batch_t *batch, uint32_t data)
+{
+    if (batch->size + 4 > sizeof(batch->data))
+        m4af_batch_flush(ctx, batch);
+    data = m4af_htob32(data);
+    memcpy(batch->data + batch->size, &data, 4);
+    batch->size += 4;
+}
+
+static
+void m4af_batch_put64(m4af_ctx_t *ctx, m4af_batch_t *batch, uint64_t data)
+{
+    if (batch->size + 8 > sizeof(batch->data))
+        m4af_batch_flush(ctx, batch);
+    data = m4af_htob64(data);
+    memcpy(batch->data + batch->size, &data, 8);
+    batch->size += 8;
+}
+
 m4af_ctx_t *m4af_create(uint32_t codec, uint32_t timescale,
                         m4af_io_callbacks_t *io, void *io_cookie, int no_timestamp)
 {
@@ -240,15 +378,35 @@ m4af_ctx_t *m4af_create(uint32_t codec, uint32_t timescale,
     timestamp = no_timestamp ? 0 : m4af_timestamp();
     ctx->creation_time = timestamp;
     ctx->modification_time = timestamp;
-    ctx->num_tracks = 1;
-    ctx->track[0].codec = codec;
-    ctx->track[0].timescale = timescale;
-    ctx->track[0].creation_time = timestamp;
-    ctx->track[0].modification_time = timestamp;
-    ctx->track[0].num_channels = 2;
+    if (m4af_add_track(ctx, codec, timescale) < 0) {
+        m4af_free(ctx);
+        return 0;
+    }
     return ctx;
 }
 
+int m4af_add_track(m4af_ctx_t *ctx, uint32_t codec, uint32_t timescale)
+{
+    m4af_track_t *track;
+
+    if (codec != M4AF_FOURCC('m','p','4','a') &&
+        codec != M4AF_FOURCC('a','l','a','c'))
+        return M4AF_NOT_SUPPORTED;
+    track = m4af_realloc(ctx->track,
+                         (ctx->num_tracks + 1) * sizeof(m4af_track_t));
+    if (!track)
+        return ctx->last_error = M4AF_NO_MEMORY;
+    ctx->track = track;
+    track += ctx->num_tracks;
+    memset(track, 0, sizeof(m4af_track_t));
+    track->codec = codec;
+    track->timescale = timescale;
+    track->creation_time = ctx->creation_time;
+    track->modification_time = ctx->modification_time;
+    track->num_channels = 2;
+    return ctx->num_tracks++;
+}
+
 static
 void m4af_free_itmf_table(m4af_ctx_t *ctx)
 {
@@ -266,10 +424,17 @@ static
 void m4af_clear_track(m4af_ctx_t *ctx, int track_idx)
 {
     m4af_track_t *track = ctx->track + track_idx;
+    uint32_t i;
     if (track->decSpecificInfo)
         m4af_free(track->decSpecificInfo);
-    if (track->sample_table)
-        m4af_free(track->sample_table);
+    for (i = 0; i < track->num_size_blocks; ++i) {
+        m4af_free(track->size_blocks[i].size16);
+        m4af_free(track->size_blocks[i].size32);
+    }
+    if (track->size_blocks)
+        m4af_free(track->size_blocks);
+    if (track->delta_runs)
+        m4af_free(track->delta_runs);
     if (track->chunk_table)
         m4af_free(track->chunk_table);
     if (track->chunk_buffer)
@@ -283,6 +448,8 @@ void m4af_teardown(m4af_ctx_t **ctxp)
     m4af_ctx_t *ctx = *ctxp;
     for (i = 0; i < ctx->num_tracks; ++i)
         m4af_clear_track(ctx, i);
+    if (ctx->track)
+        m4af_free(ctx->track);
     if (ctx->itmf_table)
         m4af_free_itmf_table(ctx);
     m4af_free(ctx);
@@ -326,6 +493,14 @@ void m4af_set_vbr_mode(m4af_ctx_t *ctx, uint32_t track_idx, int is_vbr)
     track->is_vbr = is_vbr;
 }
 
+void m4af_set_bitrate_hint(m4af_ctx_t *ctx, uint32_t track_idx,
+                           uint32_t bitrate, uint32_t max_frame_size)
+{
+    m4af_track_t *track = &ctx->track[track_idx];
+    track->bitrate_hint = bitrate;
+    track->max_frame_size = max_frame_size;
+}
+
 void m4af_set_priming(m4af_ctx_t *ctx, uint32_t track_idx,
                       uint32_t encoder_delay, uint32_t padding)
 {
@@ -340,32 +515,138 @@ void m4af_set_priming_mode(m4af_ctx_t *ctx, int mode)
 }
 
 static
-int m4af_add_sample_entry(m4af_ctx_t *ctx, uint32_t track_idx,
-                          uint32_t size, uint32_t delta)
+uint32_t m4af_get_sample_size(m4af_track_t *track, uint32_t i)
 {
-    m4af_track_t *track = &ctx->track[track_idx];
-    m4af_sample_entry_t *entry;
+    m4af_size_block_t *block = track->size_blocks;
+    block += i / M4AF_SIZE_BLOCK_SAMPLES;
+    i %= M4AF_SIZE_BLOCK_SAMPLES;
+    return block->size16 ? block->size16[i] : block->size32[i];
+}
 
-    if (ctx->last_error)
+/* returns the duration of the sample at the cursor, and moves to the next */
+static
+uint32_t m4af_next_delta(m4af_track_t *track, m4af_delta_cursor_t *cursor)
+{
+    m4af_delta_run_t *run = &track->delta_runs[cursor->run];
+    if (++cursor->pos == run->count) {
+        ++cursor->run;
+        cursor->pos = 0;
+    }
+    return run->delta;
+}
+
+static
+int m4af_widen_size_block(m4af_ctx_t *ctx, m4af_size_block_t *block)
+{
+    uint32_t i;
+    block->size32 = m4af_realloc(0, M4AF_SIZE_BLOCK_SAMPLES * 4);
+    if (block->size32 == 0) {
+        ctx->last_error = M4AF_NO_MEMORY;
+        return -1;
+    }
+    for (i = 0; i < M4AF_SIZE_BLOCK_SAMPLES; ++i)
+        block->size32[i] = block->size16[i];
+    m4af_free(block->size16);
+    block->size16 = 0;
+    return 0;
+}
+
+static
+int m4af_add_sample_size(m4af_ctx_t *ctx, uint32_t track_idx, uint32_t size)
+{
+    m4af_track_t *track = &ctx->track[track_idx];
+    m4af_size_block_t *block;
+    uint32_t n = track->num_samples / M4AF_SIZE_BLOCK_SAMPLES;
+    uint32_t i = track->num_samples % M4AF_SIZE_BLOCK_SAMPLES;
+
+    if (n == track->num_size_blocks) {
+        if (n == track->size_blocks_capacity) {
+            uint32_t new_size = track->size_blocks_capacity;
+            new_size = new_size ? new_size * 2 : 1;
+            block = m4af_realloc(track->size_blocks,
+                                 new_size * sizeof(*block));
+            if (block == 0) {
+                ctx->last_error = M4AF_NO_MEMORY;
+                return -1;
+            }
+            track->size_blocks = block;
+            track->size_blocks_capacity = new_size;
+        }
+        block = &track->size_blocks[n];
+        block->size32 = 0;
+        block->size16 = m4af_realloc(0, M4AF_SIZE_BLOCK_SAMPLES * 2);
+        if (block->size16 == 0) {
+            ctx->last_error = M4AF_NO_MEMORY;
+            return -1;
+        }
+        ++track->num_size_blocks;
+    }
+    block = &track->size_blocks[n];
+    if (block->size16 && size > 0xffff &&
+        m4af_widen_size_block(ctx, block) < 0)
         return -1;
-    if (track->num_samples == track->sample_table_capacity) {
-        uint32_t new_size = track->sample_table_capacity;
+    if (block->size16)
+        block->size16[i] = size;
+    else
+        block->size32[i] = size;
+    return 0;
+}
+
+static
+int m4af_add_sample_delta(m4af_ctx_t *ctx, uint32_t track_idx,
+                          uint32_t delta)
+{
+    m4af_track_t *track = &ctx->track[track_idx];
+    m4af_delta_run_t *run;
+
+    if (track->num_delta_runs) {
+        run = &track->delta_runs[track->num_delta_runs - 1];
+        if (run->delta == delta) {
+            ++run->count;
+            return 0;
+        }
+    }
+    if (track->num_delta_runs == track->delta_runs_capacity) {
+        uint32_t new_size = track->delta_runs_capacity;
         new_size = new_size ? new_size * 2 : 1;
-        entry = m4af_realloc(track->sample_table, new_size * sizeof(*entry));
-        if (entry == 0) {
+        run = m4af_realloc(track->delta_runs, new_size * sizeof(*run));
+        if (run == 0) {
             ctx->last_error = M4AF_NO_MEMORY;
             return -1;
         }
-        track->sample_table = entry;
-        track->sample_table_capacity = new_size;
+        track->delta_runs = run;
+        track->delta_runs_capacity = new_size;
     }
-    entry = track->sample_table + track->num_samples;
-    entry->size = size;
-    entry->delta = delta;
+    run = &track->delta_runs[track->num_delta_runs++];
+    run->count = 1;
+    run->delta = delta;
+    return 0;
+}
+
+static
+int m4af_add_sample_entry(m4af_ctx_t *ctx, uint32_t track_idx,
+                          uint32_t size, uint32_t delta)
+{
+    m4af_track_t *track = &ctx->track[track_idx];
+
+    if (ctx->last_error)
+        return -1;
+    if (m4af_add_sample_size(ctx, track_idx, size) < 0 ||
+        m4af_add_sample_delta(ctx, track_idx, delta) < 0)
+        return -1;
     ++track->num_samples;
     return 0;
 }
 
+/* empties the table for the next fragment, keeping size blocks allocated */
+static
+void m4af_clear_sample_entries(m4af_ctx_t *ctx, uint32_t track_idx)
+{
+    m4af_track_t *track = &ctx->track[track_idx];
+    track->num_samples = 0;
+    track->num_delta_runs = 0;
+}
+
 static
 int m4af_flush_chunk(m4af_ctx_t *ctx, uint32_t track_idx)
 {
@@ -431,18 +712,34 @@ int m4af_update_chunk_table(m4af_ctx_t *ctx, uint32_t track_idx,
     return 0;
 }
 
+/*
+ * The window is the shortest run of the latest samples lasting one second
+ * or more (or all of them when shorter), which is slid forward as samples
+ * are added.
+ */
 static
-void m4af_update_max_bitrate(m4af_ctx_t *ctx, uint32_t track_idx)
+void m4af_update_max_bitrate(m4af_ctx_t *ctx, uint32_t track_idx,
+                             uint32_t size, uint32_t delta)
 {
     m4af_track_t *track = &ctx->track[track_idx];
-    uint32_t duration = 0, size = 0, bitrate;
-    m4af_sample_entry_t *ent = track->sample_table + track->num_samples - 1;
+    uint32_t bitrate;
 
-    for (; ent >= track->sample_table && duration < track->timescale; --ent) {
-        duration += ent->delta;
-        size += ent->size;
+    if (ctx->last_error)
+        return;
+    track->window_size += size;
+    track->window_duration += delta;
+    while (track->window_start < track->num_samples - 1) {
+        delta = track->delta_runs[track->window_cursor.run].delta;
+        if (track->window_duration - delta < track->timescale)
+            break;
+        track->window_size -= m4af_get_sample_size(track,
+                                                   track->window_start);
+        track->window_duration -= delta;
+        m4af_next_delta(track, &track->window_cursor);
+        ++track->window_start;
     }
-    bitrate = (uint32_t)(size * 8.0 * track->timescale / duration + .5);
+    bitrate = (uint32_t)(track->window_size * 8.0 * track->timescale /
+                         track->window_duration + .5);
     if (bitrate > track->maxBitrate)
         track->maxBitrate = bitrate;
 }
@@ -471,18 +768,31 @@ int m4af_append_sample_to_chunk(m4af_ctx_t *ctx, uint32_t track_idx,
     return 0;
 }
 
+static void m4af_flush_fragment(m4af_ctx_t *ctx);
+
 int m4af_write_sample(m4af_ctx_t *ctx, uint32_t track_idx, const void *data,
                       uint32_t size, uint32_t duration)
 {
     m4af_track_t *track = &ctx->track[track_idx];
     if (track->frame_duration)
         duration = track->frame_duration;
+    if (ctx->fragment_duration) {
+        /* samples are kept only until the fragment is full */
+        if (track->num_samples &&
+            (track->duration - track->fragment_start + duration) * 1000 >
+            (int64_t)ctx->fragment_duration * track->timescale)
+            m4af_flush_fragment(ctx);
+        track->duration += duration;
+        m4af_add_sample_entry(ctx, track_idx, size, duration);
+        m4af_append_sample_to_chunk(ctx, track_idx, data, size);
+        return ctx->last_error;
+    }
     if (size > track->bufferSizeDB)
         track->bufferSizeDB = size;
     track->duration += duration;
     m4af_add_sample_entry(ctx, track_idx, size, duration);
     m4af_update_chunk_table(ctx, track_idx, size, duration);
-    m4af_update_max_bitrate(ctx, track_idx);
+    m4af_update_max_bitrate(ctx, track_idx, size, duration);
     m4af_append_sample_to_chunk(ctx, track_idx, data, size);
     return ctx->last_error;
 }
@@ -669,7 +979,14 @@ void m4af_write_descriptor(m4af_ctx_t *ctx, uint32_t tag, uint32_t size)
 static
 void m4af_write_ftyp_box(m4af_ctx_t *ctx)
 {
-    m4af_write(ctx, "\0\0\0\040""ftypM4A \0\0\0\0M4A mp42isom\0\0\0\0", 32);
+    if (!ctx->fragment_duration)
+        m4af_write(ctx, "\0\0\0\040""ftypM4A \0\0\0\0M4A mp42isom\0\0\0\0",
+                   32);
+    else if (ctx->num_tracks == 1)
+        m4af_write(ctx, "\0\0\0\040""ftypM4A \0\0\0\0M4A iso6cmfcmp41", 32);
+    else
+        /* CMAF track file holds a single track */
+        m4af_write(ctx, "\0\0\0\040""ftypM4A \0\0\0\0M4A iso6isommp41", 32);
 }
 
 static
@@ -682,13 +999,69 @@ void m4af_write_free_box(m4af_ctx_t *ctx, uint32_t size)
         m4af_set_pos(ctx, pos + size + 8);
 }
 
-int m4af_begin_write(m4af_ctx_t *ctx)
+void m4af_set_expected_samples(m4af_ctx_t *ctx, uint32_t track_idx,
+                               uint32_t num_samples)
 {
-    m4af_write_ftyp_box(ctx);
-    m4af_write_free_box(ctx, 0);
-    m4af_write(ctx, "\0\0\0\0mdat", 8);
-    ctx->mdat_pos = m4af_tell(ctx);
-    return ctx->last_error;
+    ctx->track[track_idx].expected_samples = num_samples;
+}
+
+/*
+ * Upper bound of the size of moov, for the expected number of samples and
+ * the tags added so far. Returns 0 unless expected for all tracks.
+ */
+static
+uint32_t m4af_estimate_moov_size(m4af_ctx_t *ctx)
+{
+    uint64_t size = 8 + 120;   /* moov, mvhd (version 1) */
+    uint32_t i;
+
+    for (i = 0; i < ctx->num_tracks; ++i) {
+        m4af_track_t *track = &ctx->track[i];
+        uint64_t samples = track->expected_samples, chunks, stsc_entries;
+
+        if (!samples)
+            return 0;
+        /* see m4af_update_chunk_table() */
+        if (track->frame_duration) {
+            chunks = samples * track->frame_duration
+                   / m4af_max(track->timescale / 2, 1) + 2;
+            stsc_entries = 3;
+        } else
+            chunks = stsc_entries = samples;
+        if (chunks > samples)
+            chunks = samples;
+        if (stsc_entries > chunks)
+            stsc_entries = chunks;
+        /* boxes other than sample tables (<= 460 bytes) */
+        size += 512 + track->decSpecificInfoSize;
+        size += 16 + 8 * (track->frame_duration ? 1 : samples); /* stts */
+        size += 16 + 12 * stsc_entries;
+        size += 20 + 4 * samples;                               /* stsz */
+        size += 16 + 8 * chunks;                                /* co64 */
+    }
+    /* udta, meta, hdlr, ilst, and iTunSMPB added on finalize */
+    size += 61 + 256;
+    for (i = 0; i < ctx->num_tags; ++i) {
+        m4af_itmf_entry_t *entry = &ctx->itmf_table[i];
+        size += 8 + 16 + entry->data_size;
+        if (entry->fcc == M4AF_FOURCC('-','-','-','-'))
+            size += 28 + 12 + strlen(entry->name);
+    }
+    size += M4AF_MOOV_MARGIN;
+    return size > UINT32_MAX / 2 ? 0 : size;
+}
+
+void m4af_set_spool(m4af_ctx_t *ctx, m4af_io_callbacks_t *spool_io,
+                    void *spool_cookie, m4af_copy_callback copy)
+{
+    ctx->spool_io = *spool_io;
+    ctx->spool_cookie = spool_cookie;
+    ctx->spool_copy = copy;
+}
+
+void m4af_set_fragment_duration(m4af_ctx_t *ctx, uint32_t duration)
+{
+    ctx->fragment_duration = duration;
 }
 
 static
@@ -697,19 +1070,23 @@ void m4af_write_stco_box(m4af_ctx_t *ctx, uint32_t track_idx)
     m4af_track_t *track = &ctx->track[track_idx];
     uint32_t i;
     m4af_chunk_entry_t *index = track->chunk_table;
-    int is_co64 = index[track->num_chunks - 1].offset > 0xffffffff;
+    int is_co64 = track->num_chunks &&
+                  index[track->num_chunks - 1].offset > 0xffffffff;
     int64_t pos = m4af_tell(ctx);
+    m4af_batch_t batch;
 
     m4af_write32(ctx, 0); /* size */
     m4af_write(ctx, is_co64 ? "co64" : "stco", 4);
     m4af_write32(ctx, 0); /* version and flags */
     m4af_write32(ctx, track->num_chunks);
+    batch.size = 0;
     for (i = 0; i < track->num_chunks; ++i, ++index) {
         if (is_co64)
-            m4af_write64(ctx, index->offset);
+            m4af_batch_put64(ctx, &batch, index->offset);
         else
-            m4af_write32(ctx, index->offset);
+            m4af_batch_put32(ctx, &batch, index->offset);
     }
+    m4af_batch_flush(ctx, &batch);
     m4af_update_box_size(ctx, pos);
 }
 
@@ -717,9 +1094,9 @@ static
 void m4af_write_stsz_box(m4af_ctx_t *ctx, uint32_t track_idx)
 {
     m4af_track_t *track = &ctx->track[track_idx];
-    m4af_sample_entry_t *index = track->sample_table;
     uint32_t i;
     int64_t pos = m4af_tell(ctx);
+    m4af_batch_t batch;
     m4af_write(ctx,
                "\0\0\0\0"  /* size                     */
                "stsz"      /* type                     */
@@ -728,8 +1105,10 @@ void m4af_write_stsz_box(m4af_ctx_t *ctx, uint32_t track_idx)
                "\0\0\0\0"  /* sample_size: 0(variable) */
                , 16);
     m4af_write32(ctx, track->num_samples);
-    for (i = 0; i < track->num_samples; ++i, ++index)
-        m4af_write32(ctx, index->size);
+    batch.size = 0;
+    for (i = 0; i < track->num_samples; ++i)
+        m4af_batch_put32(ctx, &batch, m4af_get_sample_size(track, i));
+    m4af_batch_flush(ctx, &batch);
     m4af_update_box_size(ctx, pos);
 }
 
@@ -740,6 +1119,7 @@ void m4af_write_stsc_box(m4af_ctx_t *ctx, uint32_t track_idx)
     m4af_chunk_entry_t *index = track->chunk_table;
     uint32_t i, prev_samples_per_chunk = 0, entry_count = 0;
     int64_t pos = m4af_tell(ctx);
+    m4af_batch_t batch;
     m4af_write(ctx,
                "\0\0\0\0"  /* size        */
                "stsc"      /* type        */
@@ -748,15 +1128,17 @@ void m4af_write_stsc_box(m4af_ctx_t *ctx, uint32_t track_idx)
                "\0\0\0\0"  /* entry_count */
                , 16);
 
+    batch.size = 0;
     for (i = 0; i < track->num_chunks; ++i, ++index) {
         if (index->samples_per_chunk != prev_samples_per_chunk) {
             ++entry_count;
-            m4af_write32(ctx, i + 1);
-            m4af_write32(ctx, index->samples_per_chunk);
-            m4af_write32(ctx, 1); /* sample_description_index */
+            m4af_batch_put32(ctx, &batch, i + 1);
+            m4af_batch_put32(ctx, &batch, index->samples_per_chunk);
+            m4af_batch_put32(ctx, &batch, 1); /* sample_description_index */
             prev_samples_per_chunk = index->samples_per_chunk;
         }
     }
+    m4af_batch_flush(ctx, &batch);
     m4af_write32_at(ctx, pos + 12, entry_count);
     m4af_update_box_size(ctx, pos);
 }
@@ -765,9 +1147,10 @@ static
 void m4af_write_stts_box(m4af_ctx_t *ctx, uint32_t track_idx)
 {
     m4af_track_t *track = &ctx->track[track_idx];
-    m4af_sample_entry_t *index = track->sample_table;
-    uint32_t i, prev_delta = 0, entry_count = 0, sample_count = 0;
+    m4af_delta_run_t *run = track->delta_runs;
+    uint32_t i;
     int64_t pos = m4af_tell(ctx);
+    m4af_batch_t batch;
     m4af_write(ctx,
                "\0\0\0\0"  /* size        */
                "stts"      /* type        */
@@ -776,24 +1159,14 @@ void m4af_write_stts_box(m4af_ctx_t *ctx, uint32_t track_idx)
                "\0\0\0\0"  /* entry_count */
                , 16);
 
-    for (i = 0; i < track->num_samples; ++i, ++index) {
-        if (index->delta == prev_delta)
-            ++sample_count;
-        else {
-            ++entry_count;
-            if (sample_count) {
-                m4af_write32(ctx, sample_count);
-                m4af_write32(ctx, prev_delta);
-            }
-            prev_delta = index->delta;
-            sample_count = 1;
-        } 
-    }
-    if (sample_count) {
-        m4af_write32(ctx, sample_count);
-        m4af_write32(ctx, prev_delta);
+    /* runs of the same delta are exactly the entries */
+    batch.size = 0;
+    for (i = 0; i < track->num_delta_runs; ++i, ++run) {
+        m4af_batch_put32(ctx, &batch, run->count);
+        m4af_batch_put32(ctx, &batch, run->delta);
     }
-    m4af_write32_at(ctx, pos + 12, entry_count);
+    m4af_batch_flush(ctx, &batch);
+    m4af_write32_at(ctx, pos + 12, track->num_delta_runs);
     m4af_update_box_size(ctx, pos);
 }
 
@@ -802,6 +1175,21 @@ void m4af_write_esds_box(m4af_ctx_t *ctx, uint32_t track_idx)
 {
     m4af_track_t *track = &ctx->track[track_idx];
     int64_t pos = m4af_tell(ctx);
+    uint32_t buffer_size = track->bufferSizeDB;
+    uint32_t max_bitrate = track->maxBitrate;
+    uint32_t avg_bitrate = track->avgBitrate;
+
+    if (ctx->fragment_duration) {
+        /* no samples yet; upper bounds from m4af_set_bitrate_hint() */
+        buffer_size = track->max_frame_size;
+        avg_bitrate = track->bitrate_hint;
+        if (track->is_vbr || !track->bitrate_hint) {
+            if (track->frame_duration)
+                max_bitrate = 8.0 * track->max_frame_size * track->timescale
+                            / track->frame_duration + .5;
+        } else
+            max_bitrate = track->bitrate_hint + 8 * track->max_frame_size;
+    }
     m4af_write(ctx, "\0\0\0\0esds", 8);
     m4af_write32(ctx, 0); /* version + flags */
 
@@ -817,9 +1205,9 @@ void m4af_write_esds_box(m4af_ctx_t *ctx, uint32_t track_idx)
                          * reserved(1)  : 1
                          */
                , 2);
-    m4af_write24(ctx, track->bufferSizeDB);
-    m4af_write32(ctx, track->maxBitrate);
-    m4af_write32(ctx, track->is_vbr ? 0: track->avgBitrate);
+    m4af_write24(ctx, buffer_size);
+    m4af_write32(ctx, max_bitrate);
+    m4af_write32(ctx, track->is_vbr ? 0: avg_bitrate);
     /* DecoderSpecificInfo */
     m4af_write_descriptor(ctx, 5, track->decSpecificInfoSize);
     m4af_write(ctx, track->decSpecificInfo, track->decSpecificInfoSize);
@@ -927,7 +1315,9 @@ void m4af_write_stbl_box(m4af_ctx_t *ctx, uint32_t track_idx)
     m4af_write_stsd_box(ctx, track_idx);
     if ((ctx->priming_mode & M4AF_PRIMING_MODE_EDTS) &&
         (track->encoder_delay || track->padding)) {
-        m4af_write_sbgp_box(ctx, track_idx);
+        /* sbgp goes to each traf when fragmented */
+        if (!ctx->fragment_duration)
+            m4af_write_sbgp_box(ctx, track_idx);
         m4af_write_sgpd_box(ctx, track_idx);
     }
     m4af_write_stts_box(ctx, track_idx);
@@ -1071,6 +1461,9 @@ void m4af_write_elst_box(m4af_ctx_t *ctx, uint32_t track_idx)
     int64_t duration = track->duration - track->encoder_delay - track->padding;
     int64_t pos = m4af_tell(ctx);
     duration = (double)duration / track->timescale * ctx->timescale + .5;
+    /* unknown when fragmented, and 0 means the edit lasts to the end */
+    if (ctx->fragment_duration)
+        duration = 0;
     version  = (duration > UINT32_MAX);
 
     m4af_write(ctx, "\0\0\0\0elst", 8);
@@ -1107,12 +1500,20 @@ void m4af_write_tkhd_box(m4af_ctx_t *ctx, uint32_t track_idx)
     if (ctx->priming_mode & M4AF_PRIMING_MODE_EDTS)
         duration -= (track->encoder_delay + track->padding);
     duration = (double)duration / track->timescale * ctx->timescale + .5;
+    if (ctx->fragment_duration)
+        duration = 0;
     uint8_t version = (track->creation_time > UINT32_MAX ||
                        track->modification_time > UINT32_MAX ||
                        duration > UINT32_MAX);
+    /*
+     * Multiple audio tracks are treated as alternatives of each other
+     * (e.g. stereo and 5.1), and only the first one is enabled.
+     */
+    int is_alternate = ctx->num_tracks > 1;
     m4af_write(ctx, "\0\0\0\0tkhd", 8);
     m4af_write(ctx, &version, 1);
-    m4af_write(ctx, "\0\0\007", 3);  /* flags  */
+    /* flags: track_enabled(1), track_in_movie(2), track_in_preview(4) */
+    m4af_write24(ctx, track_idx ? 6 : 7);
     if (version) {
         m4af_write64(ctx, track->creation_time);
         m4af_write64(ctx, track->modification_time);
@@ -1132,7 +1533,9 @@ void m4af_write_tkhd_box(m4af_ctx_t *ctx, uint32_t track_idx)
                "\0\0\0\0"   /* reserved[0]      */
                "\0\0\0\0"   /* reserved[1]      */
                "\0\0"       /* layer            */
-               "\0\0"       /* alternate_group  */
+               , 10);
+    m4af_write16(ctx, is_alternate); /* alternate_group */
+    m4af_write(ctx,
                "\001\0"     /* volume: 1.0      */
                "\0\0"       /* reserved         */
                "\0\001\0\0" /* matrix[0]        */
@@ -1146,7 +1549,7 @@ void m4af_write_tkhd_box(m4af_ctx_t *ctx, uint32_t track_idx)
                "\100\0\0\0" /* matrix[8]        */
                "\0\0\0\0"   /* width            */
                "\0\0\0\0"   /* height           */
-               , 60);
+               , 48);
     m4af_update_box_size(ctx, pos);
 }
 
@@ -1326,7 +1729,34 @@ void m4af_write_udta_box(m4af_ctx_t *ctx)
 }
 
 static
-uint32_t m4af_write_moov_box(m4af_ctx_t *ctx)
+void m4af_write_trex_box(m4af_ctx_t *ctx, uint32_t track_idx)
+{
+    m4af_write(ctx,
+               "\0\0\0\040"  /* size: 32 */
+               "trex"        /* type     */
+               "\0"          /* version  */
+               "\0\0\0"      /* flags    */
+               , 12);
+    m4af_write32(ctx, track_idx + 1);
+    m4af_write32(ctx, 1); /* default_sample_description_index */
+    m4af_write32(ctx, ctx->track[track_idx].frame_duration);
+    m4af_write32(ctx, 0); /* default_sample_size */
+    m4af_write32(ctx, 0); /* default_sample_flags */
+}
+
+static
+void m4af_write_mvex_box(m4af_ctx_t *ctx)
+{
+    unsigned i;
+    int64_t pos = m4af_tell(ctx);
+    m4af_write(ctx, "\0\0\0\0mvex", 8);
+    for (i = 0; i < ctx->num_tracks; ++i)
+        m4af_write_trex_box(ctx, i);
+    m4af_update_box_size(ctx, pos);
+}
+
+static
+uint32_t m4af_build_moov_box(m4af_ctx_t *ctx)
 {
     unsigned i;
     int64_t pos = m4af_tell(ctx);
@@ -1334,11 +1764,222 @@ uint32_t m4af_write_moov_box(m4af_ctx_t *ctx)
     m4af_write_mvhd_box(ctx);
     for (i = 0; i < ctx->num_tracks; ++i)
         m4af_write_trak_box(ctx, i);
+    if (ctx->fragment_duration)
+        m4af_write_mvex_box(ctx);
     if (ctx->num_tags)
         m4af_write_udta_box(ctx);
     return m4af_update_box_size(ctx, pos);
 }
 
+/*
+ * moov is built in memory, where seeking back to fill in box sizes is
+ * cheap, and then written to the file by a single write.
+ */
+static
+uint32_t m4af_write_moov_box(m4af_ctx_t *ctx)
+{
+    m4af_membuf_t buf = { 0 };
+    m4af_io_callbacks_t io_reserve = ctx->io;
+    void *io_cookie_reserve = ctx->io_cookie;
+    int last_error = ctx->last_error;
+    uint32_t moov_size;
+
+    ctx->io = m4af_membuf_io_callbacks;
+    ctx->io_cookie = &buf;
+    ctx->last_error = 0;
+    moov_size = m4af_build_moov_box(ctx);
+    ctx->io = io_reserve;
+    ctx->io_cookie = io_cookie_reserve;
+    if (ctx->last_error)
+        ctx->last_error = last_error ? last_error : M4AF_NO_MEMORY;
+    else {
+        ctx->last_error = last_error;
+        m4af_write(ctx, buf.data, buf.size);
+    }
+    m4af_free(buf.data);
+    return moov_size;
+}
+
+static
+void m4af_write_styp_box(m4af_ctx_t *ctx)
+{
+    m4af_write(ctx, "\0\0\0\030""stypmsdh\0\0\0\0msdhcmfs", 24);
+}
+
+static
+void m4af_write_mfhd_box(m4af_ctx_t *ctx)
+{
+    m4af_write(ctx,
+               "\0\0\0\020"  /* size: 16 */
+               "mfhd"        /* type     */
+               "\0"          /* version  */
+               "\0\0\0"      /* flags    */
+               , 12);
+    m4af_write32(ctx, ctx->moov_stats.fragments); /* sequence_number */
+}
+
+static
+void m4af_write_tfhd_box(m4af_ctx_t *ctx, uint32_t track_idx)
+{
+    m4af_track_t *track = &ctx->track[track_idx];
+
+    m4af_write32(ctx, track->frame_duration ? 20 : 16);
+    m4af_write(ctx, "tfhd", 4);
+    /*
+     * flags: default-base-is-moof(0x20000),
+     *        default-sample-duration-present(8)
+     */
+    m4af_write32(ctx, 0x20000 | (track->frame_duration ? 8 : 0));
+    m4af_write32(ctx, track_idx + 1);
+    if (track->frame_duration)
+        m4af_write32(ctx, track->frame_duration);
+}
+
+static
+void m4af_write_tfdt_box(m4af_ctx_t *ctx, uint32_t track_idx)
+{
+    m4af_write(ctx,
+               "\0\0\0\024"  /* size: 20   */
+               "tfdt"        /* type       */
+               "\001"        /* version: 1 */
+               "\0\0\0"      /* flags      */
+               , 12);
+    m4af_write64(ctx, ctx->track[track_idx].fragment_start);
+}
+
+static
+void m4af_write_trun_box(m4af_ctx_t *ctx, uint32_t track_idx)
+{
+    m4af_track_t *track = &ctx->track[track_idx];
+    m4af_delta_cursor_t cursor = { 0 };
+    uint32_t i;
+    int64_t pos = m4af_tell(ctx);
+    m4af_batch_t batch;
+
+    m4af_write(ctx, "\0\0\0\0trun", 8);
+    /*
+     * flags: data-offset-present(1), sample-size-present(0x200),
+     *        sample-duration-present(0x100)
+     */
+    m4af_write32(ctx, 0x201 | (track->frame_duration ? 0 : 0x100));
+    m4af_write32(ctx, track->num_samples);
+    track->data_offset_pos = m4af_tell(ctx);
+    m4af_write32(ctx, 0);  /* data_offset, filled in later */
+    batch.size = 0;
+    for (i = 0; i < track->num_samples; ++i) {
+        if (!track->frame_duration)
+            m4af_batch_put32(ctx, &batch, m4af_next_delta(track, &cursor));
+        m4af_batch_put32(ctx, &batch, m4af_get_sample_size(track, i));
+    }
+    m4af_batch_flush(ctx, &batch);
+    m4af_update_box_size(ctx, pos);
+}
+
+static
+void m4af_write_traf_box(m4af_ctx_t *ctx, uint32_t track_idx)
+{
+    m4af_track_t *track = &ctx->track[track_idx];
+    int64_t pos = m4af_tell(ctx);
+    m4af_write(ctx, "\0\0\0\0traf", 8);
+    m4af_write_tfhd_box(ctx, track_idx);
+    m4af_write_tfdt_box(ctx, track_idx);
+    m4af_write_trun_box(ctx, track_idx);
+    /* same condition as sgpd in moov, where padding was not known yet */
+    if ((ctx->priming_mode & M4AF_PRIMING_MODE_EDTS) && track->encoder_delay)
+        m4af_write_sbgp_box(ctx, track_idx);
+    m4af_update_box_size(ctx, pos);
+}
+
+/*
+ * Writes moof for the samples kept on all tracks, and then mdat holding
+ * them. Like moov, moof is built in memory, where data_offset of each trun
+ * is filled in after the size of moof is known.
+ */
+static
+void m4af_write_fragment(m4af_ctx_t *ctx, uint32_t mdat_size)
+{
+    m4af_membuf_t buf = { 0 };
+    m4af_io_callbacks_t io_reserve = ctx->io;
+    void *io_cookie_reserve = ctx->io_cookie;
+    uint32_t i, data_offset;
+    int64_t pos;
+
+    ctx->io = m4af_membuf_io_callbacks;
+    ctx->io_cookie = &buf;
+    pos = m4af_tell(ctx);
+    m4af_write(ctx, "\0\0\0\0moof", 8);
+    m4af_write_mfhd_box(ctx);
+    for (i = 0; i < ctx->num_tracks; ++i)
+        if (ctx->track[i].num_samples)
+            m4af_write_traf_box(ctx, i);
+    data_offset = m4af_update_box_size(ctx, pos) + 8;
+    for (i = 0; i < ctx->num_tracks; ++i) {
+        m4af_track_t *track = &ctx->track[i];
+        if (track->num_samples) {
+            m4af_write32_at(ctx, track->data_offset_pos, data_offset);
+            data_offset += track->chunk_size;
+        }
+    }
+    ctx->io = io_reserve;
+    ctx->io_cookie = io_cookie_reserve;
+    if (ctx->last_error)
+        ctx->last_error = M4AF_NO_MEMORY;
+    else {
+        if (ctx->fragment_callback)
+            m4af_write_styp_box(ctx);
+        m4af_write(ctx, buf.data, buf.size);
+        m4af_write32(ctx, mdat_size);
+        m4af_write(ctx, "mdat", 4);
+        for (i = 0; i < ctx->num_tracks; ++i)
+            m4af_write(ctx, ctx->track[i].chunk_buffer,
+                       ctx->track[i].chunk_size);
+    }
+    m4af_free(buf.data);
+}
+
+/* writes a fragment if any samples are kept, and starts the next one */
+static
+void m4af_flush_fragment(m4af_ctx_t *ctx)
+{
+    m4af_track_t *track = ctx->track;
+    uint32_t i, mdat_size = 8;
+
+    for (i = 0; i < ctx->num_tracks; ++i)
+        mdat_size += ctx->track[i].chunk_size;
+    if (mdat_size == 8 || ctx->last_error)
+        return;
+    ++ctx->moov_stats.fragments;
+    if (ctx->fragment_callback &&
+        ctx->fragment_callback(ctx->fragment_cookie, ctx->moov_stats.fragments,
+                               track->fragment_start,
+                               track->duration - track->fragment_start) < 0)
+        ctx->last_error = M4AF_IO_ERROR;
+    else
+        m4af_write_fragment(ctx, mdat_size);
+    for (i = 0; i < ctx->num_tracks; ++i) {
+        track = &ctx->track[i];
+        track->chunk_size = 0;
+        m4af_clear_sample_entries(ctx, i);
+        track->fragment_start = track->duration;
+    }
+}
+
+static
+uint32_t m4af_measure_moov_box(m4af_ctx_t *ctx)
+{
+    int64_t pos = 0;
+    uint32_t moov_size;
+    m4af_io_callbacks_t io_reserve = ctx->io;
+    void *io_cookie_reserve = ctx->io_cookie;
+
+    ctx->io = m4af_null_io_callbacks;
+    ctx->io_cookie = &pos;
+    moov_size = m4af_build_moov_box(ctx);
+    ctx->io = io_reserve;
+    ctx->io_cookie = io_cookie_reserve;
+    return moov_size;
+}
+
 static
 void m4af_finalize_mdat(m4af_ctx_t *ctx)
 {
@@ -1369,14 +2010,14 @@ uint64_t m4af_patch_moov(m4af_ctx_t *ctx, uint32_t moov_size, uint32_t offset)
 
     ctx->io = m4af_null_io_callbacks;
     ctx->io_cookie = &pos;
-    moov_size2 = m4af_write_moov_box(ctx);
+    moov_size2 = m4af_build_moov_box(ctx);
 
     if (moov_size2 != moov_size) {
         /* stco -> co64 switching */
         for (i = 0; i < ctx->num_tracks; ++i)
             for (j = 0; j < ctx->track[i].num_chunks; ++j)
                 ctx->track[i].chunk_table[j].offset += moov_size2 - moov_size;
-        moov_size2 = m4af_write_moov_box(ctx);
+        moov_size2 = m4af_build_moov_box(ctx);
     }
     ctx->io = io_reserve;
     ctx->io_cookie = io_cookie_reserve;
@@ -1408,12 +2049,112 @@ void m4af_shift_mdat_pos(m4af_ctx_t *ctx, uint32_t offset)
     free(buf);
 }
 
+static
+void m4af_copy_spool(m4af_ctx_t *ctx)
+{
+    int64_t pos = 0;
+    uint32_t n;
+    char *buf = 0;
+
+    if (ctx->spool_copy &&
+        (pos = ctx->spool_copy(ctx->io_cookie, ctx->spool_cookie,
+                               0, ctx->mdat_size)) < 0) {
+        ctx->last_error = M4AF_IO_ERROR;
+        return;
+    }
+    if (pos == ctx->mdat_size)
+        return;
+    if ((buf = m4af_realloc(0, 1024*1024*2)) == 0) {
+        ctx->last_error = M4AF_NO_MEMORY;
+        return;
+    }
+    if (ctx->spool_io.seek(ctx->spool_cookie, pos, SEEK_SET) < 0)
+        ctx->last_error = M4AF_IO_ERROR;
+    for (; pos < ctx->mdat_size && !ctx->last_error; pos += n) {
+        n = m4af_min(ctx->mdat_size - pos, 1024*1024*2);
+        if (ctx->spool_io.read(ctx->spool_cookie, buf, n) != (int)n)
+            ctx->last_error = M4AF_IO_ERROR;
+        else
+            m4af_write(ctx, buf, n);
+    }
+    m4af_free(buf);
+}
+
+/*
+ * Writes ftyp, moov, and mdat header to the output, and then mdat payload
+ * from the spool after them.
+ */
+static
+void m4af_write_spooled(m4af_ctx_t *ctx)
+{
+    uint32_t moov_size;
+    uint32_t mdat_header_size = ctx->mdat_size + 8 > UINT32_MAX ? 16 : 8;
+
+    ctx->io = ctx->output_io;
+    ctx->io_cookie = ctx->output_cookie;
+    moov_size = m4af_measure_moov_box(ctx);
+    m4af_patch_moov(ctx, moov_size, 32 + moov_size + mdat_header_size);
+    m4af_write_ftyp_box(ctx);
+    ctx->moov_stats.size = m4af_write_moov_box(ctx);
+    if (mdat_header_size == 16) {
+        m4af_write32(ctx, 1);
+        m4af_write(ctx, "mdat", 4);
+        m4af_write64(ctx, ctx->mdat_size + 16);
+    } else {
+        m4af_write32(ctx, ctx->mdat_size + 8);
+        m4af_write(ctx, "mdat", 4);
+    }
+    if (!ctx->last_error)
+        m4af_copy_spool(ctx);
+    ctx->moov_stats.placement = M4AF_MOOV_SPOOLED;
+}
+
+void m4af_set_fragment_callback(m4af_ctx_t *ctx,
+                                m4af_fragment_callback callback,
+                                void *cookie)
+{
+    ctx->fragment_callback = callback;
+    ctx->fragment_cookie = cookie;
+}
+
+int m4af_begin_write(m4af_ctx_t *ctx)
+{
+    if (ctx->fragment_duration) {
+        /* iTunSMPB needs the length, so edts is used instead */
+        ctx->priming_mode = M4AF_PRIMING_MODE_EDTS;
+        m4af_write_ftyp_box(ctx);
+        ctx->moov_stats.size = m4af_write_moov_box(ctx);
+        ctx->moov_stats.placement = M4AF_MOOV_FRAGMENTED;
+        return ctx->last_error;
+    }
+    if (ctx->spool_cookie) {
+        /* mdat payload starts at the beginning of the spool */
+        ctx->output_io = ctx->io;
+        ctx->output_cookie = ctx->io_cookie;
+        ctx->io = ctx->spool_io;
+        ctx->io_cookie = ctx->spool_cookie;
+        ctx->mdat_pos = 0;
+        return ctx->last_error;
+    }
+    m4af_write_ftyp_box(ctx);
+    ctx->moov_stats.reserved = m4af_estimate_moov_size(ctx);
+    m4af_write_free_box(ctx, ctx->moov_stats.reserved);
+    m4af_write(ctx, "\0\0\0\0mdat", 8);
+    ctx->mdat_pos = m4af_tell(ctx);
+    return ctx->last_error;
+}
+
 int m4af_finalize(m4af_ctx_t *ctx, int optimize)
 {
     unsigned i;
     m4af_track_t *track;
     uint32_t moov_size;
 
+    if (ctx->fragment_duration) {
+        m4af_flush_fragment(ctx);
+        return ctx->last_error;
+    }
+
     for (i = 0; i < ctx->num_tracks; ++i) {
         track = ctx->track + i;
         if (track->duration) {
@@ -1430,8 +2171,30 @@ int m4af_finalize(m4af_ctx_t *ctx, int optimize)
     if ((ctx->priming_mode & M4AF_PRIMING_MODE_ITUNSMPB) &&
         (track->encoder_delay || track->padding))
         m4af_set_iTunSMPB(ctx);
+    if (ctx->output_cookie) {
+        m4af_write_spooled(ctx);
+        return ctx->last_error;
+    }
     m4af_finalize_mdat(ctx);
+    if (optimize && ctx->moov_stats.reserved) {
+        /*
+         * Reserved space is the free box including its header. moov must
+         * fill it up exactly, or leave room for another free box.
+         */
+        uint32_t space = ctx->moov_stats.reserved + 8;
+        moov_size = m4af_measure_moov_box(ctx);
+        ctx->moov_stats.size = moov_size;
+        if (moov_size == space || moov_size + 8 <= space) {
+            m4af_set_pos(ctx, 32);
+            m4af_write_moov_box(ctx);
+            if (moov_size < space)
+                m4af_write_free_box(ctx, space - moov_size - 8);
+            ctx->moov_stats.placement = M4AF_MOOV_IN_RESERVED;
+            return ctx->last_error;
+        }
+    }
     moov_size = m4af_write_moov_box(ctx);
+    ctx->moov_stats.size = moov_size;
     if (optimize) {
         int64_t pos;
         uint32_t moov_size2 = m4af_patch_moov(ctx, moov_size, moov_size + 1024);
@@ -1440,6 +2203,12 @@ int m4af_finalize(m4af_ctx_t *ctx, int optimize)
         m4af_write_moov_box(ctx);
         pos = m4af_tell(ctx);
         m4af_write_free_box(ctx, ctx->mdat_pos - pos - 24);
+        ctx->moov_stats.placement = M4AF_MOOV_SHIFTED;
     }
     return ctx->last_error;
 }
+
+void m4af_get_moov_stats(m4af_ctx_t *ctx, m4af_moov_stats_t *stats)
+{
+    *stats = ctx->moov_stats;
+}
@@ -52,6 +52,21 @@ enum m4af_codec_type {
     M4AF_CODEC_TEXT = M4AF_FOURCC('t','e','x','t'),
 };
 
+enum m4af_moov_placement {
+    M4AF_MOOV_AFTER_MDAT = 0,
+    M4AF_MOOV_IN_RESERVED = 1,  /* written into space reserved in advance */
+    M4AF_MOOV_SHIFTED = 2,      /* mdat was moved to make room for moov */
+    M4AF_MOOV_SPOOLED = 3,      /* mdat was copied from the spool */
+    M4AF_MOOV_FRAGMENTED = 4,   /* followed by moof and mdat fragments */
+};
+
+typedef struct m4af_moov_stats_t {
+    int placement;
+    uint32_t size;
+    uint32_t reserved;          /* 0 when nothing was reserved */
+    uint32_t fragments;
+} m4af_moov_stats_t;
+
 enum m4af_priming_mode {
     M4AF_PRIMING_MODE_ITUNSMPB = 1,
     M4AF_PRIMING_MODE_EDTS = 2,
@@ -63,6 +78,12 @@ typedef int (*m4af_write_callback)(void *cookie, const void *data,
                                    uint32_t size);
 typedef int (*m4af_seek_callback)(void *cookie, int64_t off, int whence);
 typedef int64_t (*m4af_tell_callback)(void *cookie);
+/* returns bytes copied, which can be short, or -1 on error */
+typedef int64_t (*m4af_copy_callback)(void *cookie, void *spool_cookie,
+                                      int64_t offset, int64_t size);
+
+typedef int (*m4af_fragment_callback)(void *cookie, uint32_t sequence,
+                                      int64_t start, int64_t duration);
 
 typedef struct m4af_io_callbacks_t {
     m4af_read_callback read;
@@ -77,10 +98,61 @@ typedef struct m4af_ctx_t m4af_ctx_t;
 m4af_ctx_t *m4af_create(uint32_t codec, uint32_t timescale,
                         m4af_io_callbacks_t *io, void *io_cookie, int no_timestamp);
 
+int m4af_add_track(m4af_ctx_t *ctx, uint32_t codec, uint32_t timescale);
+
 int m4af_begin_write(m4af_ctx_t *ctx);
 
+/*
+ * With optimize, moov is placed before mdat: either written into the space
+ * reserved by m4af_begin_write() (see m4af_set_expected_samples()), or
+ * mdat is moved when it doesn't fit.
+ */
 int m4af_finalize(m4af_ctx_t *ctx, int optimize);
 
+/*
+ * Upper bound of the number of samples of the track, given before
+ * m4af_begin_write(). When given for all tracks, space for moov is reserved
+ * before mdat, counting tags added so far.
+ */
+void m4af_set_expected_samples(m4af_ctx_t *ctx, uint32_t track_idx,
+                               uint32_t num_samples);
+
+/*
+ * Writes mdat to the spool instead of the output, given before
+ * m4af_begin_write(). m4af_finalize() then writes ftyp, moov and mdat to
+ * the output in this order without seeking, which works on pipes, and
+ * copies mdat from the spool by copy (when given) or by read and write.
+ * spool_io must support all of read, write, seek and tell.
+ */
+void m4af_set_spool(m4af_ctx_t *ctx, m4af_io_callbacks_t *spool_io,
+                    void *spool_cookie, m4af_copy_callback copy);
+
+/*
+ * Makes the file fragmented, given before m4af_begin_write(): moov without
+ * samples (and with mvex) is written by m4af_begin_write(), followed by
+ * moof and mdat for each duration (in milliseconds) of samples. The output
+ * is written sequentially, memory use is bounded by a fragment, and the
+ * file is playable up to the last fragment written whenever cut.
+ * iTunSMPB is not written, since the length is unknown on writing moov.
+ * edts is written instead regardless of the priming mode, with
+ * encoder_delay given by m4af_set_priming() before m4af_begin_write().
+ */
+void m4af_set_fragment_duration(m4af_ctx_t *ctx, uint32_t duration);
+
+/*
+ * Called before writing each fragment, with its sequence number (from 1),
+ * and decode time and duration of the first track in it. Meant for writing
+ * each fragment into a file of its own as a media segment, by switching
+ * where io writes to, and styp is written at the head of each fragment
+ * then. Returning -1 fails the write.
+ */
+void m4af_set_fragment_callback(m4af_ctx_t *ctx,
+                                m4af_fragment_callback callback,
+                                void *cookie);
+
+/* valid after m4af_finalize() */
+void m4af_get_moov_stats(m4af_ctx_t *ctx, m4af_moov_stats_t *stats);
+
 void m4af_teardown(m4af_ctx_t **ctx);
 
 int m4af_write_sample(m4af_ctx_t *ctx, uint32_t track_idx, const void *data,
@@ -91,6 +163,17 @@ int m4af_set_decoder_specific_info(m4af_ctx_t *ctx, uint32_t track_idx,
 
 void m4af_set_vbr_mode(m4af_ctx_t *ctx, uint32_t track_idx, int is_vbr);
 
+/*
+ * Configured bitrate (bits per second) and maximum size of a sample (bytes)
+ * of the track, given before m4af_begin_write(). Fragmented moov is
+ * written before any sample, and its esds is filled from these:
+ * bufferSizeDB is max_frame_size, and maxBitrate is bitrate plus a bit
+ * reservoir of max_frame_size for CBR, or max_frame_size in every sample
+ * for VBR. Otherwise, esds is computed from the samples written.
+ */
+void m4af_set_bitrate_hint(m4af_ctx_t *ctx, uint32_t track_idx,
+                           uint32_t bitrate, uint32_t max_frame_size);
+
 void m4af_set_priming(m4af_ctx_t *ctx, uint32_t track_idx,
                       uint32_t encoder_delay, uint32_t padding);
 
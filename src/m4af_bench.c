@@ -0,0 +1,166 @@
+/* 
+ * Copyright (C) 2013 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+/*
+ * Microbenchmark of m4af_write_sample(), writing to a null io.
+ * Compares the time per sample with walking back over the last one second
+ * of samples on every sample (as maxBitrate used to be computed), which
+ * gets slower as frames get shorter, such as AAC-ELD 480 at 96kHz.
+ *
+ * usage: m4af_bench [seconds]
+ */
+#if HAVE_CONFIG_H
+#  include "config.h"
+#endif
+#if HAVE_STDINT_H
+#  include <stdint.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "compat.h"
+#include "m4af.h"
+
+typedef struct null_io_t {
+    int64_t pos;
+    int64_t size;
+} null_io_t;
+
+static int null_read(void *cookie, void *data, uint32_t size)
+{
+    return -1;
+}
+
+static int null_write(void *cookie, const void *data, uint32_t size)
+{
+    null_io_t *io = cookie;
+    io->pos += size;
+    if (io->pos > io->size)
+        io->size = io->pos;
+    return 0;
+}
+
+static int null_seek(void *cookie, int64_t off, int whence)
+{
+    null_io_t *io = cookie;
+    switch (whence) {
+    case SEEK_SET: io->pos = off; break;
+    case SEEK_CUR: io->pos += off; break;
+    case SEEK_END: io->pos = io->size + off; break;
+    default: return -1;
+    }
+    return 0;
+}
+
+static int64_t null_tell(void *cookie)
+{
+    return ((null_io_t *)cookie)->pos;
+}
+
+static m4af_io_callbacks_t null_io_callbacks = {
+    null_read, null_write, null_seek, null_tell
+};
+
+static uint32_t frame_size(uint32_t i)
+{
+    /* varying sizes like VBR, same sequence on every run */
+    return 100 + (i * 2654435761u >> 24) % 400;
+}
+
+/* returns usec taken to mux num_frames frames */
+static int64_t bench_m4af(uint32_t rate, uint32_t frame_length,
+                          uint32_t num_frames)
+{
+    static uint8_t data[1024];
+    static uint8_t asc[] = { 0x12, 0x10 };
+    null_io_t io = { 0 };
+    m4af_ctx_t *m4af;
+    int64_t start;
+    uint32_t i;
+
+    m4af = m4af_create(M4AF_CODEC_MP4A, rate, &null_io_callbacks, &io, 1);
+    if (!m4af)
+        return -1;
+    m4af_set_decoder_specific_info(m4af, 0, asc, sizeof(asc));
+    m4af_set_num_channels(m4af, 0, 2);
+    m4af_set_fixed_frame_duration(m4af, 0, frame_length);
+    m4af_begin_write(m4af);
+    start = aacenc_timer_usec();
+    for (i = 0; i < num_frames; ++i)
+        m4af_write_sample(m4af, 0, data, frame_size(i), frame_length);
+    start = aacenc_timer_usec() - start;
+    m4af_finalize(m4af, 0);
+    m4af_teardown(&m4af);
+    return start;
+}
+
+/* time of walking back over one second on every frame, in usec */
+static int64_t bench_walk(uint32_t rate, uint32_t frame_length,
+                          uint32_t num_frames)
+{
+    uint32_t *sizes, i, max_bitrate = 0;
+    int64_t start;
+
+    if ((sizes = malloc(num_frames * sizeof(uint32_t))) == 0)
+        return -1;
+    start = aacenc_timer_usec();
+    for (i = 0; i < num_frames; ++i) {
+        uint32_t duration = 0, size = 0, bitrate, j = i + 1;
+
+        sizes[i] = frame_size(i);
+        while (j > 0 && duration < rate) {
+            duration += frame_length;
+            size += sizes[--j];
+        }
+        bitrate = (uint32_t)(size * 8.0 * rate / duration + .5);
+        if (bitrate > max_bitrate)
+            max_bitrate = bitrate;
+    }
+    start = aacenc_timer_usec() - start;
+    free(sizes);
+    /* keep the loop from being optimized out */
+    return max_bitrate ? start : start + 1;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct {
+        const char *name;
+        uint32_t rate;
+        uint32_t frame_length;
+    } cases[] = {
+        { "AAC-LC 1024 @ 44.1kHz", 44100, 1024 },
+        { "AAC-LD 512  @ 48kHz  ", 48000, 512 },
+        { "AAC-ELD 480 @ 96kHz  ", 96000, 480 },
+    };
+    unsigned seconds = 3600, i;
+
+    if (argc > 1 && (sscanf(argv[1], "%u", &seconds) != 1 || !seconds)) {
+        fprintf(stderr, "usage: m4af_bench [seconds]\n");
+        return 1;
+    }
+    printf("%u seconds per track, ns per frame\n", seconds);
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        uint64_t frames = (uint64_t)seconds * cases[i].rate
+                        / cases[i].frame_length;
+        int64_t m4af_usec, walk_usec;
+
+        if (frames > UINT32_MAX / sizeof(uint32_t)) {
+            fprintf(stderr, "ERROR: too long\n");
+            return 1;
+        }
+        m4af_usec = bench_m4af(cases[i].rate, cases[i].frame_length,
+                               frames);
+        walk_usec = bench_walk(cases[i].rate, cases[i].frame_length,
+                               frames);
+        if (m4af_usec < 0 || walk_usec < 0) {
+            fprintf(stderr, "ERROR: out of memory\n");
+            return 2;
+        }
+        printf("%s: m4af_write_sample %7.1f, walk back over 1s %7.1f\n",
+               cases[i].name, m4af_usec * 1000.0 / frames,
+               walk_usec * 1000.0 / frames);
+    }
+    return 0;
+}
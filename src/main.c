@@ -15,6 +15,8 @@
 #endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
 #include <string.h>
 #include <ctype.h>
 #include <locale.h>
@@ -39,9 +41,26 @@
 #include "progress.h"
 #include "version.h"
 #include "metadata.h"
+#include "encoder_pool.h"
+#include "session.h"
+#include "server.h"
+#include "uring_io.h"
+#include "packager.h"
+#include "mmap_output.h"
+#include "pipe_output.h"
+#include "throttle.h"
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #define PROGNAME "fdkaac"
 
+/* blocks of LADDER_BLOCK_FRAMES buffered for each tap of the fanout */
+#define FANOUT_DEPTH 64
+#define LADDER_BLOCK_FRAMES 4096
+#define MAX_RENDITIONS 16
+#define URING_DEPTH 4          /* blocks in flight per input/output */
+
 static volatile int g_interrupted = 0;
 
 #if HAVE_SIGACTION
@@ -108,7 +127,7 @@ void usage(void)
 {
     printf(
 PROGNAME " %s\n"
-"Usage: " PROGNAME " [options] input_file\n"
+"Usage: " PROGNAME " [options] input_file [input_file...]\n"
 "Options:\n"
 " -h, --help                    Print this help message\n"
 " -p, --profile <n>             Profile (audio object type)\n"
@@ -158,7 +177,59 @@ PROGNAME " %s\n"
 " -I, --ignorelength            Ignore length of WAV header\n"
 " -S, --silent                  Don't print progress messages\n"
 " --moov-before-mdat            Place moov box before mdat box on m4a output\n"
+" --fragment-duration <ms>      Write fragmented m4a (CMAF), made of moov\n"
+"                               and then moof+mdat for every n milliseconds\n"
+" --cmaf-segments <ms>          Write CMAF segments of about n milliseconds\n"
+"                               with HLS playlist <output>.m3u8 and DASH\n"
+"                               manifest <output>.mpd, instead of M4A\n"
 " --no-timestamp                Don't inject timestamp in the file\n"
+" --threads <n>                 Split input into segments and encode them\n"
+"                               in parallel using n threads.\n"
+"                               0 means number of CPUs (default: 1)\n"
+" --pipeline                    Run reading/decoding, encoding and writing\n"
+"                               on separate threads\n"
+" --block-size <n>              Number of PCM frames read from the input at\n"
+"                               a time (default: 16384). Values up to the\n"
+"                               AAC frame length read one frame at a time\n"
+" --low-latency                 Minimize delay for live streaming, and\n"
+"                               report the latency at the end. Meant for\n"
+"                               AAC-LD/ELD (-p 23/39) with ADTS/LOAS output\n"
+" --pipe-flush <n>              Number of frames gathered before handing\n"
+"                               ADTS/LATM output to a pipe (default: 16)\n"
+" --jobs <n>                    Encode multiple input files in parallel\n"
+"                               using n workers. 0 means number of CPUs\n"
+" --from-list <filename>        Read names of input files from a text file\n"
+"                               (one per line)\n"
+" --stats                       Print statistics at the end\n"
+" --ladder <spec>               Encode multiple renditions from one input\n"
+"                               pass. Spec is a comma separated list of\n"
+"                               [profile:]bitrate, such as \"29:32,2:128\".\n"
+"                               Renditions are written to <output>_<n>k.m4a\n"
+" --add-track <[profile:]bitrate[@filename]>\n"
+"                               Add an audio track to the M4A output.\n"
+"                               Can be specified multiple times. Input file\n"
+"                               is used when filename is omitted\n"
+" --serve <path>                Run as a daemon accepting jobs on a Unix\n"
+"                               domain socket. Options given on the command\n"
+"                               line are used as defaults for each job.\n"
+"                               Jobs are run on --jobs workers.\n"
+"                               Only the owner can connect (mode 0600)\n"
+" --segment <start:[end]>       Encode only the given range of input (in\n"
+"                               samples) for later --merge. Output is raw\n"
+"                               frames with <output>.json sidecar\n"
+" --merge                       Join segments given as input files into a\n"
+"                               gapless M4A file\n"
+" --io-uring                    Read input and write output asynchronously\n"
+"                               using io_uring (Linux only), keeping\n"
+"                               several blocks of 1MB in flight\n"
+" --prefetch <n>                Read input on a background thread, keeping\n"
+"                               n blocks of 1MB ahead of the encoder\n"
+" --preallocate                 Reserve space for the output file from the\n"
+"                               estimated size, and write it through mmap\n"
+" --max-read-rate <MB/s>        Limit the rate of reading input files.\n"
+"                               Shared by all jobs of --jobs and --serve\n"
+" --max-write-rate <MB/s>       Limit the rate of writing output files.\n"
+"                               Shared by all jobs of --jobs and --serve\n"
 "\n"
 "Options for raw (headerless) input:\n"
 " -R, --raw                     Treat input as raw (by default WAV is\n"
@@ -203,25 +274,62 @@ PROGNAME " %s\n"
     , fdkaac_version);
 }
 
+typedef struct aacenc_rendition_t {
+    unsigned profile;   /* 0 means same as -p */
+    unsigned bitrate;
+    char *input_filename;
+} aacenc_rendition_t;
+
 typedef struct aacenc_param_ex_t {
-    AACENC_PARAMS
+    AACENC_SESSION_PARAMS
+
+    char **input_files;
+    int num_input_files;
+    char *list_filename;
+    unsigned num_jobs;
+    int print_stats;
+    char *serve_path;
+    int is_segment;
+    int merge;
+    int io_uring;
+    int preallocate;
+    aacenc_uring_t *uring;          /* shared by all jobs */
+    double max_read_rate;           /* in MB/s */
+    double max_write_rate;          /* in MB/s */
+    aacenc_throttle_t *read_throttle;   /* shared by all jobs */
+    aacenc_throttle_t *write_throttle;  /* shared by all jobs */
 
     char *input_filename;
     FILE *input_fp;
+    pcm_io_context_t input_map;     /* cookie is set when mapped */
+    pcm_io_context_t input_uring;   /* cookie is set when used */
+    pcm_io_context_t input_prefetch; /* cookie is set when used */
+    unsigned prefetch_depth;
+    pcm_io_context_t input_throttle; /* cookie is set when used */
     char *output_filename;
     FILE *output_fp;
-    unsigned gapless_mode;
-    unsigned include_sbr_delay;
+    aacenc_uring_output_t *output_uring;
+    aacenc_mmap_output_t *output_mmap;
+    aacenc_pipe_output_t *output_pipe;
+    aacenc_throttle_output_t *output_throttle;
+    unsigned pipe_flush;            /* in frames */
+    FILE *spool_fp;                 /* holds mdat until finalized */
+    unsigned cmaf_segments;         /* segment duration in ms */
+    aacenc_packager_t *packager;    /* replaces output_fp on cmaf-segments */
     unsigned ignore_length;
     int silent;
-    int moov_before_mdat;
+    aacenc_progress_callback_t progress;    /* overrides the default one */
+    void *progress_cookie;
 
     int is_raw;
     unsigned raw_channels;
     unsigned raw_rate;
     const char *raw_format;
 
-    int no_timestamp;
+    aacenc_rendition_t ladder[MAX_RENDITIONS];
+    unsigned num_renditions;
+    aacenc_rendition_t tracks[MAX_RENDITIONS];
+    unsigned num_tracks;
 
     aacenc_tag_store_t tags;
     aacenc_tag_store_t source_tags;
@@ -230,6 +338,87 @@ typedef struct aacenc_param_ex_t {
     char *json_filename;
 } aacenc_param_ex_t;
 
+/*
+ * [profile:]bitrate, such as "29:32" or "128".
+ * bitrate is in kbps when less than 10000, like -b.
+ */
+static
+int parse_profile_bitrate(const char *spec, unsigned *profile,
+                          unsigned *bitrate)
+{
+    char c;
+
+    if (sscanf(spec, "%u:%u%c", profile, bitrate, &c) != 2) {
+        *profile = 0;
+        if (sscanf(spec, "%u%c", bitrate, &c) != 1)
+            return -1;
+    }
+    if (!*bitrate)
+        return -1;
+    if (*bitrate < 10000)
+        *bitrate *= 1000;
+    return 0;
+}
+
+/* comma separated list of [profile:]bitrate, such as "29:32,5:64,2:128" */
+static
+int parse_ladder_spec(char *spec, aacenc_param_ex_t *params)
+{
+    char *tok;
+    unsigned i, profile, bitrate;
+
+    for (tok = strtok(spec, ","); tok; tok = strtok(0, ",")) {
+        if (params->num_renditions == MAX_RENDITIONS ||
+            parse_profile_bitrate(tok, &profile, &bitrate) < 0)
+            return -1;
+        /* bitrate is used to name the output */
+        for (i = 0; i < params->num_renditions; ++i)
+            if (params->ladder[i].bitrate / 1000 == bitrate / 1000)
+                return -1;
+        params->ladder[i].profile = profile;
+        params->ladder[i].bitrate = bitrate;
+        ++params->num_renditions;
+    }
+    return params->num_renditions ? 0 : -1;
+}
+
+/* [profile:]bitrate[@filename] */
+static
+int parse_track_spec(char *spec, aacenc_param_ex_t *params)
+{
+    aacenc_rendition_t *track = &params->tracks[params->num_tracks];
+    char *filename;
+
+    if (params->num_tracks == MAX_RENDITIONS)
+        return -1;
+    if ((filename = strchr(spec, '@')) != 0)
+        *filename++ = 0;
+    if (parse_profile_bitrate(spec, &track->profile, &track->bitrate) < 0)
+        return -1;
+    track->input_filename = filename;
+    ++params->num_tracks;
+    return 0;
+}
+
+/* start:[end], in samples */
+static
+int parse_segment_spec(const char *spec, aacenc_param_ex_t *params)
+{
+    int64_t start, end = 0;
+    char c;
+
+    if (sscanf(spec, "%" SCNd64 "%c", &start, &c) != 2 || c != ':')
+        return -1;
+    spec = strchr(spec, ':') + 1;
+    if (*spec && sscanf(spec, "%" SCNd64 "%c", &end, &c) != 1)
+        return -1;
+    if (start < 0 || (*spec && end <= start))
+        return -1;
+    params->segment_start = start;
+    params->segment_end = end;
+    return 0;
+}
+
 static
 int parse_options(int argc, char **argv, aacenc_param_ex_t *params)
 {
@@ -238,6 +427,8 @@ int parse_options(int argc, char **argv, aacenc_param_ex_t *params)
 
 #define OPT_INCLUDE_SBR_DELAY    M4AF_FOURCC('s','d','l','y')
 #define OPT_MOOV_BEFORE_MDAT     M4AF_FOURCC('m','o','o','v')
+#define OPT_FRAGMENT_DURATION    M4AF_FOURCC('f','r','a','g')
+#define OPT_CMAF_SEGMENTS        M4AF_FOURCC('c','m','a','f')
 #define OPT_RAW_CHANNELS         M4AF_FOURCC('r','c','h','n')
 #define OPT_RAW_RATE             M4AF_FOURCC('r','r','a','t')
 #define OPT_RAW_FORMAT           M4AF_FOURCC('r','f','m','t')
@@ -245,6 +436,24 @@ int parse_options(int argc, char **argv, aacenc_param_ex_t *params)
 #define OPT_SHORT_TAG_FILE       M4AF_FOURCC('s','t','g','f')
 #define OPT_LONG_TAG             M4AF_FOURCC('l','t','a','g')
 #define OPT_TAG_FROM_JSON        M4AF_FOURCC('t','f','j','s')
+#define OPT_THREADS              M4AF_FOURCC('t','h','r','d')
+#define OPT_PIPELINE             M4AF_FOURCC('p','i','p','e')
+#define OPT_BLOCK_SIZE           M4AF_FOURCC('b','l','k','s')
+#define OPT_JOBS                 M4AF_FOURCC('j','o','b','s')
+#define OPT_FROM_LIST            M4AF_FOURCC('l','i','s','t')
+#define OPT_STATS                M4AF_FOURCC('s','t','a','t')
+#define OPT_LADDER               M4AF_FOURCC('l','a','d','r')
+#define OPT_ADD_TRACK            M4AF_FOURCC('a','t','r','k')
+#define OPT_SERVE                M4AF_FOURCC('s','e','r','v')
+#define OPT_LOW_LATENCY          M4AF_FOURCC('l','l','a','t')
+#define OPT_PIPE_FLUSH           M4AF_FOURCC('p','f','l','s')
+#define OPT_SEGMENT              M4AF_FOURCC('s','g','m','t')
+#define OPT_MERGE                M4AF_FOURCC('m','r','g','e')
+#define OPT_IO_URING             M4AF_FOURCC('u','r','n','g')
+#define OPT_PREALLOCATE          M4AF_FOURCC('p','a','l','c')
+#define OPT_PREFETCH             M4AF_FOURCC('p','f','t','c')
+#define OPT_MAX_READ_RATE        M4AF_FOURCC('m','x','r','r')
+#define OPT_MAX_WRITE_RATE       M4AF_FOURCC('m','x','w','r')
 
     static const struct option long_options[] = {
         { "help",             no_argument,       0, 'h' },
@@ -264,6 +473,8 @@ int parse_options(int argc, char **argv, aacenc_param_ex_t *params)
         { "ignorelength",     no_argument,       0, 'I' },
         { "silent",           no_argument,       0, 'S' },
         { "moov-before-mdat", no_argument,       0, OPT_MOOV_BEFORE_MDAT   },
+        { "fragment-duration", required_argument, 0, OPT_FRAGMENT_DURATION },
+        { "cmaf-segments",    required_argument, 0, OPT_CMAF_SEGMENTS      },
 
         { "raw",              no_argument,       0, 'R' },
         { "raw-channels",     required_argument, 0, OPT_RAW_CHANNELS       },
@@ -288,6 +499,24 @@ int parse_options(int argc, char **argv, aacenc_param_ex_t *params)
         { "tag-from-json",    required_argument, 0, OPT_TAG_FROM_JSON      },
 
         { "no-timestamp",     no_argument,       0, '#' },
+        { "threads",          required_argument, 0, OPT_THREADS            },
+        { "pipeline",         no_argument,       0, OPT_PIPELINE           },
+        { "block-size",       required_argument, 0, OPT_BLOCK_SIZE         },
+        { "jobs",             required_argument, 0, OPT_JOBS               },
+        { "from-list",        required_argument, 0, OPT_FROM_LIST          },
+        { "stats",            no_argument,       0, OPT_STATS              },
+        { "ladder",           required_argument, 0, OPT_LADDER             },
+        { "add-track",        required_argument, 0, OPT_ADD_TRACK          },
+        { "serve",            required_argument, 0, OPT_SERVE              },
+        { "low-latency",      no_argument,       0, OPT_LOW_LATENCY        },
+        { "pipe-flush",       required_argument, 0, OPT_PIPE_FLUSH         },
+        { "segment",          required_argument, 0, OPT_SEGMENT            },
+        { "merge",            no_argument,       0, OPT_MERGE              },
+        { "io-uring",         no_argument,       0, OPT_IO_URING           },
+        { "preallocate",      no_argument,       0, OPT_PREALLOCATE        },
+        { "prefetch",         required_argument, 0, OPT_PREFETCH           },
+        { "max-read-rate",    required_argument, 0, OPT_MAX_READ_RATE      },
+        { "max-write-rate",   required_argument, 0, OPT_MAX_WRITE_RATE     },
         { 0,                  0,                 0, 0                      },
     };
     params->afterburner = 1;
@@ -386,6 +615,20 @@ int parse_options(int argc, char **argv, aacenc_param_ex_t *params)
         case OPT_MOOV_BEFORE_MDAT:
             params->moov_before_mdat = 1;
             break;
+        case OPT_FRAGMENT_DURATION:
+            if (sscanf(optarg, "%u", &n) != 1 || n == 0) {
+                fprintf(stderr, "invalid arg for fragment-duration\n");
+                return -1;
+            }
+            params->fragment_duration = n;
+            break;
+        case OPT_CMAF_SEGMENTS:
+            if (sscanf(optarg, "%u", &n) != 1 || n == 0) {
+                fprintf(stderr, "invalid arg for cmaf-segments\n");
+                return -1;
+            }
+            params->cmaf_segments = n;
+            break;
         case 'R':
             params->is_raw = 1;
             break;
@@ -463,22 +706,218 @@ int parse_options(int argc, char **argv, aacenc_param_ex_t *params)
         case '#':
             params->no_timestamp = 1;
             break;
+        case OPT_THREADS:
+            if (sscanf(optarg, "%u", &n) != 1) {
+                fprintf(stderr, "invalid arg for threads\n");
+                return -1;
+            }
+#if !HAVE_PTHREAD_H
+            if (n != 1) {
+                fprintf(stderr, "threads are not supported on this build\n");
+                return -1;
+            }
+#endif
+            params->num_threads = n ? n : aacenc_cpu_count();
+            break;
+        case OPT_PIPELINE:
+#if !HAVE_PTHREAD_H || !HAVE_STDATOMIC_H
+            fprintf(stderr, "pipeline is not supported on this build\n");
+            return -1;
+#endif
+            params->pipeline = 1;
+            break;
+        case OPT_BLOCK_SIZE:
+            if (sscanf(optarg, "%u", &n) != 1 || n == 0) {
+                fprintf(stderr, "invalid arg for block-size\n");
+                return -1;
+            }
+            params->block_size = n;
+            break;
+        case OPT_JOBS:
+            if (sscanf(optarg, "%u", &n) != 1) {
+                fprintf(stderr, "invalid arg for jobs\n");
+                return -1;
+            }
+#if !HAVE_PTHREAD_H
+            if (n != 1) {
+                fprintf(stderr, "jobs are not supported on this build\n");
+                return -1;
+            }
+#endif
+            params->num_jobs = n ? n : aacenc_cpu_count();
+            break;
+        case OPT_FROM_LIST:
+            params->list_filename = optarg;
+            break;
+        case OPT_STATS:
+            params->print_stats = 1;
+            break;
+        case OPT_LADDER:
+#if !HAVE_PTHREAD_H || !HAVE_STDATOMIC_H
+            fprintf(stderr, "ladder is not supported on this build\n");
+            return -1;
+#endif
+            if (parse_ladder_spec(optarg, params) < 0) {
+                fprintf(stderr, "invalid arg for ladder\n");
+                return -1;
+            }
+            break;
+        case OPT_ADD_TRACK:
+#if !HAVE_PTHREAD_H || !HAVE_STDATOMIC_H
+            fprintf(stderr, "multi-track is not supported on this build\n");
+            return -1;
+#endif
+            if (parse_track_spec(optarg, params) < 0) {
+                fprintf(stderr, "invalid arg for add-track\n");
+                return -1;
+            }
+            break;
+        case OPT_SERVE:
+#if !HAVE_PTHREAD_H || !HAVE_SYS_UN_H
+            fprintf(stderr, "serve is not supported on this build\n");
+            return -1;
+#endif
+            params->serve_path = optarg;
+            break;
+        case OPT_LOW_LATENCY:
+            params->low_latency = 1;
+            break;
+        case OPT_PIPE_FLUSH:
+            if (sscanf(optarg, "%u", &n) != 1 || n == 0) {
+                fprintf(stderr, "invalid arg for pipe-flush\n");
+                return -1;
+            }
+            params->pipe_flush = n;
+            break;
+        case OPT_SEGMENT:
+            if (parse_segment_spec(optarg, params) < 0) {
+                fprintf(stderr, "invalid arg for segment\n");
+                return -1;
+            }
+            params->is_segment = 1;
+            break;
+        case OPT_MERGE:
+            params->merge = 1;
+            break;
+        case OPT_IO_URING:
+            params->io_uring = 1;
+            break;
+        case OPT_PREALLOCATE:
+            params->preallocate = 1;
+            break;
+        case OPT_PREFETCH:
+#if !HAVE_PTHREAD_H
+            fprintf(stderr, "prefetch is not supported on this build\n");
+            return -1;
+#endif
+            if (sscanf(optarg, "%u", &n) != 1 || n == 0 || n > 1024) {
+                fprintf(stderr, "invalid arg for prefetch\n");
+                return -1;
+            }
+            params->prefetch_depth = n;
+            break;
+        case OPT_MAX_READ_RATE:
+            if (sscanf(optarg, "%lf", &params->max_read_rate) != 1 ||
+                !(params->max_read_rate > 0.0)) {
+                fprintf(stderr, "invalid arg for max-read-rate\n");
+                return -1;
+            }
+            break;
+        case OPT_MAX_WRITE_RATE:
+            if (sscanf(optarg, "%lf", &params->max_write_rate) != 1 ||
+                !(params->max_write_rate > 0.0)) {
+                fprintf(stderr, "invalid arg for max-write-rate\n");
+                return -1;
+            }
+            break;
         default:
             return usage(), -1;
         }
     }
-    if (argc == optind)
+    if (params->serve_path) {
+        /* everything else comes from each request */
+        if (argc > optind || params->list_filename) {
+            fprintf(stderr, "input files are given by requests on serve "
+                            "mode\n");
+            return -1;
+        }
+        if (params->output_filename || params->num_renditions ||
+            params->num_tracks) {
+            fprintf(stderr, "-o, ladder and add-track are not available on "
+                            "serve mode\n");
+            return -1;
+        }
+    } else if (argc == optind && !params->list_filename && !params->num_tracks)
         return usage(), -1;
 
-    if (!params->bitrate && !params->bitrate_mode) {
+    if (params->cmaf_segments) {
+        if (params->transport_format || params->is_segment ||
+            params->merge || params->num_renditions || params->num_tracks ||
+            params->serve_path) {
+            fprintf(stderr, "cmaf-segments cannot be combined with "
+                            "transport-format, segment, merge, ladder, "
+                            "add-track or serve\n");
+            return -1;
+        }
+        if (params->output_filename && !strcmp(params->output_filename, "-")) {
+            fprintf(stderr, "stdout streaming is not available on "
+                            "cmaf-segments\n");
+            return -1;
+        }
+        params->fragment_duration = params->cmaf_segments;
+    }
+    if (params->merge) {
+        if (params->is_segment || params->list_filename ||
+            params->num_renditions || params->num_tracks ||
+            params->transport_format) {
+            fprintf(stderr, "merge takes segments and writes M4A only\n");
+            return -1;
+        }
+        params->input_files = argv + optind;
+        params->num_input_files = argc - optind;
+        return 0;
+    }
+    if (params->is_segment && (params->transport_format ||
+                               params->num_renditions || params->num_tracks ||
+                               params->low_latency || params->serve_path)) {
+        fprintf(stderr, "segment cannot be combined with transport-format, "
+                        "ladder, add-track, low-latency or serve\n");
+        return -1;
+    }
+    if (params->is_segment && params->output_filename &&
+        !strcmp(params->output_filename, "-")) {
+        fprintf(stderr, "stdout streaming is not available on segment "
+                        "mode\n");
+        return -1;
+    }
+    if (params->fragment_duration &&
+        (params->transport_format || params->is_segment)) {
+        fprintf(stderr, "fragment-duration is only available on M4A "
+                        "output\n");
+        return -1;
+    }
+    if (!params->serve_path && !params->bitrate && !params->bitrate_mode &&
+        !params->num_renditions && !params->num_tracks) {
         fprintf(stderr, "bitrate or bitrate-mode is mandatory\n");
         return -1;
     }
     if (params->output_filename && !strcmp(params->output_filename, "-") &&
-        !params->transport_format) {
-        fprintf(stderr, "stdout streaming is not available on M4A output\n");
+        params->num_renditions) {
+        fprintf(stderr, "stdout streaming is not available on ladder mode\n");
         return -1;
     }
+    if (params->low_latency) {
+        if (!params->transport_format) {
+            fprintf(stderr, "low-latency is not available on M4A output\n");
+            return -1;
+        }
+        if (params->num_threads > 1 || params->pipeline ||
+            params->num_renditions) {
+            fprintf(stderr, "low-latency cannot be combined with threads, "
+                            "pipeline or ladder\n");
+            return -1;
+        }
+    }
     if (params->bitrate && params->bitrate < 10000)
         params->bitrate *= 1000;
 
@@ -490,115 +929,164 @@ int parse_options(int argc, char **argv, aacenc_param_ex_t *params)
         if (!params->raw_format)
             params->raw_format = "S16L";
     }
-    params->input_filename = argv[optind];
+    params->input_files = argv + optind;
+    params->num_input_files = argc - optind;
+    if (params->num_input_files > 1 || params->list_filename ||
+        params->num_jobs) {
+        if (params->output_filename) {
+            fprintf(stderr, "-o is not available on batch mode\n");
+            return -1;
+        }
+        if (params->num_tracks) {
+            fprintf(stderr, "add-track is not available on batch mode\n");
+            return -1;
+        }
+    } else
+        params->input_filename = argv[optind];
+
+    if (params->num_tracks) {
+        unsigned i;
+        if (params->num_renditions) {
+            fprintf(stderr, "add-track and ladder cannot be combined\n");
+            return -1;
+        }
+        if (params->transport_format) {
+            fprintf(stderr, "multi-track is available only on M4A output\n");
+            return -1;
+        }
+        if (params->num_threads > 1) {
+            fprintf(stderr, "threads are not available on multi-track "
+                            "mode\n");
+            return -1;
+        }
+        for (i = 0; i < params->num_tracks; ++i) {
+            if (!params->tracks[i].input_filename)
+                params->tracks[i].input_filename = params->input_filename;
+            if (!params->tracks[i].input_filename)
+                return usage(), -1;
+        }
+    }
     return 0;
 };
 
+#if HAVE_PTHREAD_H
+/*
+ * Serializes writing of multiple tracks, each encoded on its own thread,
+ * into one m4af context.
+ * Frames are written in the order of their timestamps (ties are broken by
+ * track index), therefore layout of the resulting file doesn't depend on
+ * thread scheduling.
+ */
+typedef struct track_clock_t {
+    int64_t time;           /* end of the last frame written */
+    uint32_t timescale;
+    uint32_t frame_duration;
+    int finished;
+} track_clock_t;
+
+typedef struct track_mux_t {
+    m4af_ctx_t *m4af;
+    track_clock_t *tracks;
+    unsigned ntracks;
+    int aborted;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} track_mux_t;
+
 static
-int write_sample(FILE *ofp, m4af_ctx_t *m4af, aacenc_frame_t *frame)
+int track_mux_init(track_mux_t *mux, m4af_ctx_t *m4af, unsigned ntracks)
 {
-    if (!m4af) {
-        fwrite(frame->data, 1, frame->size, ofp);
-        if (ferror(ofp)) {
-            fprintf(stderr, "ERROR: fwrite(): %s\n", strerror(errno));
-            return -1;
-        }
-    } else if (m4af_write_sample(m4af, 0, frame->data, frame->size, 0) < 0) {
-        fprintf(stderr, "ERROR: failed to write m4a sample\n");
+    memset(mux, 0, sizeof(track_mux_t));
+    if ((mux->tracks = calloc(ntracks, sizeof(track_clock_t))) == 0)
         return -1;
-    }
+    mux->m4af = m4af;
+    mux->ntracks = ntracks;
+    pthread_mutex_init(&mux->mutex, 0);
+    pthread_cond_init(&mux->cond, 0);
     return 0;
 }
 
-static int do_smart_padding(int profile)
+static
+void track_mux_destroy(track_mux_t *mux)
 {
-    return profile == 2 || profile == 5 || profile == 29;
+    if (mux->tracks) {
+        pthread_mutex_destroy(&mux->mutex);
+        pthread_cond_destroy(&mux->cond);
+        free(mux->tracks);
+        mux->tracks = 0;
+    }
 }
 
 static
-int encode(aacenc_param_ex_t *params, pcm_reader_t *reader,
-           HANDLE_AACENCODER encoder, uint32_t frame_length, 
-           m4af_ctx_t *m4af)
+int track_mux_is_turn(track_mux_t *mux, unsigned track_idx)
 {
-    INT_PCM *ibuf = 0, *ip;
-    aacenc_frame_t obuf[2] = {{ 0 }}, *obp;
-    unsigned flip = 0;
-    int nread = 1;
-    int rc = -1;
-    int remaining, consumed;
-    int frames_written = 0, encoded = 0;
-    aacenc_progress_t progress = { 0 };
-    const pcm_sample_description_t *fmt = pcm_get_format(reader);
-    const int is_padding = do_smart_padding(params->profile);
-
-    ibuf = malloc(frame_length * fmt->bytes_per_frame);
-    aacenc_progress_init(&progress, pcm_get_length(reader), fmt->sample_rate);
-
-    for (;;) {
-        if (g_interrupted)
-            nread = 0;
-        if (nread > 0) {
-            if ((nread = pcm_read_frames(reader, ibuf, frame_length)) < 0) {
-                fprintf(stderr, "ERROR: read failed\n");
-                goto END;
-            }
-            if (!params->silent)
-                aacenc_progress_update(&progress, pcm_get_position(reader),
-                                       fmt->sample_rate * 2);
-        }
-        ip = ibuf;
-        remaining = nread;
-        do {
-            obp = &obuf[flip];
-            consumed = aac_encode_frame(encoder, fmt, ip, remaining, obp);
-            if (consumed < 0) goto END;
-            if (consumed == 0 && obp->size == 0) goto DONE;
-            if (obp->size == 0) break;
-
-            remaining -= consumed;
-            ip += consumed * fmt->channels_per_frame;
-            if (is_padding) {
-            /*
-             * As we pad 1 frame at beginning and ending by our extrapolator,
-             * we want to drop them.
-             * We delay output by 1 frame by double buffering, and discard
-             * second frame and final frame from the encoder.
-             * Since sbr_header is included in the first frame (in case of
-             * SBR), we cannot discard first frame. So we pick second instead.
-             */
-                flip ^= 1;
-                ++encoded;
-                if (encoded == 1 || encoded == 3)
-                    continue;
-            }
-            if (write_sample(params->output_fp, m4af, &obuf[flip]) < 0)
-                goto END;
-            ++frames_written;
-        } while (remaining > 0);
+    track_clock_t *self = &mux->tracks[track_idx];
+    unsigned i;
+
+    for (i = 0; i < mux->ntracks; ++i) {
+        track_clock_t *other = &mux->tracks[i];
+        int64_t x, y;
+        if (i == track_idx || other->finished)
+            continue;
+        x = self->time * other->timescale;
+        y = other->time * self->timescale;
+        if (x > y || (x == y && i < track_idx))
+            return 0;
     }
-DONE:
-    /*
-     * When interrupted, we haven't pulled out last extrapolated frames
-     * from the reader. Therefore, we have to write the final outcome.
-     */
-    if (g_interrupted) {
-        if (write_sample(params->output_fp, m4af, &obp[flip^1]) < 0)
-            goto END;
-        ++frames_written;
+    return 1;
+}
+
+static
+int track_mux_write(track_mux_t *mux, unsigned track_idx,
+                    aacenc_frame_t *frame)
+{
+    int rc = -1;
+
+    pthread_mutex_lock(&mux->mutex);
+    while (!mux->aborted && !track_mux_is_turn(mux, track_idx))
+        pthread_cond_wait(&mux->cond, &mux->mutex);
+    if (!mux->aborted) {
+        if (m4af_write_sample(mux->m4af, track_idx, frame->data,
+                              frame->size, 0) < 0) {
+            fprintf(stderr, "ERROR: failed to write m4a sample\n");
+            mux->aborted = 1;
+        } else {
+            mux->tracks[track_idx].time +=
+                mux->tracks[track_idx].frame_duration;
+            rc = 0;
+        }
+        pthread_cond_broadcast(&mux->cond);
     }
-    if (!params->silent)
-        aacenc_progress_finish(&progress, pcm_get_position(reader));
-    rc = frames_written;
-END:
-    if (ibuf) free(ibuf);
-    if (obuf[0].data) free(obuf[0].data);
-    if (obuf[1].data) free(obuf[1].data);
+    pthread_mutex_unlock(&mux->mutex);
     return rc;
 }
 
+/* track will write no more. on failure, other tracks are also aborted */
+static
+void track_mux_finish(track_mux_t *mux, unsigned track_idx, int failed)
+{
+    pthread_mutex_lock(&mux->mutex);
+    mux->tracks[track_idx].finished = 1;
+    if (failed)
+        mux->aborted = 1;
+    pthread_cond_broadcast(&mux->cond);
+    pthread_mutex_unlock(&mux->mutex);
+}
+
+/* let every pending and future write fail */
+static
+void track_mux_abort(track_mux_t *mux)
+{
+    pthread_mutex_lock(&mux->mutex);
+    mux->aborted = 1;
+    pthread_cond_broadcast(&mux->cond);
+    pthread_mutex_unlock(&mux->mutex);
+}
+#endif
+
 static
 void put_tool_tag(m4af_ctx_t *m4af, const aacenc_param_ex_t *params,
-                  HANDLE_AACENCODER encoder)
+                  unsigned bitrate)
 {
     char tool_info[256];
     char *p = tool_info;
@@ -610,15 +1098,14 @@ void put_tool_tag(m4af_ctx_t *m4af, const aacenc_param_ex_t *params,
     if (params->bitrate_mode)
         sprintf(p, "VBR mode %d", params->bitrate_mode);
     else
-        sprintf(p, "CBR %dkbps",
-                aacEncoder_GetParam(encoder, AACENC_BITRATE) / 1000);
+        sprintf(p, "CBR %dkbps", bitrate / 1000);
 
     m4af_add_itmf_string_tag(m4af, M4AF_TAG_TOOL, tool_info);
 }
 
 static
-int finalize_m4a(m4af_ctx_t *m4af, const aacenc_param_ex_t *params,
-                 HANDLE_AACENCODER encoder)
+void put_tags(m4af_ctx_t *m4af, const aacenc_param_ex_t *params,
+              unsigned bitrate)
 {
     unsigned i;
     aacenc_tag_entry_t *tag;
@@ -634,13 +1121,7 @@ int finalize_m4a(m4af_ctx_t *m4af, const aacenc_param_ex_t *params,
     for (i = 0; i < params->tags.tag_count; ++i, ++tag)
         aacenc_write_tag_entry(m4af, tag);
 
-    put_tool_tag(m4af, params, encoder);
-
-    if (m4af_finalize(m4af, params->moov_before_mdat) < 0) {
-        fprintf(stderr, "ERROR: failed to finalize m4a\n");
-        return -1;
-    }
-    return 0;
+    put_tool_tag(m4af, params, bitrate);
 }
 
 static
@@ -704,6 +1185,28 @@ static pcm_io_vtbl_t pcm_io_vtbl = {
 };
 static pcm_io_vtbl_t pcm_io_vtbl_noseek = { read_callback, 0, tell_callback };
 
+/*
+ * Sets up io through io_uring, prefetch or mmap, which read up to the size
+ * of the file at open. Returns -1 when none of them is available.
+ */
+static
+int open_input_io(aacenc_param_ex_t *params, pcm_io_context_t *io)
+{
+    if (params->uring &&
+        aacenc_uring_open_input(params->uring, &params->input_uring,
+                                params->input_fp) == 0)
+        *io = params->input_uring;
+    else if (params->prefetch_depth &&
+             pcm_open_prefetch_io(&params->input_prefetch, params->input_fp,
+                                  params->prefetch_depth) == 0)
+        *io = params->input_prefetch;
+    else if (pcm_open_mmap_io(&params->input_map, params->input_fp) == 0)
+        *io = params->input_map;
+    else
+        return -1;
+    return 0;
+}
+
 static
 pcm_reader_t *open_input(aacenc_param_ex_t *params)
 {
@@ -716,10 +1219,14 @@ pcm_reader_t *open_input(aacenc_param_ex_t *params)
         goto FAIL;
     }
     io.cookie = params->input_fp;
-    if (aacenc_seekable(params->input_fp))
-        io.vtbl = &pcm_io_vtbl;
-    else
-        io.vtbl = &pcm_io_vtbl_noseek;
+    /* a file still being written is read until the real EOF */
+    if (params->ignore_length || open_input_io(params, &io) < 0)
+        io.vtbl = aacenc_seekable(params->input_fp) ? &pcm_io_vtbl
+                                                    : &pcm_io_vtbl_noseek;
+    if (params->read_throttle &&
+        aacenc_throttle_open_input(params->read_throttle,
+                                   &params->input_throttle, &io) == 0)
+        io = params->input_throttle;
 
     if (params->is_raw) {
         int bytes_per_channel;
@@ -763,134 +1270,1560 @@ pcm_reader_t *open_input(aacenc_param_ex_t *params)
         }
     }
     reader = pcm_open_native_converter(reader);
-    if (reader && PCM_IS_FLOAT(pcm_get_format(reader)))
+    /* limiter looks ahead, therefore float input is just clipped */
+    if (reader && PCM_IS_FLOAT(pcm_get_format(reader)) &&
+        !params->low_latency)
         reader = limiter_open(reader);
-    if (reader && (reader = pcm_open_sint16_converter(reader)) != 0) {
-        if (do_smart_padding(params->profile))
-            reader = extrapolater_open(reader);
-    }
+    if (reader)
+        reader = pcm_open_sint16_converter(reader);
     return reader;
 FAIL:
     return 0;
 }
 
-int main(int argc, char **argv)
+/* after the reader is torn down */
+static
+void close_input(aacenc_param_ex_t *params)
+{
+    if (params->input_map.cookie)
+        pcm_close_mmap_io(&params->input_map);
+    if (params->input_uring.cookie)
+        aacenc_uring_close_input(&params->input_uring);
+    if (params->input_throttle.cookie)
+        aacenc_throttle_close_input(&params->input_throttle);
+    if (params->input_prefetch.cookie)
+        pcm_close_prefetch_io(&params->input_prefetch);
+    if (params->input_fp)
+        fclose(params->input_fp);
+    params->input_fp = 0;
+}
+
+/*
+ * Opens params->output_filename, and returns the cookie for *io, which is
+ * set to write through io_uring or mmap when enabled.
+ * ADTS/LATM output to a pipe is written by vmsplice where available.
+ * size_hint is the estimated size of the output for preallocation.
+ * Output of segment and low-latency mode is always written by stdio, since
+ * they write frame by frame.
+ * On cmaf-segments, output goes to the packager, named after
+ * params->output_filename without ".m3u8".
+ */
+static
+void *open_output_io(aacenc_param_ex_t *params, m4af_io_callbacks_t **io,
+                     int64_t size_hint)
 {
     static m4af_io_callbacks_t m4af_io = {
         read_callback, write_callback, seek_callback, tell_callback
     };
-    aacenc_param_ex_t params = { 0 };
 
-    int result = 2;
-    char *output_filename = 0;
-    pcm_reader_t *reader = 0;
-    HANDLE_AACENCODER encoder = 0;
-    AACENC_InfoStruct aacinfo = { 0 };
-    m4af_ctx_t *m4af = 0;
-    const pcm_sample_description_t *sample_format;
-    int frame_count = 0;
-    int sbr_mode = 0;
-    unsigned scale_shift = 0;
-
-    setlocale(LC_CTYPE, "");
-    setbuf(stderr, 0);
+    if (params->cmaf_segments) {
+        char *base = strdup(params->output_filename), *ext;
+
+        if (!base)
+            return 0;
+        ext = strrchr(aacenc_basename(base), '.');
+        if (ext && !strcmp(ext, ".m3u8"))
+            *ext = 0;
+        params->packager = aacenc_packager_open(base, params->cmaf_segments);
+        free(base);
+        *io = aacenc_packager_get_io();
+        return params->packager;
+    }
+    if ((params->output_fp = aacenc_fopen(params->output_filename,
+                                          "wb+")) == 0) {
+        aacenc_fprintf(stderr, "ERROR: %s: %s\n", params->output_filename,
+                       strerror(errno));
+        return 0;
+    }
+    if (params->uring && !params->is_segment && !params->low_latency &&
+        (params->output_uring =
+            aacenc_uring_open_output(params->uring, params->output_fp)) != 0)
+    {
+        *io = aacenc_uring_get_output_io();
+        return params->output_uring;
+    }
+    if (params->preallocate && !params->is_segment && !params->low_latency) {
+        params->output_mmap =
+            aacenc_mmap_open_output(params->output_fp, size_hint);
+        if (params->output_mmap) {
+            *io = aacenc_mmap_get_output_io();
+            return params->output_mmap;
+        }
+        if (strcmp(params->output_filename, "-"))
+            aacenc_fprintf(stderr, "WARNING: %s: cannot preallocate, "
+                           "written by stdio\n", params->output_filename);
+    }
+    if (params->transport_format && !params->low_latency &&
+        (params->output_pipe =
+            aacenc_pipe_open_output(params->output_fp,
+                                    params->pipe_flush)) != 0)
+    {
+        *io = aacenc_pipe_get_output_io();
+        return params->output_pipe;
+    }
+    *io = &m4af_io;
+    return params->output_fp;
+}
 
-    if (parse_options(argc, argv, &params) < 0)
-        return 1;
+/* same as open_output_io(), through the write throttle when enabled */
+static
+void *open_output(aacenc_param_ex_t *params, m4af_io_callbacks_t **io,
+                  int64_t size_hint)
+{
+    void *cookie;
+
+    if ((cookie = open_output_io(params, io, size_hint)) == 0)
+        return 0;
+    if (params->write_throttle &&
+        (params->output_throttle =
+            aacenc_throttle_open_output(params->write_throttle, *io,
+                                        cookie)) != 0)
+    {
+        *io = aacenc_throttle_get_output_io();
+        return params->output_throttle;
+    }
+    return cookie;
+}
 
-    if ((reader = open_input(&params)) == 0)
-        goto END;
+/*
+ * Size of the output for preallocation, from length in frames and bitrate
+ * in bps, with some margin for the container. 0 when unknown.
+ */
+static
+int64_t estimate_output_size(int64_t length, uint32_t sample_rate,
+                             unsigned bitrate)
+{
+    double size;
 
-    sample_format = pcm_get_format(reader);
-
-    sbr_mode = aacenc_is_sbr_active((aacenc_param_t*)&params);
-    if (sbr_mode && !aacenc_is_sbr_ratio_available()) {
-        fprintf(stderr, "WARNING: Only dual-rate SBR is available "
-                        "for this version\n");
-        params.sbr_ratio = 2;
-    }
-    scale_shift = aacenc_is_dual_rate_sbr((aacenc_param_t*)&params);
-    params.sbr_signaling = 0;
-    if (sbr_mode) {
-        if (params.transport_format == TT_MP4_LOAS || !scale_shift)
-            params.sbr_signaling = 2;
-        if (params.transport_format == TT_MP4_RAW &&
-            aacenc_is_explicit_bw_compatible_sbr_signaling_available())
-            params.sbr_signaling = 1;
-    }
-    if (aacenc_init(&encoder, (aacenc_param_t*)&params, sample_format,
-                    &aacinfo) < 0)
-        goto END;
+    if (length < 0 || length == INT64_MAX || !bitrate)
+        return 0;
+    size = (double)length / sample_rate * bitrate / 8;
+    return size + size / 16;
+}
 
-    if (!params.output_filename) {
-        const char *ext = params.transport_format ? ".aac" : ".m4a";
-        output_filename = generate_output_filename(params.input_filename, ext);
-        params.output_filename = output_filename;
+/* returns -1 when some of the writes have failed */
+static
+int close_output(aacenc_param_ex_t *params)
+{
+    int rc = 0;
+
+    if (params->output_throttle)
+        aacenc_throttle_close_output(&params->output_throttle);
+    if (params->output_uring &&
+        aacenc_uring_close_output(&params->output_uring) < 0) {
+        aacenc_fprintf(stderr, "ERROR: %s: write failed\n",
+                       params->output_filename);
+        rc = -1;
     }
-
-    if ((params.output_fp = aacenc_fopen(params.output_filename, "wb+")) == 0) {
-        aacenc_fprintf(stderr, "ERROR: %s: %s\n", params.output_filename,
-                       strerror(errno));
-        goto END;
+    if (params->output_mmap &&
+        aacenc_mmap_close_output(&params->output_mmap) < 0) {
+        aacenc_fprintf(stderr, "ERROR: %s: write failed\n",
+                       params->output_filename);
+        rc = -1;
     }
-    handle_signals();
+    if (params->output_pipe &&
+        aacenc_pipe_close_output(&params->output_pipe) < 0) {
+        aacenc_fprintf(stderr, "ERROR: %s: write failed\n",
+                       params->output_filename);
+        rc = -1;
+    }
+    if (params->packager && aacenc_packager_close(&params->packager) < 0) {
+        aacenc_fprintf(stderr, "ERROR: %s: write failed\n",
+                       params->output_filename);
+        rc = -1;
+    }
+    if (params->output_fp) fclose(params->output_fp);
+    params->output_fp = 0;
+    if (params->spool_fp) fclose(params->spool_fp);
+    params->spool_fp = 0;
+    return rc;
+}
 
-    if (!params.transport_format) {
-        uint32_t scale;
-        unsigned framelen = aacinfo.frameLength;
-        scale = sample_format->sample_rate >> scale_shift;
-        if ((m4af = m4af_create(M4AF_CODEC_MP4A, scale, &m4af_io,
-                                params.output_fp, params.no_timestamp)) < 0)
-            goto END;
-        m4af_set_num_channels(m4af, 0, sample_format->channels_per_frame);
-        m4af_set_fixed_frame_duration(m4af, 0, framelen >> scale_shift);
-        if (aacenc_is_explicit_bw_compatible_sbr_signaling_available())
-            m4af_set_decoder_specific_info(m4af, 0,
-                                           aacinfo.confBuf, aacinfo.confSize);
-        else {
-            uint8_t mp4asc[32];
-            uint32_t ascsize = sizeof(mp4asc);
-            aacenc_mp4asc((aacenc_param_t*)&params, aacinfo.confBuf,
-                          aacinfo.confSize, mp4asc, &ascsize);
-            m4af_set_decoder_specific_info(m4af, 0, mp4asc, ascsize);
-        }
-        m4af_set_vbr_mode(m4af, 0, params.bitrate_mode);
-        m4af_set_priming_mode(m4af, params.gapless_mode + 1);
-        m4af_begin_write(m4af);
-    }
-    frame_count = encode(&params, reader, encoder, aacinfo.frameLength, m4af);
-    if (frame_count < 0)
-        goto END;
-    if (m4af) {
-        uint32_t padding;
-#if AACENCODER_LIB_VL0 < 4
-        uint32_t delay = aacinfo.encoderDelay;
-        if (sbr_mode && params.profile != AOT_ER_AAC_ELD
-            && !params.include_sbr_delay)
-            delay -= 481 << scale_shift;
-#else
-        uint32_t delay = params.include_sbr_delay ? aacinfo.nDelay
-                                                  : aacinfo.nDelayCore;
-#endif
-        int64_t frames_read = pcm_get_position(reader);
+static
+int64_t spool_copy_callback(void *cookie, void *spool_cookie, int64_t offset,
+                            int64_t size)
+{
+    return aacenc_copy_file_range(cookie, spool_cookie, offset, size);
+}
 
-        padding = frame_count * aacinfo.frameLength - frames_read - delay;
-        m4af_set_priming(m4af, 0, delay >> scale_shift, padding >> scale_shift);
-        if (finalize_m4a(m4af, &params, encoder) < 0)
-            goto END;
+/*
+ * mdat of M4A is spooled into a temporary file when the output is not
+ * seekable, or when moov is wanted before mdat but no space can be reserved
+ * for it since the length is unknown. The output is then written at once
+ * on finalize.
+ */
+static
+int setup_spool(aacenc_param_ex_t *params, m4af_ctx_t *m4af, int length_known)
+{
+    static m4af_io_callbacks_t spool_io = {
+        read_callback, write_callback, seek_callback, tell_callback
+    };
+
+    /* fragmented output is written sequentially anyway */
+    if (params->fragment_duration)
+        return 0;
+    if (aacenc_seekable(params->output_fp) &&
+        (!params->moov_before_mdat || length_known))
+        return 0;
+    if ((params->spool_fp = aacenc_tmpfile(params->output_filename)) == 0) {
+        fprintf(stderr, "ERROR: failed to create temporary file: %s\n",
+                strerror(errno));
+        return -1;
     }
-    result = 0;
-END:
-    if (reader) pcm_teardown(&reader);
-    if (params.input_fp) fclose(params.input_fp);
-    if (m4af) m4af_teardown(&m4af);
-    if (params.output_fp) fclose(params.output_fp);
-    if (encoder) aacEncClose(&encoder);
-    if (output_filename) free(output_filename);
-    if (params.tags.tag_table)
-        aacenc_free_tag_store(&params.tags);
+    /*
+     * the output is not a FILE when written through io_uring or mmap, and
+     * copying by the kernel would bypass the write throttle
+     */
+    m4af_set_spool(m4af, &spool_io, params->spool_fp,
+                   params->output_uring || params->output_mmap ||
+                   params->output_throttle ? 0 : spool_copy_callback);
+    return 0;
+}
+
+typedef struct aacenc_job_t {
+    aacenc_param_ex_t params;
+    char *output_filename;  /* generated one */
+    int64_t length;         /* input length in frames, used for scheduling */
+    int64_t frames_read;
+    uint32_t sample_rate;
+    double elapsed;         /* in seconds */
+    int result;             /* -1 if not processed */
+} aacenc_job_t;
+
+static
+void progress_callback(void *cookie, int64_t position, int64_t length)
+{
+    aacenc_progress_t *progress = cookie;
+    aacenc_progress_update(progress, position, progress->timescale * 2);
+}
+
+static
+void print_block_stats(aacenc_session_t *session)
+{
+    unsigned block_size;
+    int64_t blocks, usec, frames = aacenc_session_get_position(session);
+
+    if (aacenc_session_get_block_stats(session, &block_size, &blocks,
+                                       &usec) < 0)
+        return;
+    fprintf(stderr, "reader: %" PRId64 " blocks of %u frames, "
+                    "%.1f us per block (%.1f ns per frame)\n",
+            blocks, block_size, (double)usec / blocks,
+            frames ? usec * 1000.0 / frames : 0.0);
+}
+
+static
+void print_prefetch_stats(aacenc_param_ex_t *params)
+{
+    int64_t blocks, stalls, usec;
+
+    if (!params->input_prefetch.cookie)
+        return;
+    pcm_get_prefetch_stats(&params->input_prefetch, &blocks, &stalls, &usec);
+    fprintf(stderr, "prefetch: %" PRId64 " blocks of 1MB, %" PRId64
+                    " reads stalled for %.3f s\n",
+            blocks, stalls, usec / 1000000.0);
+}
+
+static
+void print_throttle_stats(aacenc_param_ex_t *params)
+{
+    int64_t read_usec = 0, write_usec = 0;
+
+    if (!params->input_throttle.cookie && !params->output_throttle)
+        return;
+    if (params->input_throttle.cookie)
+        read_usec = aacenc_throttle_get_input_wait(&params->input_throttle);
+    if (params->output_throttle)
+        write_usec = aacenc_throttle_get_output_wait(params->output_throttle);
+    fprintf(stderr, "throttle: waited %.3f s for reads, %.3f s for writes\n",
+            read_usec / 1000000.0, write_usec / 1000000.0);
+}
+
+static
+void print_moov_stats(m4af_ctx_t *m4af)
+{
+    m4af_moov_stats_t stats;
+
+    m4af_get_moov_stats(m4af, &stats);
+    if (stats.placement == M4AF_MOOV_IN_RESERVED)
+        fprintf(stderr, "moov: %u bytes, written into %u bytes reserved\n",
+                stats.size, stats.reserved + 8);
+    else if (stats.placement == M4AF_MOOV_SHIFTED && stats.reserved)
+        fprintf(stderr, "moov: %u bytes, exceeded %u bytes reserved, "
+                        "mdat was moved\n", stats.size, stats.reserved + 8);
+    else if (stats.placement == M4AF_MOOV_SHIFTED)
+        fprintf(stderr, "moov: %u bytes, mdat was moved "
+                        "(length of the input unknown)\n", stats.size);
+    else if (stats.placement == M4AF_MOOV_SPOOLED)
+        fprintf(stderr, "moov: %u bytes, mdat was copied from temporary "
+                        "file\n", stats.size);
+    else if (stats.placement == M4AF_MOOV_FRAGMENTED)
+        fprintf(stderr, "moov: %u bytes, followed by %u fragments\n",
+                stats.size, stats.fragments);
+}
+
+static
+void print_latency(aacenc_session_t *session)
+{
+    aacenc_latency_t latency;
+
+    if (aacenc_session_get_latency(session, &latency) < 0)
+        return;
+    fprintf(stderr, "latency: %.1f ms frame + %.1f ms encoder delay + "
+                    "%.2f ms processing (max %.2f ms)\n",
+            latency.frame, latency.algorithmic, latency.processing_avg,
+            latency.processing_max);
+    fprintf(stderr, "end-to-end latency of the encoder: %.1f ms (worst)\n",
+            latency.frame + latency.algorithmic + latency.processing_max);
+}
+
+/*
+ * Output of segment mode is a sequence of raw AAC frames, each preceded by
+ * 16 bit big endian size, and a JSON sidecar (<output>.json) describing
+ * the segment and the encoder configuration, which is used by --merge.
+ */
+static
+int write_segment_frame(void *cookie, aacenc_frame_t *frame)
+{
+    uint8_t size[2];
+
+    size[0] = frame->size >> 8;
+    size[1] = frame->size & 0xff;
+    if (fwrite(size, 1, 2, cookie) != 2 ||
+        fwrite(frame->data, 1, frame->size, cookie) != frame->size) {
+        fprintf(stderr, "ERROR: write failed: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static
+int write_segment_info(aacenc_param_ex_t *params, aacenc_session_t *session)
+{
+    FILE *fp;
+    char *filename;
+    uint8_t asc[64];
+    uint32_t i, ascsize = sizeof(asc), timescale, frame_duration;
+    uint32_t rate = aacenc_session_get_format(session)->sample_rate;
+    int64_t start = params->segment_start, end = params->segment_end;
+    int rc = -1;
+
+    timescale = aacenc_session_get_timescale(session, &frame_duration);
+    if (aacenc_session_get_asc(session, asc, &ascsize) < 0)
+        return -1;
+    /* boundaries are rounded down to frame boundary by the session */
+    start -= start % (frame_duration * (rate / timescale));
+    end -= end % (frame_duration * (rate / timescale));
+    if ((filename = malloc(strlen(params->output_filename) + 6)) == 0)
+        return -1;
+    sprintf(filename, "%s.json", params->output_filename);
+    if ((fp = aacenc_fopen(filename, "w")) == 0) {
+        aacenc_fprintf(stderr, "ERROR: %s: %s\n", filename, strerror(errno));
+        goto END;
+    }
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"start\": %" PRId64 ",\n", start);
+    if (params->segment_end)
+        fprintf(fp, "  \"end\": %" PRId64 ",\n", end);
+    else
+        fprintf(fp, "  \"end\": null,\n");
+    fprintf(fp, "  \"frames\": %d,\n",
+            aacenc_session_get_frame_count(session));
+    if (aacenc_session_is_complete(session))
+        fprintf(fp, "  \"length\": %" PRId64 ",\n",
+                aacenc_session_get_position(session));
+    fprintf(fp, "  \"sample_rate\": %u,\n", rate);
+    fprintf(fp, "  \"channels\": %u,\n",
+            aacenc_session_get_format(session)->channels_per_frame);
+    fprintf(fp, "  \"timescale\": %u,\n", timescale);
+    fprintf(fp, "  \"frame_duration\": %u,\n", frame_duration);
+    fprintf(fp, "  \"delay\": %u,\n", aacenc_session_get_delay(session));
+    fprintf(fp, "  \"bitrate_mode\": %u,\n", params->bitrate_mode);
+    fprintf(fp, "  \"bitrate\": %u,\n",
+            aacEncoder_GetParam(aacenc_session_get_encoder(session),
+                                AACENC_BITRATE));
+    fprintf(fp, "  \"asc\": \"");
+    for (i = 0; i < ascsize; ++i)
+        fprintf(fp, "%02x", asc[i]);
+    fprintf(fp, "\"\n}\n");
+    if (fclose(fp) == 0)
+        rc = 0;
+    else
+        aacenc_fprintf(stderr, "ERROR: %s: %s\n", filename, strerror(errno));
+END:
+    free(filename);
+    return rc;
+}
+
+/* encode PCM from the reader (ownership is taken) into the output */
+static
+int encode_stream(aacenc_job_t *job, pcm_reader_t *reader)
+{
+    aacenc_param_ex_t *params = &job->params;
+    m4af_io_callbacks_t *io;
+    void *io_cookie;
+
+    int result = 2;
+    aacenc_session_t *session = 0;
+    aacenc_progress_t progress = { 0 };
+    m4af_ctx_t *m4af = 0;
+    int64_t length = pcm_get_length(reader), size_hint;
+
+    aacenc_progress_init(&progress, length,
+                         pcm_get_format(reader)->sample_rate);
+    session = aacenc_session_open_reader((aacenc_session_params_t*)params,
+                                         reader);
+    if (!session)
+        goto END;
+
+    size_hint = estimate_output_size(length,
+                    pcm_get_format(reader)->sample_rate,
+                    aacEncoder_GetParam(aacenc_session_get_encoder(session),
+                                        AACENC_BITRATE));
+    if ((io_cookie = open_output(params, &io, size_hint)) == 0)
+        goto END;
+    /* write each frame as soon as it is encoded */
+    if (params->low_latency)
+        setvbuf(params->output_fp, 0, _IONBF, 0);
+    handle_signals();
+
+    if (params->is_segment)
+        aacenc_session_set_frame_callback(session, write_segment_frame,
+                                          params->output_fp);
+    else if (aacenc_session_set_output(session, io, io_cookie) < 0)
+        goto END;
+    /* before the first frame, to be counted in the space for moov */
+    if ((m4af = aacenc_session_get_m4af(session)) != 0) {
+        put_tags(m4af, params,
+                 aacEncoder_GetParam(aacenc_session_get_encoder(session),
+                                     AACENC_BITRATE));
+        if (setup_spool(params, m4af, length >= 0 && length != INT64_MAX) < 0)
+            goto END;
+    }
+    if (params->packager) {
+        HANDLE_AACENCODER encoder = aacenc_session_get_encoder(session);
+        const pcm_sample_description_t *fmt =
+            aacenc_session_get_format(session);
+
+        aacenc_packager_set_format(params->packager,
+                                   aacEncoder_GetParam(encoder, AACENC_AOT),
+                                   aacenc_session_get_timescale(session, 0),
+                                   fmt->sample_rate, fmt->channels_per_frame);
+        m4af_set_fragment_callback(m4af, aacenc_packager_begin_segment,
+                                   params->packager);
+    }
+    if (params->progress)
+        aacenc_session_set_progress_callback(session, params->progress,
+                                             params->progress_cookie);
+    else if (!params->silent)
+        aacenc_session_set_progress_callback(session, progress_callback,
+                                             &progress);
+    if (aacenc_session_run(session) < 0)
+        goto END;
+    if (aacenc_session_finalize(session) < 0)
+        goto END;
+    if (!params->silent)
+        aacenc_progress_finish(&progress,
+                               aacenc_session_get_position(session));
+    if (params->low_latency && !params->silent)
+        print_latency(session);
+    if (params->print_stats) {
+        print_block_stats(session);
+        print_prefetch_stats(params);
+        print_throttle_stats(params);
+        if (m4af)
+            print_moov_stats(m4af);
+    }
+    if (params->is_segment && write_segment_info(params, session) < 0)
+        goto END;
+    job->frames_read = aacenc_session_get_position(session);
+    job->sample_rate = aacenc_session_get_format(session)->sample_rate;
+    result = 0;
+END:
+    if (session) aacenc_session_close(&session);
+    if (close_output(params) < 0)
+        result = 2;
+
+    return job->result = result;
+}
+
+#if HAVE_PTHREAD_H && HAVE_STDATOMIC_H
+typedef struct rendition_job_t {
+    aacenc_job_t job;
+    pcm_reader_t *reader;
+    pthread_t thread;
+} rendition_job_t;
+
+static
+void *rendition_main(void *arg)
+{
+    rendition_job_t *rendition = arg;
+    encode_stream(&rendition->job, rendition->reader);
+    return 0;
+}
+
+/* foo.m4a -> foo_<kbps>k.m4a */
+static
+char *generate_rendition_filename(const char *filename, unsigned bitrate)
+{
+    const char *ext = strrchr(aacenc_basename(filename), '.');
+    size_t len = ext ? ext - filename : strlen(filename);
+    char *p;
+
+    if ((p = malloc(strlen(filename) + 16)) != 0)
+        sprintf(p, "%.*s_%uk%s", (int)len, filename, bitrate / 1000,
+                ext ? ext : "");
+    return p;
+}
+
+/*
+ * Input is read and converted only once, and fed to the encoders of each
+ * rendition running on their own threads.
+ */
+static
+int encode_ladder(aacenc_job_t *job, pcm_reader_t *reader)
+{
+    aacenc_param_ex_t *params = &job->params;
+    unsigned i, n = params->num_renditions, nstarted = 0;
+    rendition_job_t *renditions = 0;
+    pcm_fanout_t *fanout = 0;
+    int result = 2;
+
+    if ((renditions = calloc(n, sizeof(rendition_job_t))) == 0 ||
+        (fanout = pcm_fanout_open(reader, n, LADDER_BLOCK_FRAMES,
+                                  FANOUT_DEPTH)) == 0) {
+        pcm_teardown(&reader);
+        goto END;
+    }
+    for (i = 0; i < n; ++i) {
+        aacenc_job_t *rj = &renditions[i].job;
+
+        rj->params = *params;
+        rj->params.num_renditions = 0;
+        rj->params.input_fp = 0;
+        rj->params.input_map.cookie = 0;
+        rj->params.input_uring.cookie = 0;
+        rj->params.input_prefetch.cookie = 0;
+        rj->params.input_throttle.cookie = 0;
+        if (params->ladder[i].profile)
+            rj->params.profile = params->ladder[i].profile;
+        rj->params.bitrate = params->ladder[i].bitrate;
+        rj->params.bitrate_mode = 0;
+        /* progress is shown only for the first one */
+        rj->params.silent = params->silent || i > 0;
+        rj->output_filename =
+            generate_rendition_filename(params->output_filename,
+                                        rj->params.bitrate);
+        if (!rj->output_filename)
+            goto END;
+        rj->params.output_filename = rj->output_filename;
+        rj->result = -1;
+    }
+    for (; nstarted < n; ++nstarted) {
+        rendition_job_t *r = &renditions[nstarted];
+        r->reader = pcm_fanout_get_tap(fanout, nstarted);
+        if (pthread_create(&r->thread, 0, rendition_main, r) != 0) {
+            fprintf(stderr, "ERROR: failed to create thread\n");
+            break;
+        }
+    }
+    /* detach taps that have no consumer, or fanout would wait for them */
+    for (i = nstarted; i < n; ++i)
+        pcm_teardown(&renditions[i].reader);
+    if (nstarted)
+        pcm_fanout_run(fanout);
+    for (i = 0; i < nstarted; ++i)
+        pthread_join(renditions[i].thread, 0);
+
+    result = 0;
+    for (i = 0; i < n; ++i)
+        if (renditions[i].job.result)
+            result = 2;
+    job->frames_read = renditions[0].job.frames_read;
+    job->sample_rate = renditions[0].job.sample_rate;
+END:
+    if (fanout) pcm_fanout_teardown(&fanout);
+    if (renditions) {
+        for (i = 0; i < n; ++i)
+            if (renditions[i].job.output_filename)
+                free(renditions[i].job.output_filename);
+        free(renditions);
+    }
+    return job->result = result;
+}
+typedef struct track_input_t {
+    aacenc_param_ex_t params;
+    pcm_fanout_t *fanout;
+    unsigned ntaps;
+    unsigned next_tap;
+    pthread_t thread;
+    int thread_started;
+} track_input_t;
+
+typedef struct track_job_t {
+    aacenc_param_ex_t params;
+    aacenc_session_t *session;
+    aacenc_progress_t progress;
+    track_mux_t *mux;
+    unsigned index;
+    pthread_t thread;
+    int thread_started;
+    int result;
+} track_job_t;
+
+static
+void *track_input_main(void *arg)
+{
+    pcm_fanout_run(arg);
+    return 0;
+}
+
+static
+int track_write_frame(void *cookie, aacenc_frame_t *frame)
+{
+    track_job_t *track = cookie;
+    return track_mux_write(track->mux, track->index, frame);
+}
+
+static
+void *track_main(void *arg)
+{
+    track_job_t *track = arg;
+
+    /* finalize or close detaches from the fanout, so it won't wait for us */
+    if ((track->result = aacenc_session_run(track->session)) == 0)
+        track->result = aacenc_session_finalize(track->session);
+    if (track->result < 0)
+        aacenc_session_close(&track->session);
+    else if (!track->params.silent)
+        aacenc_progress_finish(&track->progress,
+                               aacenc_session_get_position(track->session));
+    track_mux_finish(track->mux, track->index, track->result < 0);
+    return 0;
+}
+
+/*
+ * Encode multiple tracks into one M4A file in one pass.
+ * Each input is read only once and distributed to tracks using it, and
+ * each track is encoded on its own thread.
+ */
+static
+int encode_tracks(aacenc_job_t *job)
+{
+    aacenc_param_ex_t *params = &job->params;
+    m4af_io_callbacks_t *io;
+    void *io_cookie;
+    unsigned i, j, ntracks = params->num_tracks, ninputs = 0;
+    int length_known = 1;
+    int64_t size_hint = 0;
+    track_input_t *inputs = 0;
+    track_job_t *tracks = 0;
+    track_mux_t mux = { 0 };
+    m4af_ctx_t *m4af = 0;
+    int result = 2;
+
+    if ((inputs = calloc(ntracks, sizeof(track_input_t))) == 0 ||
+        (tracks = calloc(ntracks, sizeof(track_job_t))) == 0)
+        goto END;
+    for (i = 0; i < ntracks; ++i) {
+        const char *filename = params->tracks[i].input_filename;
+        for (j = 0; j < ninputs; ++j)
+            if (!strcmp(inputs[j].params.input_filename, filename))
+                break;
+        if (j == ninputs) {
+            inputs[ninputs].params = *params;
+            inputs[ninputs].params.input_filename = (char*)filename;
+            memset(&inputs[ninputs].params.source_tags, 0,
+                   sizeof(aacenc_tag_store_t));
+            ++ninputs;
+        }
+        ++inputs[j].ntaps;
+    }
+    for (j = 0; j < ninputs; ++j) {
+        pcm_reader_t *reader = open_input(&inputs[j].params);
+        if (!reader)
+            goto END;
+        inputs[j].fanout = pcm_fanout_open(reader, inputs[j].ntaps,
+                                           LADDER_BLOCK_FRAMES,
+                                           FANOUT_DEPTH);
+        if (!inputs[j].fanout) {
+            pcm_teardown(&reader);
+            goto END;
+        }
+    }
+    if (track_mux_init(&mux, 0, ntracks) < 0)
+        goto END;
+
+    for (i = 0; i < ntracks; ++i) {
+        track_job_t *track = &tracks[i];
+        track_input_t *input;
+        pcm_reader_t *reader;
+
+        for (j = 0; strcmp(inputs[j].params.input_filename,
+                           params->tracks[i].input_filename); ++j)
+            ;
+        input = &inputs[j];
+        track->params = *params;
+        if (params->tracks[i].profile)
+            track->params.profile = params->tracks[i].profile;
+        track->params.bitrate = params->tracks[i].bitrate;
+        track->params.bitrate_mode = 0;
+        track->params.silent = params->silent || i > 0;
+        track->params.source_tags = input->params.source_tags;
+        track->mux = &mux;
+        track->index = i;
+        reader = pcm_fanout_get_tap(input->fanout, input->next_tap++);
+        if (pcm_get_length(reader) < 0 || pcm_get_length(reader) == INT64_MAX)
+            length_known = 0;
+        size_hint += estimate_output_size(pcm_get_length(reader),
+                                          pcm_get_format(reader)->sample_rate,
+                                          track->params.bitrate);
+        aacenc_progress_init(&track->progress, pcm_get_length(reader),
+                             pcm_get_format(reader)->sample_rate);
+        track->session =
+            aacenc_session_open_reader((aacenc_session_params_t*)&track->params,
+                                       reader);
+        if (!track->session)
+            goto END;
+        aacenc_session_set_frame_callback(track->session, track_write_frame,
+                                          track);
+        if (!track->params.silent)
+            aacenc_session_set_progress_callback(track->session,
+                                                 progress_callback,
+                                                 &track->progress);
+        mux.tracks[i].timescale =
+            aacenc_session_get_timescale(track->session,
+                                         &mux.tracks[i].frame_duration);
+    }
+
+    if ((io_cookie = open_output(params, &io, size_hint)) == 0)
+        goto END;
+    handle_signals();
+
+    if ((m4af = m4af_create(M4AF_CODEC_MP4A, mux.tracks[0].timescale,
+                            io, io_cookie, params->no_timestamp)) == 0)
+        goto END;
+    if (params->fragment_duration)
+        m4af_set_fragment_duration(m4af, params->fragment_duration);
+    for (i = 1; i < ntracks; ++i)
+        if (m4af_add_track(m4af, M4AF_CODEC_MP4A,
+                           mux.tracks[i].timescale) < 0)
+            goto END;
+    for (i = 0; i < ntracks; ++i)
+        aacenc_session_setup_m4a_track(tracks[i].session, m4af, i);
+    m4af_set_priming_mode(m4af, params->gapless_mode + 1);
+    put_tags(m4af, &tracks[0].params,
+             aacEncoder_GetParam(aacenc_session_get_encoder(tracks[0].session),
+                                 AACENC_BITRATE));
+    if (setup_spool(params, m4af, length_known) < 0)
+        goto END;
+    m4af_begin_write(m4af);
+    mux.m4af = m4af;
+
+    for (i = 0; i < ntracks; ++i) {
+        if (pthread_create(&tracks[i].thread, 0, track_main, &tracks[i])) {
+            fprintf(stderr, "ERROR: failed to create thread\n");
+            tracks[i].result = -1;
+            aacenc_session_close(&tracks[i].session);
+            track_mux_finish(&mux, i, 1);
+        } else
+            tracks[i].thread_started = 1;
+    }
+    for (j = 0; j < ninputs; ++j) {
+        if (pthread_create(&inputs[j].thread, 0, track_input_main,
+                           inputs[j].fanout) == 0)
+            inputs[j].thread_started = 1;
+        else {
+            /*
+             * Let the tracks fail on the first write, and keep feeding
+             * until they have gone.
+             */
+            fprintf(stderr, "ERROR: failed to create thread\n");
+            track_mux_abort(&mux);
+            pcm_fanout_run(inputs[j].fanout);
+        }
+    }
+    for (j = 0; j < ninputs; ++j)
+        if (inputs[j].thread_started)
+            pthread_join(inputs[j].thread, 0);
+    for (i = 0; i < ntracks; ++i)
+        if (tracks[i].thread_started)
+            pthread_join(tracks[i].thread, 0);
+
+    for (i = 0; i < ntracks; ++i)
+        if (tracks[i].result < 0)
+            goto END;
+    for (i = 0; i < ntracks; ++i)
+        aacenc_session_set_m4a_priming(tracks[i].session, m4af, i);
+    if (m4af_finalize(m4af, params->moov_before_mdat) < 0) {
+        fprintf(stderr, "ERROR: failed to finalize m4a\n");
+        goto END;
+    }
+    if (params->print_stats) {
+        print_throttle_stats(params);
+        print_moov_stats(m4af);
+    }
+    job->frames_read = aacenc_session_get_position(tracks[0].session);
+    job->sample_rate = aacenc_session_get_format(tracks[0].session)->sample_rate;
+    result = 0;
+END:
+    if (tracks) {
+        for (i = 0; i < ntracks; ++i)
+            if (tracks[i].session)
+                aacenc_session_close(&tracks[i].session);
+        free(tracks);
+    }
+    if (inputs) {
+        for (j = 0; j < ninputs; ++j) {
+            if (inputs[j].fanout) pcm_fanout_teardown(&inputs[j].fanout);
+            close_input(&inputs[j].params);
+            if (inputs[j].params.source_tags.tag_table)
+                aacenc_free_tag_store(&inputs[j].params.source_tags);
+        }
+        free(inputs);
+    }
+    track_mux_destroy(&mux);
+    if (m4af) m4af_teardown(&m4af);
+    if (close_output(params) < 0)
+        result = 2;
+
+    return job->result = result;
+}
+#endif
+
+static
+int encode_job(aacenc_job_t *job)
+{
+    aacenc_param_ex_t *params = &job->params;
+    pcm_reader_t *reader;
+    int64_t start = aacenc_timer();
+
+    if (!params->output_filename) {
+        char ext[32];
+        const char *input = params->num_tracks ?
+            params->tracks[0].input_filename : params->input_filename;
+        if (params->is_segment)
+            sprintf(ext, "_%" PRId64 ".seg", params->segment_start);
+        else if (params->cmaf_segments)
+            strcpy(ext, ".m3u8");
+        else
+            strcpy(ext, params->transport_format ? ".aac" : ".m4a");
+        job->output_filename = generate_output_filename(input, ext);
+        params->output_filename = job->output_filename;
+    }
+    if (params->num_tracks) {
+#if HAVE_PTHREAD_H && HAVE_STDATOMIC_H
+        encode_tracks(job);
+#endif
+    } else if ((reader = open_input(params)) == 0)
+        job->result = 2;
+#if HAVE_PTHREAD_H && HAVE_STDATOMIC_H
+    else if (params->num_renditions)
+        encode_ladder(job, reader);
+#endif
+    else
+        encode_stream(job, reader);
+
+    job->elapsed = (aacenc_timer() - start) / 1000.0;
+    close_input(params);
+    if (params->source_tags.tag_table)
+        aacenc_free_tag_store(&params->source_tags);
+
+    return job->result;
+}
+
+static
+int read_list_file(const char *filename, char ***names, unsigned *count)
+{
+    FILE *fp;
+    char buf[4096];
+    unsigned capacity = *count;
+    int rc = -1;
+
+    if (strcmp(filename, "-") == 0)
+        fp = stdin;
+    else if ((fp = aacenc_fopen(filename, "r")) == 0) {
+        aacenc_fprintf(stderr, "ERROR: %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    while (fgets(buf, sizeof buf, fp)) {
+        size_t len = strcspn(buf, "\r\n");
+        buf[len] = 0;
+        if (!len)
+            continue;
+        if (*count == capacity) {
+            char **p;
+            capacity = capacity ? capacity * 2 : 64;
+            if ((p = realloc(*names, capacity * sizeof(char*))) == 0)
+                goto END;
+            *names = p;
+        }
+        if (((*names)[*count] = strdup(buf)) == 0)
+            goto END;
+        ++*count;
+    }
+    rc = ferror(fp) ? -1 : 0;
+END:
+    if (fp != stdin) fclose(fp);
+    return rc;
+}
+
+static
+int compare_job_length(const void *a, const void *b)
+{
+    const aacenc_job_t *x = *(const aacenc_job_t **)a;
+    const aacenc_job_t *y = *(const aacenc_job_t **)b;
+    return x->length < y->length ? 1 : x->length > y->length ? -1 : 0;
+}
+
+static
+int compare_output_filename(const void *a, const void *b)
+{
+    const aacenc_job_t *x = *(const aacenc_job_t **)a;
+    const aacenc_job_t *y = *(const aacenc_job_t **)b;
+    return strcmp(x->output_filename, y->output_filename);
+}
+
+/* open input just to know the length, for longest-first scheduling */
+static
+int probe_input_length(aacenc_job_t *job)
+{
+    aacenc_param_ex_t params = job->params;
+    pcm_reader_t *reader;
+    int rc = -1;
+
+    if ((reader = open_input(&params)) != 0) {
+        job->length = pcm_get_length(reader);
+        pcm_teardown(&reader);
+        rc = 0;
+    }
+    close_input(&params);
     if (params.source_tags.tag_table)
         aacenc_free_tag_store(&params.source_tags);
+    return rc;
+}
+
+typedef struct job_queue_t {
+    aacenc_job_t **jobs;
+    unsigned count;
+    unsigned next;
+#if HAVE_PTHREAD_H
+    pthread_mutex_t mutex;
+#endif
+} job_queue_t;
+
+static
+aacenc_job_t *next_job(job_queue_t *queue)
+{
+    aacenc_job_t *job = 0;
+    const char *upcoming = 0;
+
+#if HAVE_PTHREAD_H
+    pthread_mutex_lock(&queue->mutex);
+#endif
+    if (!g_interrupted && queue->next < queue->count) {
+        job = queue->jobs[queue->next++];
+        if (queue->next < queue->count)
+            upcoming = queue->jobs[queue->next]->params.input_filename;
+    }
+#if HAVE_PTHREAD_H
+    pthread_mutex_unlock(&queue->mutex);
+#endif
+    /* warm up page cache for the input of the job to be started next */
+    if (upcoming)
+        aacenc_prefetch_file(upcoming);
+    return job;
+}
+
+static
+void *job_worker(void *arg)
+{
+    job_queue_t *queue = arg;
+    aacenc_job_t *job;
+
+    while ((job = next_job(queue)) != 0)
+        encode_job(job);
+    return 0;
+}
+
+static
+void print_job_summary(aacenc_job_t *jobs, unsigned count)
+{
+    unsigned i, failed = 0;
+
+    fputs("\n", stderr);
+    for (i = 0; i < count; ++i) {
+        aacenc_job_t *job = &jobs[i];
+        if (job->result == 0) {
+            double seconds = (double)job->frames_read / job->sample_rate;
+            aacenc_fprintf(stderr, "[%u/%u] %s -> %s: done, %.3fs in %.3fs "
+                           "(%.1fx)\n", i + 1, count,
+                           job->params.input_filename,
+                           job->params.output_filename, seconds, job->elapsed,
+                           job->elapsed > 0 ? seconds / job->elapsed : 0.0);
+        } else {
+            aacenc_fprintf(stderr, "[%u/%u] %s: %s\n", i + 1, count,
+                           job->params.input_filename,
+                           job->result < 0 ? "skipped" : "failed");
+            ++failed;
+        }
+    }
+    fprintf(stderr, "%u succeeded, %u failed\n", count - failed, failed);
+}
+
+typedef struct segment_info_t {
+    const char *filename;
+    int64_t start, end;         /* end is -1 when open */
+    int64_t length;             /* -1 unless the last segment */
+    unsigned frames;
+    unsigned sample_rate, channels, timescale, frame_duration, delay;
+    unsigned bitrate_mode, bitrate;
+    uint8_t asc[64];
+    uint32_t ascsize;
+} segment_info_t;
+
+static
+int load_segment_info(const char *filename, segment_info_t *info)
+{
+    char *path;
+    JSON_Value *json = 0;
+    JSON_Object *obj;
+    const char *asc;
+    size_t i;
+    int rc = -1;
+
+    memset(info, 0, sizeof(segment_info_t));
+    info->filename = filename;
+    if ((path = malloc(strlen(filename) + 6)) == 0)
+        return -1;
+    sprintf(path, "%s.json", filename);
+    if ((json = json_parse_file(path)) == 0 ||
+        (obj = json_value_get_object(json)) == 0) {
+        aacenc_fprintf(stderr, "ERROR: %s: broken or missing sidecar\n",
+                       path);
+        goto END;
+    }
+    info->start = json_object_get_number(obj, "start");
+    info->end = json_value_get_type(json_object_get_value(obj, "end"))
+        == JSONNumber ? json_object_get_number(obj, "end") : -1;
+    info->length = json_object_get_value(obj, "length") ?
+        json_object_get_number(obj, "length") : -1;
+    info->frames = json_object_get_number(obj, "frames");
+    info->sample_rate = json_object_get_number(obj, "sample_rate");
+    info->channels = json_object_get_number(obj, "channels");
+    info->timescale = json_object_get_number(obj, "timescale");
+    info->frame_duration = json_object_get_number(obj, "frame_duration");
+    info->delay = json_object_get_number(obj, "delay");
+    info->bitrate_mode = json_object_get_number(obj, "bitrate_mode");
+    info->bitrate = json_object_get_number(obj, "bitrate");
+    asc = json_object_get_string(obj, "asc");
+    if (!asc || strlen(asc) > 2 * sizeof(info->asc) || !info->timescale ||
+        !info->frame_duration || info->sample_rate < info->timescale) {
+        aacenc_fprintf(stderr, "ERROR: %s: broken sidecar\n", path);
+        goto END;
+    }
+    for (i = 0; asc[i] && asc[i + 1]; i += 2) {
+        unsigned n;
+        sscanf(asc + i, "%2x", &n);
+        info->asc[info->ascsize++] = n;
+    }
+    rc = 0;
+END:
+    if (json) json_value_free(json);
+    free(path);
+    return rc;
+}
+
+static
+int compare_segment_start(const void *a, const void *b)
+{
+    const segment_info_t *x = a, *y = b;
+
+    if (x->start != y->start)
+        return x->start < y->start ? -1 : 1;
+    /* empty one first */
+    return (uint64_t)x->end < (uint64_t)y->end ? -1 : 1;
+}
+
+static
+int copy_segment_frames(m4af_ctx_t *m4af, const segment_info_t *info)
+{
+    FILE *fp;
+    uint8_t buf[65536], size[2];
+    unsigned n, count = 0;
+    int rc = -1;
+
+    if ((fp = aacenc_fopen(info->filename, "rb")) == 0) {
+        aacenc_fprintf(stderr, "ERROR: %s: %s\n", info->filename,
+                       strerror(errno));
+        return -1;
+    }
+    while (fread(size, 1, 2, fp) == 2) {
+        n = size[0] << 8 | size[1];
+        if (fread(buf, 1, n, fp) != n)
+            break;
+        if (m4af_write_sample(m4af, 0, buf, n, 0) < 0) {
+            fprintf(stderr, "ERROR: failed to write m4a sample\n");
+            goto END;
+        }
+        ++count;
+    }
+    if (count != info->frames || !feof(fp)) {
+        aacenc_fprintf(stderr, "ERROR: %s: truncated segment\n",
+                       info->filename);
+        goto END;
+    }
+    rc = 0;
+END:
+    fclose(fp);
+    return rc;
+}
+
+/* join outputs of segment mode into one M4A */
+static
+int merge_segments(aacenc_param_ex_t *params)
+{
+    segment_info_t *segs = 0, *last;
+    m4af_io_callbacks_t *io;
+    void *io_cookie;
+    m4af_ctx_t *m4af = 0;
+    char *output_filename = 0;
+    unsigned i, n = params->num_input_files, shift;
+    int64_t frames = 0;
+    uint32_t padding;
+    int result = 2;
 
+    if ((segs = calloc(n, sizeof(segment_info_t))) == 0)
+        return 2;
+    for (i = 0; i < n; ++i)
+        if (load_segment_info(params->input_files[i], &segs[i]) < 0)
+            goto END;
+    qsort(segs, n, sizeof(segment_info_t), compare_segment_start);
+    for (i = 0; i < n; ++i) {
+        if (segs[i].start != (i ? segs[i - 1].end : 0) ||
+            (i < n - 1 && segs[i].end < 0)) {
+            aacenc_fprintf(stderr, "ERROR: %s: segment doesn't start at %"
+                           PRId64 "\n", segs[i].filename,
+                           i ? segs[i - 1].end : 0);
+            goto END;
+        }
+        if (segs[i].sample_rate != segs[0].sample_rate ||
+            segs[i].channels != segs[0].channels ||
+            segs[i].frame_duration != segs[0].frame_duration ||
+            segs[i].delay != segs[0].delay ||
+            segs[i].ascsize != segs[0].ascsize ||
+            memcmp(segs[i].asc, segs[0].asc, segs[0].ascsize)) {
+            aacenc_fprintf(stderr, "ERROR: %s: encoder configuration "
+                           "differs from other segments\n", segs[i].filename);
+            goto END;
+        }
+        frames += segs[i].frames;
+    }
+    last = &segs[n - 1];
+    if (last->length < 0) {
+        fprintf(stderr, "ERROR: segment at the end of input is missing\n");
+        goto END;
+    }
+
+    if (!params->output_filename) {
+        output_filename = generate_output_filename(segs[0].filename, ".m4a");
+        params->output_filename = output_filename;
+    }
+    if ((io_cookie = open_output(params, &io, 0)) == 0)
+        goto END;
+    m4af = m4af_create(M4AF_CODEC_MP4A, segs[0].timescale, io, io_cookie,
+                       params->no_timestamp);
+    if (!m4af)
+        goto END;
+    m4af_set_num_channels(m4af, 0, segs[0].channels);
+    m4af_set_fixed_frame_duration(m4af, 0, segs[0].frame_duration);
+    m4af_set_decoder_specific_info(m4af, 0, segs[0].asc, segs[0].ascsize);
+    m4af_set_vbr_mode(m4af, 0, segs[0].bitrate_mode);
+    /* 6144 bits per channel is the limit of an AAC frame */
+    m4af_set_bitrate_hint(m4af, 0, segs[0].bitrate,
+                          segs[0].channels * 768);
+    m4af_set_priming_mode(m4af, params->gapless_mode + 1);
+    if (params->moov_before_mdat)
+        m4af_set_expected_samples(m4af, 0, frames);
+    if (params->fragment_duration)
+        m4af_set_fragment_duration(m4af, params->fragment_duration);
+    /*
+     * same as aacenc_session_set_m4a_priming(), known in advance here
+     * (fragmented moov is written by m4af_begin_write())
+     */
+    shift = segs[0].sample_rate / segs[0].timescale - 1;
+    padding = (frames * segs[0].frame_duration << shift) - last->length
+            - segs[0].delay;
+    m4af_set_priming(m4af, 0, segs[0].delay >> shift, padding >> shift);
+    params->bitrate_mode = segs[0].bitrate_mode;
+    put_tags(m4af, params, segs[0].bitrate);
+    if (setup_spool(params, m4af, 1) < 0)
+        goto END;
+    m4af_begin_write(m4af);
+    for (i = 0; i < n; ++i)
+        if (copy_segment_frames(m4af, &segs[i]) < 0)
+            goto END;
+
+    if (m4af_finalize(m4af, params->moov_before_mdat) < 0) {
+        fprintf(stderr, "ERROR: failed to finalize m4a\n");
+        goto END;
+    }
+    if (params->print_stats) {
+        print_throttle_stats(params);
+        print_moov_stats(m4af);
+    }
+    result = 0;
+END:
+    if (m4af) m4af_teardown(&m4af);
+    if (close_output(params) < 0)
+        result = 2;
+    if (output_filename) free(output_filename);
+    free(segs);
+    return result;
+}
+
+static
+int encode_batch(aacenc_param_ex_t *params)
+{
+    char **names = 0;
+    unsigned i, count = 0, nworkers = params->num_jobs ? params->num_jobs : 1;
+    aacenc_job_t *jobs = 0;
+    job_queue_t queue = { 0 };
+    const char *ext = params->transport_format ? ".aac" : ".m4a";
+    int result = 2;
+
+    if (params->cmaf_segments)
+        ext = ".m3u8";
+
+    if (params->num_input_files &&
+        (names = malloc(params->num_input_files * sizeof(char*))) == 0)
+        goto END;
+    for (i = 0; i < params->num_input_files; ++i) {
+        if ((names[count] = strdup(params->input_files[i])) == 0)
+            goto END;
+        ++count;
+    }
+    if (params->list_filename &&
+        read_list_file(params->list_filename, &names, &count) < 0)
+        goto END;
+    if (!count) {
+        fprintf(stderr, "ERROR: no input file\n");
+        goto END;
+    }
+    if ((jobs = calloc(count, sizeof(aacenc_job_t))) == 0 ||
+        (queue.jobs = malloc(count * sizeof(aacenc_job_t*))) == 0)
+        goto END;
+
+    for (i = 0; i < count; ++i) {
+        aacenc_job_t *job = &jobs[i];
+        if (strcmp(names[i], "-") == 0) {
+            fprintf(stderr, "ERROR: stdin is not available on batch mode\n");
+            goto END;
+        }
+        job->params = *params;
+        job->params.input_filename = names[i];
+        if (nworkers > 1)
+            job->params.silent = 1;
+        job->output_filename = generate_output_filename(names[i], ext);
+        job->params.output_filename = job->output_filename;
+        job->result = -1;
+        queue.jobs[i] = job;
+    }
+    qsort(queue.jobs, count, sizeof(aacenc_job_t*), compare_output_filename);
+    for (i = 1; i < count; ++i) {
+        if (!strcmp(queue.jobs[i-1]->output_filename,
+                    queue.jobs[i]->output_filename)) {
+            aacenc_fprintf(stderr, "ERROR: %s: output filename conflicts\n",
+                           queue.jobs[i]->output_filename);
+            goto END;
+        }
+    }
+    /*
+     * Longest job first. Inputs that failed to open are not scheduled,
+     * since the error has already been reported.
+     */
+    queue.count = 0;
+    for (i = 0; i < count; ++i) {
+        if (nworkers == 1)
+            queue.jobs[queue.count++] = &jobs[i];
+        else if (probe_input_length(&jobs[i]) == 0)
+            queue.jobs[queue.count++] = &jobs[i];
+        else
+            jobs[i].result = 2;
+    }
+    if (nworkers > 1)
+        qsort(queue.jobs, queue.count, sizeof(aacenc_job_t*),
+              compare_job_length);
+
+    handle_signals();
+#if HAVE_PTHREAD_H
+    if (nworkers > 1) {
+        pthread_t *threads = calloc(nworkers, sizeof(pthread_t));
+        unsigned nthreads = 0;
+
+        if (!threads) goto END;
+        pthread_mutex_init(&queue.mutex, 0);
+        for (; nthreads < nworkers; ++nthreads)
+            if (pthread_create(&threads[nthreads], 0, job_worker, &queue))
+                break;
+        if (nthreads == 0)
+            job_worker(&queue);
+        for (i = 0; i < nthreads; ++i)
+            pthread_join(threads[i], 0);
+        pthread_mutex_destroy(&queue.mutex);
+        free(threads);
+    } else {
+        pthread_mutex_init(&queue.mutex, 0);
+        job_worker(&queue);
+        pthread_mutex_destroy(&queue.mutex);
+    }
+#else
+    job_worker(&queue);
+#endif
+    if (!params->silent)
+        print_job_summary(jobs, count);
+    result = 0;
+    for (i = 0; i < count; ++i)
+        if (jobs[i].result)
+            result = 2;
+END:
+    if (jobs) {
+        for (i = 0; i < count; ++i)
+            if (jobs[i].output_filename) free(jobs[i].output_filename);
+        free(jobs);
+    }
+    if (queue.jobs) free(queue.jobs);
+    if (names) {
+        for (i = 0; i < count; ++i)
+            free(names[i]);
+        free(names);
+    }
+    return result;
+}
+
+#if HAVE_PTHREAD_H && HAVE_SYS_UN_H
+/*
+ * Request parameters with the same name as the long option.
+ * Values are numbers (or booleans for flags).
+ */
+static const struct serve_param_t {
+    const char *name;
+    size_t offset;
+    int min, max;
+} serve_params[] = {
+    { "profile",           offsetof(aacenc_param_ex_t, profile),      0,  39 },
+    { "bitrate",           offsetof(aacenc_param_ex_t, bitrate),
+                                                                  0, INT_MAX },
+    { "bitrate-mode",      offsetof(aacenc_param_ex_t, bitrate_mode), 0,   5 },
+    { "bandwidth",         offsetof(aacenc_param_ex_t, bandwidth),
+                                                                  0, INT_MAX },
+    { "afterburner",       offsetof(aacenc_param_ex_t, afterburner),  0,   1 },
+    { "lowdelay-sbr",      offsetof(aacenc_param_ex_t, lowdelay_sbr), -1,  1 },
+    { "sbr-ratio",         offsetof(aacenc_param_ex_t, sbr_ratio),    0,   2 },
+    { "transport-format",  offsetof(aacenc_param_ex_t, transport_format),
+                                                                      0,  10 },
+    { "adts-crc-check",    offsetof(aacenc_param_ex_t, adts_crc_check), 0, 1 },
+    { "header-period",     offsetof(aacenc_param_ex_t, header_period),
+                                                                  0, INT_MAX },
+    { "gapless-mode",      offsetof(aacenc_param_ex_t, gapless_mode), 0,   2 },
+    { "include-sbr-delay", offsetof(aacenc_param_ex_t, include_sbr_delay),
+                                                                       0, 1 },
+    { "ignorelength",      offsetof(aacenc_param_ex_t, ignore_length), 0,  1 },
+    { "moov-before-mdat",  offsetof(aacenc_param_ex_t, moov_before_mdat),
+                                                                       0, 1 },
+    { "fragment-duration", offsetof(aacenc_param_ex_t, fragment_duration),
+                                                                  0, INT_MAX },
+    { "raw",               offsetof(aacenc_param_ex_t, is_raw),       0,   1 },
+    { "raw-channels",      offsetof(aacenc_param_ex_t, raw_channels), 1,   8 },
+    { "raw-rate",          offsetof(aacenc_param_ex_t, raw_rate),
+                                                                  1, INT_MAX },
+};
+
+static
+int parse_serve_params(aacenc_param_ex_t *params, JSON_Object *obj,
+                       char *error)
+{
+    size_t i, j;
+
+    for (i = 0; i < json_object_get_count(obj); ++i) {
+        const char *key = json_object_get_name(obj, i);
+        JSON_Value *value = json_object_get_value(obj, key);
+        double n;
+
+        if (!strcmp(key, "raw-format")) {
+            if (!(params->raw_format = json_value_get_string(value)))
+                goto INVALID;
+            continue;
+        }
+        for (j = 0; j < sizeof(serve_params)/sizeof(serve_params[0]); ++j)
+            if (!strcmp(key, serve_params[j].name))
+                break;
+        if (j == sizeof(serve_params)/sizeof(serve_params[0])) {
+            sprintf(error, "unknown param: %.64s", key);
+            return -1;
+        }
+        if (json_value_get_type(value) == JSONBoolean)
+            n = json_value_get_boolean(value);
+        else if (json_value_get_type(value) == JSONNumber)
+            n = json_value_get_number(value);
+        else
+            goto INVALID;
+        if (n != (int)n || n < serve_params[j].min || n > serve_params[j].max)
+            goto INVALID;
+        *(int *)((char *)params + serve_params[j].offset) = (int)n;
+    }
+    return 0;
+INVALID:
+    sprintf(error, "invalid value for %.64s", json_object_get_name(obj, i));
+    return -1;
+}
+
+static
+int serve_job(void *cookie, aacenc_server_job_t *server_job,
+              JSON_Object *request)
+{
+    aacenc_param_ex_t *defaults = cookie;
+    aacenc_job_t job = { 0 };
+    aacenc_param_ex_t *params = &job.params;
+    JSON_Object *obj;
+    unsigned i;
+    char error[256];
+    int result = -1;
+
+    *params = *defaults;
+    memset(&params->tags, 0, sizeof(params->tags));
+    params->silent = 1;
+    params->cancel = aacenc_server_job_get_cancel(server_job);
+    params->progress = aacenc_server_job_progress;
+    params->progress_cookie = server_job;
+
+    params->input_filename =
+        (char *)json_object_get_string(request, "input");
+    params->output_filename =
+        (char *)json_object_get_string(request, "output");
+    if (!params->input_filename || !strcmp(params->input_filename, "-") ||
+        (params->output_filename && !strcmp(params->output_filename, "-"))) {
+        aacenc_server_job_set_error(server_job, "input/output must be files");
+        return -1;
+    }
+    if ((obj = json_object_get_object(request, "params")) != 0 &&
+        parse_serve_params(params, obj, error) < 0) {
+        aacenc_server_job_set_error(server_job, error);
+        return -1;
+    }
+    if (!params->bitrate && !params->bitrate_mode) {
+        aacenc_server_job_set_error(server_job,
+                                    "bitrate or bitrate-mode is mandatory");
+        return -1;
+    }
+    if (params->bitrate && params->bitrate < 10000)
+        params->bitrate *= 1000;
+    if (params->is_raw) {
+        if (!params->raw_channels)
+            params->raw_channels = 2;
+        if (!params->raw_rate)
+            params->raw_rate = 44100;
+        if (!params->raw_format)
+            params->raw_format = "S16L";
+    }
+    for (i = 0; i < defaults->tags.tag_count; ++i)
+        aacenc_add_tag_entry_to_store(&params->tags,
+                                      &defaults->tags.tag_table[i]);
+    if ((obj = json_object_get_object(request, "tags")) != 0)
+        aacenc_add_tags_from_json_object(&params->tags, obj);
+
+    result = encode_job(&job);
+    if (job.output_filename) free(job.output_filename);
+    if (params->tags.tag_table)
+        aacenc_free_tag_store(&params->tags);
+    return result;
+}
+#endif
+
+/*
+ * Encoders kept in the pool while not in use: twice as many as can be in
+ * use at a time, by all jobs, threads and renditions.
+ */
+static
+unsigned max_idle_encoders(const aacenc_param_ex_t *params)
+{
+    unsigned workers = params->num_jobs ? params->num_jobs : 1;
+
+    if (params->num_threads > 1)
+        workers *= params->num_threads;
+    if (params->num_renditions)
+        workers *= params->num_renditions;
+    if (params->num_tracks)
+        workers *= params->num_tracks;
+    return 2 * workers;
+}
+
+int main(int argc, char **argv)
+{
+    aacenc_param_ex_t params = { 0 };
+    int result;
+
+    setlocale(LC_CTYPE, "");
+    setbuf(stderr, 0);
+
+    if (parse_options(argc, argv, &params) < 0)
+        return 1;
+
+    if ((params.pool = aacenc_pool_create(max_idle_encoders(&params))) == 0)
+        return 2;
+    params.cancel = &g_interrupted;
+    if (params.io_uring &&
+        (params.uring = aacenc_uring_create(URING_DEPTH)) == 0)
+        fprintf(stderr, "WARNING: io_uring is not available, "
+                        "falling back to synchronous I/O\n");
+    if (params.max_read_rate > 0.0 &&
+        (params.read_throttle =
+            aacenc_throttle_create(params.max_read_rate * 1e6)) == 0)
+        return 2;
+    if (params.max_write_rate > 0.0 &&
+        (params.write_throttle =
+            aacenc_throttle_create(params.max_write_rate * 1e6)) == 0)
+        return 2;
+    if (params.merge)
+        result = merge_segments(&params);
+    else if (params.serve_path) {
+#if HAVE_PTHREAD_H && HAVE_SYS_UN_H
+        handle_signals();
+        result = aacenc_server_run(params.serve_path,
+                                   params.num_jobs ? params.num_jobs : 1,
+                                   &g_interrupted, serve_job, &params) ? 2 : 0;
+#endif
+    } else if (params.input_filename || params.num_tracks) {
+        aacenc_job_t job = { 0 };
+        job.params = params;
+        result = encode_job(&job);
+        if (job.output_filename) free(job.output_filename);
+    } else
+        result = encode_batch(&params);
+
+    if (params.print_stats) {
+        unsigned hits, misses;
+        aacenc_pool_get_stats(params.pool, &hits, &misses);
+        fprintf(stderr, "encoder pool: %u hits, %u misses\n", hits, misses);
+        if (params.read_throttle || params.write_throttle)
+            fprintf(stderr, "throttle: %.3f s in total for reads, "
+                            "%.3f s for writes\n",
+                    params.read_throttle ?
+                        aacenc_throttle_get_wait(params.read_throttle) / 1e6
+                        : 0.0,
+                    params.write_throttle ?
+                        aacenc_throttle_get_wait(params.write_throttle) / 1e6
+                        : 0.0);
+    }
+    aacenc_pool_teardown(&params.pool);
+    if (params.uring)
+        aacenc_uring_destroy(&params.uring);
+    if (params.read_throttle)
+        aacenc_throttle_destroy(&params.read_throttle);
+    if (params.write_throttle)
+        aacenc_throttle_destroy(&params.write_throttle);
+    if (params.tags.tag_table)
+        aacenc_free_tag_store(&params.tags);
     return result;
 }
@@ -299,12 +299,37 @@ const char *aacenc_json_object_get_string(JSON_Object *obj, const char *key,
     return val;
 }
 
+static
+void translate_json_object(aacenc_translate_generic_text_tag_ctx_t *ctx,
+                           JSON_Object *obj)
+{
+    size_t i, nelts;
+
+    nelts = json_object_get_count(obj);
+    for (i = 0; i < nelts; ++i) {
+        char buf[256];
+        const char *key = json_object_get_name(obj, i);
+        const char *val = aacenc_json_object_get_string(obj, key, buf);
+        if (val) aacenc_translate_generic_text_tag(ctx, key, val, ~0U);
+    }
+    aacenc_translate_generic_text_tag(ctx, 0, 0, 0);
+}
+
+void aacenc_add_tags_from_json_object(aacenc_tag_store_t *store,
+                                      struct json_object_t *obj)
+{
+    aacenc_translate_generic_text_tag_ctx_t ctx = { 0 };
+
+    ctx.add = aacenc_add_tag_entry_to_store;
+    ctx.add_ctx = store;
+    translate_json_object(&ctx, obj);
+}
+
 void aacenc_write_tags_from_json(m4af_ctx_t *m4af, const char *json_filename)
 {
     char *data = 0;
     JSON_Value *json = 0;
     JSON_Object *root;
-    size_t i, nelts;
     uint32_t data_size;
     char *json_dot_path;
     char *filename = 0;
@@ -331,14 +356,7 @@ void aacenc_write_tags_from_json(m4af_ctx_t *m4af, const char *json_filename)
             goto DONE;
         }
     }
-    nelts = json_object_get_count(root);
-    for (i = 0; i < nelts; ++i) {
-        char buf[256];
-        const char *key = json_object_get_name(root, i);
-        const char *val = aacenc_json_object_get_string(root, key, buf);
-        if (val) aacenc_translate_generic_text_tag(&ctx, key, val, ~0U);
-    }
-    aacenc_translate_generic_text_tag(&ctx, 0, 0, 0);
+    translate_json_object(&ctx, root);
 DONE:
     if (data) free(data);
     if (filename) free(filename);
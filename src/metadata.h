@@ -41,6 +41,11 @@ void aacenc_add_tag_entry_to_store(void *store, const aacenc_tag_entry_t *tag);
 
 void aacenc_free_tag_store(aacenc_tag_store_t *store);
 
+/* obj is JSON_Object of parson */
+struct json_object_t;
+void aacenc_add_tags_from_json_object(aacenc_tag_store_t *store,
+                                      struct json_object_t *obj);
+
 void aacenc_write_tags_from_json(m4af_ctx_t *m4af, const char *json_filename);
 
 void aacenc_write_tag_entry(void *m4af, const aacenc_tag_entry_t *tag);
@@ -0,0 +1,230 @@
+/* 
+ * Copyright (C) 2013 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#if HAVE_CONFIG_H
+#  include "config.h"
+#endif
+#if HAVE_STDINT_H
+#  include <stdint.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "compat.h"
+#include "mmap_output.h"
+
+#if HAVE_SYS_MMAN_H && HAVE_MMAP && HAVE_POSIX_FALLOCATE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/* space is reserved by multiple of this */
+#define MMAP_ALLOC_UNIT (1 << 20)
+
+struct aacenc_mmap_output_t {
+    int fd;
+    int error;
+    uint8_t *window;
+    int64_t window_pos;     /* file offset of the window */
+    int64_t pos;
+    int64_t size;           /* written so far */
+    int64_t capacity;       /* reserved, which is the size of the file */
+};
+
+/* makes the file at least end bytes long, with blocks allocated */
+static int reserve(aacenc_mmap_output_t *self, int64_t end)
+{
+    int64_t n = self->capacity + self->capacity / 2;
+    int rc;
+
+    if (end <= self->capacity)
+        return 0;
+    if (n < end)
+        n = end;
+    n = (n + MMAP_ALLOC_UNIT - 1) & ~(int64_t)(MMAP_ALLOC_UNIT - 1);
+    rc = posix_fallocate(self->fd, self->capacity, n - self->capacity);
+    if (rc) {
+        errno = rc;
+        return -1;
+    }
+    self->capacity = n;
+    return 0;
+}
+
+/* returns the address of pos, moving the window as needed */
+static uint8_t *map(aacenc_mmap_output_t *self, int64_t pos)
+{
+    int64_t start = pos & ~(int64_t)(MMAP_OUTPUT_WINDOW - 1);
+    void *p;
+
+    if (!self->window || self->window_pos != start) {
+        if (self->window)
+            munmap(self->window, MMAP_OUTPUT_WINDOW);
+        /* window can span beyond EOF, which is never touched */
+        p = mmap(0, MMAP_OUTPUT_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 self->fd, start);
+        if (p == MAP_FAILED) {
+            self->window = 0;
+            return 0;
+        }
+        self->window = p;
+        self->window_pos = start;
+    }
+    return self->window + (pos - start);
+}
+
+/* copies from/to the file at the current position */
+static int transfer(aacenc_mmap_output_t *self, void *data, uint32_t size,
+                    int is_write)
+{
+    uint8_t *bp = data, *p;
+    uint32_t n, count = size;
+
+    while (count > 0) {
+        if ((p = map(self, self->pos)) == 0)
+            return -1;
+        n = self->window_pos + MMAP_OUTPUT_WINDOW - self->pos;
+        if (n > count)
+            n = count;
+        if (is_write)
+            memcpy(p, bp, n);
+        else
+            memcpy(bp, p, n);
+        bp += n;
+        count -= n;
+        self->pos += n;
+    }
+    return size;
+}
+
+static int mmap_write(void *cookie, const void *data, uint32_t size)
+{
+    aacenc_mmap_output_t *self = cookie;
+
+    if (self->error)
+        return -1;
+    if (reserve(self, self->pos + size) < 0 ||
+        transfer(self, (void *)data, size, 1) < 0) {
+        self->error = 1;
+        return -1;
+    }
+    if (self->size < self->pos)
+        self->size = self->pos;
+    return size;
+}
+
+static int mmap_read(void *cookie, void *data, uint32_t size)
+{
+    aacenc_mmap_output_t *self = cookie;
+
+    if (self->pos >= self->size)
+        return 0;
+    if (size > self->size - self->pos)
+        size = self->size - self->pos;
+    return transfer(self, data, size, 0);
+}
+
+static int mmap_seek(void *cookie, int64_t off, int whence)
+{
+    aacenc_mmap_output_t *self = cookie;
+    int64_t pos;
+
+    switch (whence) {
+    case SEEK_SET: pos = off; break;
+    case SEEK_CUR: pos = self->pos + off; break;
+    case SEEK_END: pos = self->size + off; break;
+    default: return -1;
+    }
+    if (pos < 0)
+        return -1;
+    self->pos = pos;
+    return 0;
+}
+
+static int64_t mmap_tell(void *cookie)
+{
+    return ((aacenc_mmap_output_t *)cookie)->pos;
+}
+
+static m4af_io_callbacks_t mmap_output_io = {
+    mmap_read, mmap_write, mmap_seek, mmap_tell
+};
+
+m4af_io_callbacks_t *aacenc_mmap_get_output_io(void)
+{
+    return &mmap_output_io;
+}
+
+aacenc_mmap_output_t *aacenc_mmap_open_output(FILE *fp, int64_t size_hint)
+{
+    aacenc_mmap_output_t *self;
+    struct stat st;
+    int64_t pos;
+    int flags = fcntl(fileno(fp), F_GETFL);
+
+    /* shared mapping needs read access, such as stdout opened by shell */
+    if (flags < 0 || (flags & O_ACCMODE) != O_RDWR || (flags & O_APPEND))
+        return 0;
+    if (fstat(fileno(fp), &st) < 0 || !S_ISREG(st.st_mode) ||
+        (pos = ftello(fp)) < 0)
+        return 0;
+    if ((self = calloc(1, sizeof(aacenc_mmap_output_t))) == 0)
+        return 0;
+    self->fd = fileno(fp);
+    self->pos = pos;
+    self->size = st.st_size;
+    self->capacity = st.st_size;
+    if (reserve(self, size_hint > pos ? size_hint : pos + 1) < 0) {
+        /*
+         * posix_fallocate() may have extended the file. When it cannot be
+         * cut back, the output is returned as failed, rather than letting
+         * stdio write a file with garbage at the end.
+         */
+        if (ftruncate(self->fd, self->size) == 0) {
+            free(self);
+            return 0;
+        }
+        self->error = 1;
+    }
+#if HAVE_POSIX_FADVISE
+    posix_fadvise(self->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    return self;
+}
+
+int aacenc_mmap_close_output(aacenc_mmap_output_t **output)
+{
+    aacenc_mmap_output_t *self = *output;
+    int error = self->error;
+
+    if (self->window)
+        munmap(self->window, MMAP_OUTPUT_WINDOW);
+    if (ftruncate(self->fd, self->size) < 0)
+        error = 1;
+    free(self);
+    *output = 0;
+    return error ? -1 : 0;
+}
+
+#else
+
+aacenc_mmap_output_t *aacenc_mmap_open_output(FILE *fp, int64_t size_hint)
+{
+    return 0;
+}
+
+m4af_io_callbacks_t *aacenc_mmap_get_output_io(void)
+{
+    return 0;
+}
+
+int aacenc_mmap_close_output(aacenc_mmap_output_t **output)
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,40 @@
+/* 
+ * Copyright (C) 2013 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#ifndef MMAP_OUTPUT_H
+#define MMAP_OUTPUT_H
+
+#include <stdio.h>
+#include "m4af.h"
+
+/*
+ * Writes a regular file through a shared mapping, after reserving its
+ * blocks with posix_fallocate().
+ *
+ * Space is reserved up front for the estimated size, and then grown by
+ * half of the current size at a time, so that the file is laid out
+ * contiguously even when many of them are written at once.
+ * Only a window of MMAP_OUTPUT_WINDOW bytes is mapped at a time, moved
+ * as the write position goes out of it.
+ * The file is truncated to the size actually written on close.
+ */
+#define MMAP_OUTPUT_WINDOW (64 << 20)
+
+typedef struct aacenc_mmap_output_t aacenc_mmap_output_t;
+
+/*
+ * size_hint is the estimated size of the output, 0 if unknown.
+ * Returns NULL when fp is not a regular file opened for both reading and
+ * writing, or space cannot be reserved on it, and always on systems
+ * without posix_fallocate(), where the file would only be made sparse.
+ * fp must not be written by stdio while the output is open.
+ */
+aacenc_mmap_output_t *aacenc_mmap_open_output(FILE *fp, int64_t size_hint);
+
+m4af_io_callbacks_t *aacenc_mmap_get_output_io(void);
+
+/* returns -1 if any write has failed */
+int aacenc_mmap_close_output(aacenc_mmap_output_t **output);
+
+#endif
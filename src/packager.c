@@ -0,0 +1,348 @@
+/* 
+ * Copyright (C) 2013 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#if HAVE_CONFIG_H
+#  include "config.h"
+#endif
+#if HAVE_STDINT_H
+#  include <stdint.h>
+#endif
+#if HAVE_INTTYPES_H
+#  include <inttypes.h>
+#elif defined _MSC_VER
+#  define PRId64 "I64d"
+#endif
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "compat.h"
+#include "packager.h"
+
+/* run of segments of the same duration, as <S> of SegmentTimeline */
+typedef struct segment_run_t {
+    int64_t start;
+    int64_t duration;
+    uint32_t count;
+} segment_run_t;
+
+struct aacenc_packager_t {
+    char *base;
+    const char *name;           /* basename of base, for URIs */
+    unsigned segment_duration;  /* in ms */
+    FILE *fp;                   /* init segment, or the current segment */
+    FILE *m3u8;
+    int error;
+
+    unsigned aot;
+    uint32_t timescale;
+    uint32_t sample_rate;
+    unsigned channels;
+
+    uint32_t sequence;          /* of the current segment, 0 for init */
+    int64_t start;              /* of the current segment, in timescale */
+    int64_t duration;
+
+    segment_run_t *runs;        /* of completed segments */
+    uint32_t num_runs;
+    uint32_t runs_capacity;
+    uint32_t max_bitrate;
+    time_t availability_start;
+};
+
+static
+int write_callback(void *cookie, const void *data, uint32_t size)
+{
+    FILE *fp = ((aacenc_packager_t *)cookie)->fp;
+    size_t rc = fwrite(data, 1, size, fp);
+    return ferror(fp) ? -1 : (int)rc;
+}
+
+static
+int seek_callback(void *cookie, int64_t off, int whence)
+{
+    return fseeko(((aacenc_packager_t *)cookie)->fp, off, whence);
+}
+
+static
+int64_t tell_callback(void *cookie)
+{
+    return ftello(((aacenc_packager_t *)cookie)->fp);
+}
+
+static m4af_io_callbacks_t packager_io = {
+    0, write_callback, seek_callback, tell_callback
+};
+
+m4af_io_callbacks_t *aacenc_packager_get_io(void)
+{
+    return &packager_io;
+}
+
+static
+char *make_path(aacenc_packager_t *self, const char *suffix)
+{
+    char *path = malloc(strlen(self->base) + strlen(suffix) + 1);
+    if (path)
+        sprintf(path, "%s%s", self->base, suffix);
+    return path;
+}
+
+static
+FILE *open_file(aacenc_packager_t *self, const char *suffix, const char *mode)
+{
+    char *path = make_path(self, suffix);
+    FILE *fp = 0;
+
+    if (path && (fp = aacenc_fopen(path, mode)) == 0)
+        aacenc_fprintf(stderr, "ERROR: %s: %s\n", path, strerror(errno));
+    free(path);
+    return fp;
+}
+
+/*
+ * Writes name as XML attribute value, also escaping $ of SegmentTemplate
+ * identifiers.
+ */
+static
+void put_template_name(FILE *fp, const char *name)
+{
+    for (; *name; ++name) {
+        switch (*name) {
+        case '&': fputs("&amp;", fp); break;
+        case '<': fputs("&lt;", fp); break;
+        case '"': fputs("&quot;", fp); break;
+        case '$': fputs("$$", fp); break;
+        default: fputc(*name, fp);
+        }
+    }
+}
+
+static
+void put_time(FILE *fp, const char *attr, time_t t)
+{
+    char buf[32];
+    struct tm tm;
+    /* packagers of --jobs run concurrently, don't use static storage */
+#ifdef _WIN32
+    gmtime_s(&tm, &t);
+#else
+    gmtime_r(&t, &tm);
+#endif
+    strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", &tm);
+    fprintf(fp, " %s=\"%s\"", attr, buf);
+}
+
+/* rewritten as a whole, and replaced by rename() to be read consistently */
+static
+int write_mpd(aacenc_packager_t *self, int is_final)
+{
+    char *path = make_path(self, ".mpd"), *tmp = make_path(self, ".mpd.tmp");
+    double total = 0.0;
+    FILE *fp = 0;
+    uint32_t i;
+    int rc = -1;
+
+    if (!path || !tmp || (fp = aacenc_fopen(tmp, "w")) == 0)
+        goto END;
+    for (i = 0; i < self->num_runs; ++i)
+        total += (double)self->runs[i].duration * self->runs[i].count;
+    total /= self->timescale;
+
+    fprintf(fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                "<MPD xmlns=\"urn:mpeg:dash:schema:mpd:2011\" "
+                "profiles=\"urn:mpeg:dash:profile:isoff-live:2011\"\n"
+                "     minBufferTime=\"PT%.3fS\"",
+            self->segment_duration / 1000.0);
+    if (is_final)
+        fprintf(fp, " type=\"static\" mediaPresentationDuration=\"PT%.3fS\"",
+                total);
+    else {
+        fprintf(fp, " type=\"dynamic\"");
+        put_time(fp, "availabilityStartTime", self->availability_start);
+        put_time(fp, "publishTime", time(0));
+        fprintf(fp, " minimumUpdatePeriod=\"PT%.3fS\"",
+                self->segment_duration / 1000.0);
+    }
+    fprintf(fp, ">\n"
+                "  <Period id=\"0\" start=\"PT0S\">\n"
+                "    <AdaptationSet contentType=\"audio\" "
+                "mimeType=\"audio/mp4\" lang=\"und\" "
+                "segmentAlignment=\"true\" startWithSAP=\"1\">\n"
+                "      <Representation id=\"0\" codecs=\"mp4a.40.%u\" "
+                "bandwidth=\"%u\" audioSamplingRate=\"%u\">\n"
+                "        <AudioChannelConfiguration schemeIdUri=\"urn:mpeg:"
+                "dash:23003:3:audio_channel_configuration:2011\" "
+                "value=\"%u\"/>\n"
+                "        <SegmentTemplate timescale=\"%u\" initialization=\"",
+            self->aot, self->max_bitrate, self->sample_rate, self->channels,
+            self->timescale);
+    put_template_name(fp, self->name);
+    fputs("_init.mp4\" media=\"", fp);
+    put_template_name(fp, self->name);
+    fputs("_$Number%05d$.m4s\" startNumber=\"1\">\n"
+          "          <SegmentTimeline>\n", fp);
+    for (i = 0; i < self->num_runs; ++i) {
+        segment_run_t *run = &self->runs[i];
+        fprintf(fp, "            <S t=\"%" PRId64 "\" d=\"%" PRId64 "\"",
+                run->start, run->duration);
+        if (run->count > 1)
+            fprintf(fp, " r=\"%u\"", run->count - 1);
+        fputs("/>\n", fp);
+    }
+    fputs("          </SegmentTimeline>\n"
+          "        </SegmentTemplate>\n"
+          "      </Representation>\n"
+          "    </AdaptationSet>\n"
+          "  </Period>\n"
+          "</MPD>\n", fp);
+    if (fclose(fp) == EOF)
+        goto END;
+#ifdef _WIN32
+    remove(path);
+#endif
+    rc = rename(tmp, path);
+END:
+    if (rc < 0)
+        aacenc_fprintf(stderr, "ERROR: %s: %s\n", path ? path : self->base,
+                       strerror(errno));
+    free(path);
+    free(tmp);
+    return rc;
+}
+
+static
+int add_segment_run(aacenc_packager_t *self)
+{
+    segment_run_t *run = self->num_runs ? &self->runs[self->num_runs - 1] : 0;
+
+    if (run && run->duration == self->duration &&
+        run->start + run->duration * run->count == self->start) {
+        ++run->count;
+        return 0;
+    }
+    if (self->num_runs == self->runs_capacity) {
+        uint32_t n = self->runs_capacity ? self->runs_capacity * 2 : 4;
+        if ((run = realloc(self->runs, n * sizeof(segment_run_t))) == 0)
+            return -1;
+        self->runs = run;
+        self->runs_capacity = n;
+    }
+    run = &self->runs[self->num_runs++];
+    run->start = self->start;
+    run->duration = self->duration;
+    run->count = 1;
+    return 0;
+}
+
+/* closes the current segment, and lists it on the playlists */
+static
+int finish_segment(aacenc_packager_t *self)
+{
+    int64_t size;
+    uint32_t bitrate;
+
+    if (!self->fp)
+        return 0;
+    size = ftello(self->fp);
+    if (fclose(self->fp) == EOF || size < 0)
+        self->error = 1;
+    self->fp = 0;
+    if (self->error)
+        return -1;
+    if (self->sequence == 0)
+        return 0;
+
+    bitrate = size * 8.0 * self->timescale / self->duration + .5;
+    if (bitrate > self->max_bitrate)
+        self->max_bitrate = bitrate;
+    fprintf(self->m3u8, "#EXTINF:%.3f,\n%s_%05u.m4s\n",
+            (double)self->duration / self->timescale, self->name,
+            self->sequence);
+    if (fflush(self->m3u8) == EOF || add_segment_run(self) < 0 ||
+        write_mpd(self, 0) < 0)
+        self->error = 1;
+    return self->error ? -1 : 0;
+}
+
+int aacenc_packager_begin_segment(void *cookie, uint32_t sequence,
+                                  int64_t start, int64_t duration)
+{
+    aacenc_packager_t *self = cookie;
+    char suffix[32];
+
+    if (finish_segment(self) < 0)
+        return -1;
+    sprintf(suffix, "_%05u.m4s", sequence);
+    if ((self->fp = open_file(self, suffix, "wb")) == 0) {
+        self->error = 1;
+        return -1;
+    }
+    self->sequence = sequence;
+    self->start = start;
+    self->duration = duration;
+    return 0;
+}
+
+aacenc_packager_t *aacenc_packager_open(const char *base,
+                                        unsigned segment_duration)
+{
+    aacenc_packager_t *self;
+
+    if ((self = calloc(1, sizeof(aacenc_packager_t))) == 0)
+        return 0;
+    if ((self->base = strdup(base)) == 0)
+        goto FAIL;
+    self->name = aacenc_basename(self->base);
+    self->segment_duration = segment_duration;
+    self->availability_start = time(0);
+    if ((self->fp = open_file(self, "_init.mp4", "wb")) == 0)
+        goto FAIL;
+    if ((self->m3u8 = open_file(self, ".m3u8", "w")) == 0)
+        goto FAIL;
+    fprintf(self->m3u8, "#EXTM3U\n"
+                        "#EXT-X-VERSION:7\n"
+                        "#EXT-X-TARGETDURATION:%u\n"
+                        "#EXT-X-PLAYLIST-TYPE:EVENT\n"
+                        "#EXT-X-MEDIA-SEQUENCE:1\n"
+                        "#EXT-X-INDEPENDENT-SEGMENTS\n"
+                        "#EXT-X-MAP:URI=\"%s_init.mp4\"\n",
+            (segment_duration + 999) / 1000, self->name);
+    return self;
+FAIL:
+    aacenc_packager_close(&self);
+    return 0;
+}
+
+void aacenc_packager_set_format(aacenc_packager_t *packager, unsigned aot,
+                                uint32_t timescale, uint32_t sample_rate,
+                                unsigned channels)
+{
+    packager->aot = aot;
+    packager->timescale = timescale;
+    packager->sample_rate = sample_rate;
+    packager->channels = channels;
+}
+
+int aacenc_packager_close(aacenc_packager_t **packager)
+{
+    aacenc_packager_t *self = *packager;
+    int rc = 0;
+
+    if (finish_segment(self) < 0)
+        rc = -1;
+    if (self->m3u8) {
+        fputs("#EXT-X-ENDLIST\n", self->m3u8);
+        if (fclose(self->m3u8) == EOF)
+            rc = -1;
+    }
+    if (self->num_runs && write_mpd(self, 1) < 0)
+        rc = -1;
+    free(self->runs);
+    free(self->base);
+    free(self);
+    *packager = 0;
+    return rc;
+}
@@ -0,0 +1,46 @@
+/* 
+ * Copyright (C) 2013 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#ifndef PACKAGER_H
+#define PACKAGER_H
+
+#include "m4af.h"
+
+/*
+ * Writes fragmented M4A as CMAF segments for HLS and DASH, in the same
+ * pass as encoding: <base>_init.mp4 (ftyp and moov), <base>_<n>.m4s for
+ * each fragment (numbered from 1), HLS media playlist <base>.m3u8, and
+ * DASH manifest <base>.mpd using SegmentTemplate.
+ *
+ * Playlists are updated as each segment is completed, so that players can
+ * start before encoding is done: m3u8 is an EVENT playlist appended with
+ * segments, and mpd is dynamic until closed, when it is rewritten as
+ * static.
+ *
+ * Usage: write m4af through aacenc_packager_get_io() with the packager as
+ * the cookie, and set aacenc_packager_begin_segment() as the fragment
+ * callback of m4af.
+ */
+
+typedef struct aacenc_packager_t aacenc_packager_t;
+
+/* segment_duration is in ms, used for EXT-X-TARGETDURATION */
+aacenc_packager_t *aacenc_packager_open(const char *base,
+                                        unsigned segment_duration);
+
+/* must be given before the first segment is completed */
+void aacenc_packager_set_format(aacenc_packager_t *packager, unsigned aot,
+                                uint32_t timescale, uint32_t sample_rate,
+                                unsigned channels);
+
+m4af_io_callbacks_t *aacenc_packager_get_io(void);
+
+/* m4af_fragment_callback */
+int aacenc_packager_begin_segment(void *cookie, uint32_t sequence,
+                                  int64_t start, int64_t duration);
+
+/* completes the last segment and playlists. returns -1 on write failure */
+int aacenc_packager_close(aacenc_packager_t **packager);
+
+#endif
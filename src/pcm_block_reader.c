@@ -0,0 +1,169 @@
+/* 
+ * Copyright (C) 2013 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#if HAVE_CONFIG_H
+#  include "config.h"
+#endif
+#if HAVE_STDINT_H
+#  include <stdint.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "compat.h"
+#include "pcm_reader.h"
+
+/*
+ * Reads the source by block_frames at a time into its own buffer, and
+ * hands out slices of it.
+ * Readers below (converters, limiter, and I/O) are called once per block
+ * instead of once per encoder frame, which amortizes their per-call cost.
+ */
+
+typedef struct pcm_block_reader_t {
+    pcm_reader_vtbl_t *vtbl;
+    pcm_reader_t *src;
+    pcm_sample_description_t format;
+    uint8_t *buffer;
+    unsigned block_frames;
+    unsigned count;         /* frames in the buffer */
+    unsigned pos;           /* frames consumed from the buffer */
+    unsigned acquired;
+    int64_t src_position;   /* position of the source after the block */
+    int eof;
+
+    int64_t blocks;
+    int64_t usec;           /* total time spent reading blocks */
+} pcm_block_reader_t;
+
+static inline pcm_reader_t *get_source(pcm_reader_t *reader)
+{
+    return ((pcm_block_reader_t *)reader)->src;
+}
+
+static const
+pcm_sample_description_t *get_format(pcm_reader_t *reader)
+{
+    return &((pcm_block_reader_t *)reader)->format;
+}
+
+static int64_t get_length(pcm_reader_t *reader)
+{
+    return pcm_get_length(get_source(reader));
+}
+
+static int64_t get_position(pcm_reader_t *reader)
+{
+    pcm_block_reader_t *self = (pcm_block_reader_t *)reader;
+
+    if (!self->blocks)
+        return pcm_get_position(self->src);
+    return self->src_position - (self->count - self->pos);
+}
+
+/* returns frames available in the buffer, 0 on EOF, -1 on error */
+static int fill(pcm_block_reader_t *self)
+{
+    int64_t start;
+    int nframes;
+
+    if (self->pos < self->count)
+        return self->count - self->pos;
+    if (self->eof)
+        return 0;
+    start = aacenc_timer_usec();
+    nframes = pcm_read_frames(self->src, self->buffer, self->block_frames);
+    self->usec += aacenc_timer_usec() - start;
+    if (nframes < 0)
+        return -1;
+    ++self->blocks;
+    self->count = nframes;
+    self->pos = 0;
+    self->src_position = pcm_get_position(self->src);
+    /* pcm_read_frames() returns short only on EOF */
+    if ((unsigned)nframes < self->block_frames)
+        self->eof = 1;
+    return nframes;
+}
+
+static int read_frames(pcm_reader_t *reader, void *buffer, unsigned nframes)
+{
+    pcm_block_reader_t *self = (pcm_block_reader_t *)reader;
+    unsigned bpf = self->format.bytes_per_frame;
+    int n;
+
+    if ((n = fill(self)) <= 0)
+        return n;
+    if ((unsigned)n > nframes)
+        n = nframes;
+    memcpy(buffer, self->buffer + self->pos * bpf, n * bpf);
+    self->pos += n;
+    return n;
+}
+
+static int acquire_frames(pcm_reader_t *reader, const void **data,
+                          unsigned nframes)
+{
+    pcm_block_reader_t *self = (pcm_block_reader_t *)reader;
+    int n;
+
+    if ((n = fill(self)) <= 0)
+        return n;
+    if ((unsigned)n > nframes)
+        n = nframes;
+    *data = self->buffer + self->pos * self->format.bytes_per_frame;
+    self->acquired = n;
+    return n;
+}
+
+static void release_frames(pcm_reader_t *reader)
+{
+    pcm_block_reader_t *self = (pcm_block_reader_t *)reader;
+
+    self->pos += self->acquired;
+    self->acquired = 0;
+}
+
+static void teardown(pcm_reader_t **reader)
+{
+    pcm_block_reader_t *self = (pcm_block_reader_t *)*reader;
+
+    pcm_teardown(&self->src);
+    free(self->buffer);
+    free(self);
+    *reader = 0;
+}
+
+static pcm_reader_vtbl_t my_vtable = {
+    get_format, get_length, get_position, read_frames, teardown,
+    acquire_frames, release_frames
+};
+
+pcm_reader_t *pcm_open_block_reader(pcm_reader_t *reader,
+                                    unsigned block_frames)
+{
+    pcm_block_reader_t *self = 0;
+
+    if ((self = calloc(1, sizeof(pcm_block_reader_t))) == 0)
+        return 0;
+    memcpy(&self->format, pcm_get_format(reader), sizeof(self->format));
+    self->buffer = malloc((size_t)block_frames * self->format.bytes_per_frame);
+    if (!self->buffer) {
+        free(self);
+        return 0;
+    }
+    self->src = reader;
+    self->vtbl = &my_vtable;
+    self->block_frames = block_frames;
+    return (pcm_reader_t *)self;
+}
+
+void pcm_get_block_stats(pcm_reader_t *reader, int64_t *blocks,
+                         int64_t *usec)
+{
+    pcm_block_reader_t *self = (pcm_block_reader_t *)reader;
+
+    *blocks = self->blocks;
+    *usec = self->usec;
+}
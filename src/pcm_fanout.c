@@ -0,0 +1,199 @@
+/* 
+ * Copyright (C) 2013 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#if HAVE_CONFIG_H
+#  include "config.h"
+#endif
+#if HAVE_STDINT_H
+#  include <stdint.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pcm_reader.h"
+
+#if HAVE_PTHREAD_H && HAVE_STDATOMIC_H
+#include "spsc_ring.h"
+
+/*
+ * Distributes output of a reader to multiple consumers (taps), each of
+ * which is a pcm_reader running on its own thread.
+ * pcm_fanout_run() reads the source by block_frames, and copies each block
+ * into bounded ring of every tap, therefore the slowest consumer limits
+ * the speed (and the memory usage).
+ * When a tap is torn down, it is simply skipped thereafter.
+ */
+
+typedef struct pcm_block_t {
+    int64_t position;   /* position of the source after this block */
+    int nframes;
+} pcm_block_t;
+
+typedef struct pcm_tap_t {
+    pcm_reader_vtbl_t *vtbl;
+    pcm_fanout_t *fanout;
+    spsc_ring_t *ring;
+    pcm_block_t *block;     /* block being consumed */
+    unsigned block_pos;
+    int64_t position;
+} pcm_tap_t;
+
+struct pcm_fanout_t {
+    pcm_reader_t *src;
+    pcm_sample_description_t format;
+    int64_t length;
+    unsigned block_frames;
+    size_t data_offset;
+    pcm_tap_t *taps;
+    unsigned ntaps;
+    pcm_block_t **slots;
+};
+
+static inline uint8_t *block_data(pcm_fanout_t *fanout, pcm_block_t *block)
+{
+    return (uint8_t *)block + fanout->data_offset;
+}
+
+static const
+pcm_sample_description_t *get_format(pcm_reader_t *reader)
+{
+    return &((pcm_tap_t *)reader)->fanout->format;
+}
+
+static int64_t get_length(pcm_reader_t *reader)
+{
+    return ((pcm_tap_t *)reader)->fanout->length;
+}
+
+static int64_t get_position(pcm_reader_t *reader)
+{
+    return ((pcm_tap_t *)reader)->position;
+}
+
+static int read_frames(pcm_reader_t *reader, void *buffer, unsigned nframes)
+{
+    pcm_tap_t *self = (pcm_tap_t *)reader;
+    unsigned n, bpf = self->fanout->format.bytes_per_frame;
+
+    if (!self->block || self->block_pos == self->block->nframes) {
+        if (self->block) {
+            spsc_ring_release(self->ring);
+            self->block = 0;
+        }
+        if ((self->block = spsc_ring_peek(self->ring)) == 0)
+            return 0;
+        self->block_pos = 0;
+    }
+    n = self->block->nframes - self->block_pos;
+    if (n > nframes)
+        n = nframes;
+    memcpy(buffer,
+           block_data(self->fanout, self->block) + self->block_pos * bpf,
+           n * bpf);
+    self->block_pos += n;
+    self->position = self->block->position
+                   - (self->block->nframes - self->block_pos);
+    return n;
+}
+
+static void teardown(pcm_reader_t **reader)
+{
+    pcm_tap_t *self = (pcm_tap_t *)*reader;
+    /* memory is owned by fanout. just let the producer know we're gone */
+    spsc_ring_close(self->ring);
+    *reader = 0;
+}
+
+static pcm_reader_vtbl_t my_vtable = {
+    get_format, get_length, get_position, read_frames, teardown
+};
+
+pcm_fanout_t *pcm_fanout_open(pcm_reader_t *reader, unsigned ntaps,
+                              unsigned block_frames, unsigned depth)
+{
+    pcm_fanout_t *self = 0;
+    size_t block_size;
+
+    if ((self = calloc(1, sizeof(pcm_fanout_t))) == 0)
+        return 0;
+    self->src = reader;
+    memcpy(&self->format, pcm_get_format(reader), sizeof(self->format));
+    self->length = pcm_get_length(reader);
+    self->block_frames = block_frames;
+    self->data_offset = (sizeof(pcm_block_t) + 15) & ~15;
+    block_size = self->data_offset
+               + block_frames * self->format.bytes_per_frame;
+    self->taps = calloc(ntaps, sizeof(pcm_tap_t));
+    self->slots = calloc(ntaps, sizeof(pcm_block_t*));
+    if (!self->taps || !self->slots)
+        goto FAIL;
+    for (; self->ntaps < ntaps; ++self->ntaps) {
+        pcm_tap_t *tap = &self->taps[self->ntaps];
+        tap->vtbl = &my_vtable;
+        tap->fanout = self;
+        if ((tap->ring = spsc_ring_create(depth, block_size)) == 0)
+            goto FAIL;
+    }
+    return self;
+FAIL:
+    pcm_fanout_teardown(&self);
+    return 0;
+}
+
+pcm_reader_t *pcm_fanout_get_tap(pcm_fanout_t *fanout, unsigned index)
+{
+    return (pcm_reader_t *)&fanout->taps[index];
+}
+
+void pcm_fanout_run(pcm_fanout_t *fanout)
+{
+    pcm_block_t *first;
+    unsigned i, bpf = fanout->format.bytes_per_frame;
+    int nframes;
+    int64_t position;
+
+    do {
+        for (first = 0, i = 0; i < fanout->ntaps; ++i) {
+            fanout->slots[i] = spsc_ring_reserve(fanout->taps[i].ring);
+            if (!first)
+                first = fanout->slots[i];
+        }
+        if (!first)
+            break; /* no one is listening */
+        nframes = pcm_read_frames(fanout->src, block_data(fanout, first),
+                                  fanout->block_frames);
+        position = pcm_get_position(fanout->src);
+        for (i = 0; i < fanout->ntaps; ++i) {
+            pcm_block_t *block = fanout->slots[i];
+            if (!block)
+                continue;
+            if (block != first)
+                memcpy(block_data(fanout, block), block_data(fanout, first),
+                       nframes * bpf);
+            block->nframes = nframes;
+            block->position = position;
+            spsc_ring_commit(fanout->taps[i].ring);
+        }
+    } while (nframes > 0);
+
+    for (i = 0; i < fanout->ntaps; ++i)
+        spsc_ring_close(fanout->taps[i].ring);
+}
+
+void pcm_fanout_teardown(pcm_fanout_t **fanout)
+{
+    unsigned i;
+
+    if ((*fanout)->taps) {
+        for (i = 0; i < (*fanout)->ntaps; ++i)
+            spsc_ring_teardown(&(*fanout)->taps[i].ring);
+        free((*fanout)->taps);
+    }
+    if ((*fanout)->slots) free((*fanout)->slots);
+    pcm_teardown(&(*fanout)->src);
+    free(*fanout);
+    *fanout = 0;
+}
+
+#endif
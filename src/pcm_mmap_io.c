@@ -0,0 +1,180 @@
+/* 
+ * Copyright (C) 2013 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#if HAVE_CONFIG_H
+#  include "config.h"
+#endif
+#if HAVE_STDINT_H
+#  include <stdint.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "compat.h"
+#include "pcm_reader.h"
+
+#if HAVE_SYS_MMAN_H && HAVE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/*
+ * Reads a regular file through a read-only mapping of the whole file,
+ * instead of copying through stdio buffer.
+ * Pages behind the read position are dropped from the mapping by
+ * MMAP_RELEASE_UNIT, so that RSS doesn't grow up to the size of the file.
+ * They stay in the page cache, and are faulted in again on backward seek.
+ * Since touching pages beyond EOF raises SIGBUS, size of the file is checked
+ * by fstat() before each access, and the input ends early when it has been
+ * truncated.
+ */
+#define MMAP_RELEASE_UNIT (16 << 20)
+
+typedef struct pcm_mmap_io_t {
+    int fd;
+    uint8_t *base;
+    size_t map_size;
+    size_t size;        /* shrinks when the file is truncated */
+    size_t pos;
+    size_t released;    /* bytes dropped from the head of the mapping */
+} pcm_mmap_io_t;
+
+static
+void release_consumed(pcm_mmap_io_t *self)
+{
+#if HAVE_MADVISE
+    size_t n = (self->pos - self->released) & ~(size_t)(MMAP_RELEASE_UNIT - 1);
+
+    if (self->pos < self->released || n == 0)
+        return;
+    madvise(self->base + self->released, n, MADV_DONTNEED);
+    self->released += n;
+#endif
+}
+
+static
+void check_truncation(pcm_mmap_io_t *self)
+{
+    struct stat st;
+
+    if (fstat(self->fd, &st) == 0 && (uint64_t)st.st_size < self->size)
+        self->size = st.st_size;
+}
+
+static int mmap_read(void *cookie, void *data, uint32_t count)
+{
+    pcm_mmap_io_t *self = cookie;
+
+    check_truncation(self);
+    if (self->pos >= self->size)
+        return 0;
+    if (count > self->size - self->pos)
+        count = self->size - self->pos;
+    memcpy(data, self->base + self->pos, count);
+    self->pos += count;
+    release_consumed(self);
+    return count;
+}
+
+static int mmap_seek(void *cookie, int64_t off, int whence)
+{
+    pcm_mmap_io_t *self = cookie;
+    int64_t pos;
+
+    switch (whence) {
+    case SEEK_SET: pos = off; break;
+    case SEEK_CUR: pos = self->pos + off; break;
+    case SEEK_END:
+        check_truncation(self);
+        pos = self->size + off;
+        break;
+    default: return -1;
+    }
+    if (pos < 0)
+        return -1;
+    self->pos = pos;
+    if (self->pos < self->released)
+        self->released = self->pos & ~(size_t)(MMAP_RELEASE_UNIT - 1);
+    else
+        release_consumed(self);
+    return 0;
+}
+
+static int64_t mmap_tell(void *cookie)
+{
+    return ((pcm_mmap_io_t *)cookie)->pos;
+}
+
+static int mmap_peek(void *cookie, const void **data, uint32_t count)
+{
+    pcm_mmap_io_t *self = cookie;
+
+    check_truncation(self);
+    if (self->pos >= self->size)
+        return 0;
+    if (count > self->size - self->pos)
+        count = self->size - self->pos;
+    *data = self->base + self->pos;
+    return count;
+}
+
+static pcm_io_vtbl_t mmap_io_vtbl = {
+    mmap_read, mmap_seek, mmap_tell, mmap_peek
+};
+
+int pcm_open_mmap_io(pcm_io_context_t *io, FILE *fp)
+{
+    pcm_mmap_io_t *self;
+    struct stat st;
+    void *base;
+    int64_t pos;
+
+    if (fstat(fileno(fp), &st) < 0 || !S_ISREG(st.st_mode) ||
+        st.st_size == 0 || (uint64_t)st.st_size > SIZE_MAX ||
+        (pos = ftello(fp)) < 0)
+        return -1;
+    base = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+    if (base == MAP_FAILED)
+        return -1;
+#if HAVE_MADVISE
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    /* effective only when the kernel supports THP for page cache */
+    madvise(base, st.st_size, MADV_HUGEPAGE);
+#endif
+#endif
+    if ((self = calloc(1, sizeof(pcm_mmap_io_t))) == 0) {
+        munmap(base, st.st_size);
+        return -1;
+    }
+    self->fd = fileno(fp);
+    self->base = base;
+    self->map_size = self->size = st.st_size;
+    self->pos = pos;
+    io->vtbl = &mmap_io_vtbl;
+    io->cookie = self;
+    return 0;
+}
+
+void pcm_close_mmap_io(pcm_io_context_t *io)
+{
+    pcm_mmap_io_t *self = io->cookie;
+
+    munmap(self->base, self->map_size);
+    free(self);
+    io->cookie = 0;
+}
+
+#else
+
+int pcm_open_mmap_io(pcm_io_context_t *io, FILE *fp)
+{
+    return -1;
+}
+
+void pcm_close_mmap_io(pcm_io_context_t *io)
+{
+}
+
+#endif
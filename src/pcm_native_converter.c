@@ -229,6 +229,8 @@ static int read_frames(pcm_reader_t *reader, void *buffer, unsigned nframes)
     pcm_native_converter_t *self = (pcm_native_converter_t *)reader;
     const pcm_sample_description_t *sfmt = pcm_get_format(self->src);
     unsigned bytes = nframes * sfmt->bytes_per_frame;
+    const void *ip;
+    int rc;
 
     if (self->capacity < bytes) {
         void *p = realloc(self->pivot, bytes);
@@ -236,10 +238,10 @@ static int read_frames(pcm_reader_t *reader, void *buffer, unsigned nframes)
         self->pivot = p;
         self->capacity = bytes;
     }
-    nframes = pcm_read_frames(self->src, self->pivot, nframes);
-    if (pcm_convert_to_native(sfmt, self->pivot, nframes, buffer) < 0)
-        return -1;
-    return nframes;
+    nframes = pcm_acquire_frames(self->src, &ip, self->pivot, nframes);
+    rc = pcm_convert_to_native(sfmt, ip, nframes, buffer);
+    pcm_release_frames(self->src);
+    return rc < 0 ? -1 : nframes;
 }
 
 static void teardown(pcm_reader_t **reader)
@@ -255,11 +257,34 @@ static pcm_reader_vtbl_t my_vtable = {
     get_format, get_length, get_position, read_frames, teardown
 };
 
+/*
+ * 16/32bit integer and 32bit float in host byte order need no conversion.
+ * Since sample_type of the result doesn't tell the byte order, this is
+ * limited to little endian hosts.
+ */
+static int is_native(const pcm_sample_description_t *format)
+{
+#if WORDS_BIGENDIAN
+    return 0;
+#else
+    switch (PCM_BYTES_PER_CHANNEL(format) | format->sample_type<<4) {
+    case 2 | PCM_TYPE_SINT<<4:
+    case 4 | PCM_TYPE_SINT<<4:
+    case 4 | PCM_TYPE_FLOAT<<4:
+        return 1;
+    }
+    return 0;
+#endif
+}
+
+/* returns reader as is when no conversion is required */
 pcm_reader_t *pcm_open_native_converter(pcm_reader_t *reader)
 {
     pcm_native_converter_t *self = 0;
     pcm_sample_description_t *fmt;
 
+    if (is_native(pcm_get_format(reader)))
+        return reader;
     if ((self = calloc(1, sizeof(pcm_native_converter_t))) == 0)
         return 0;
     self->src = reader;
@@ -0,0 +1,313 @@
+/* 
+ * Copyright (C) 2013 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#if HAVE_CONFIG_H
+#  include "config.h"
+#endif
+#if HAVE_STDINT_H
+#  include <stdint.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "compat.h"
+#include "pcm_reader.h"
+
+#if HAVE_PTHREAD_H && !defined(_WIN32)
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ * A background thread reads the file by PCM_PREFETCH_BLOCK_SIZE into a
+ * ring of depth blocks, ahead of the read position, and advises the kernel
+ * to read further ahead by posix_fadvise(WILLNEED).
+ *
+ * Blocks from head to head + count - 1 are filled and owned by the reader;
+ * the thread only writes the next one, so that data is copied out of them
+ * without the lock. Seek out of the ring discards it, and the thread
+ * starts over from the new position (generation tells an in-flight read
+ * of the old one).
+ */
+
+typedef struct prefetch_block_t {
+    uint8_t *data;
+    int64_t offset;
+    uint32_t size;
+} prefetch_block_t;
+
+typedef struct pcm_prefetch_io_t {
+    int fd;
+    int64_t file_size;
+    int64_t pos;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned head;
+    unsigned count;
+    int64_t next_offset;    /* of the block to be read next */
+    unsigned generation;
+    int error;
+    int quit;
+
+    int64_t blocks_read;
+    int64_t stalls;
+    int64_t stall_usec;     /* total time the reader waited for the thread */
+    unsigned nblocks;
+    prefetch_block_t blocks[1];
+} pcm_prefetch_io_t;
+
+static int64_t read_fully(int fd, uint8_t *data, uint32_t size, int64_t off)
+{
+    uint32_t done = 0;
+    ssize_t n;
+
+    while (done < size) {
+        if ((n = pread(fd, data + done, size - done, off + done)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+static void *prefetch_thread(void *arg)
+{
+    pcm_prefetch_io_t *self = arg;
+    prefetch_block_t *b;
+    unsigned generation;
+    int64_t offset, n;
+
+    pthread_mutex_lock(&self->mutex);
+    for (;;) {
+        while (!self->quit && (self->count == self->nblocks ||
+                               self->next_offset >= self->file_size))
+            pthread_cond_wait(&self->cond, &self->mutex);
+        if (self->quit)
+            break;
+        b = &self->blocks[(self->head + self->count) % self->nblocks];
+        offset = self->next_offset;
+        generation = self->generation;
+        pthread_mutex_unlock(&self->mutex);
+
+#if HAVE_POSIX_FADVISE
+        posix_fadvise(self->fd, offset + PCM_PREFETCH_BLOCK_SIZE,
+                      (off_t)self->nblocks * PCM_PREFETCH_BLOCK_SIZE,
+                      POSIX_FADV_WILLNEED);
+#endif
+        n = read_fully(self->fd, b->data, PCM_PREFETCH_BLOCK_SIZE, offset);
+
+        pthread_mutex_lock(&self->mutex);
+        if (generation != self->generation)
+            continue;
+        if (n < 0) {
+            self->error = 1;
+            self->next_offset = self->file_size;
+        } else {
+            b->offset = offset;
+            b->size = n;
+            ++self->count;
+            ++self->blocks_read;
+            /* short read is taken as EOF */
+            self->next_offset = n < PCM_PREFETCH_BLOCK_SIZE ?
+                                self->file_size : offset + n;
+        }
+        pthread_cond_broadcast(&self->cond);
+    }
+    pthread_mutex_unlock(&self->mutex);
+    return 0;
+}
+
+/*
+ * Returns the block containing pos, waiting for the thread as needed.
+ * NULL on EOF or error. Called with the mutex held.
+ */
+static prefetch_block_t *find_block(pcm_prefetch_io_t *self)
+{
+    prefetch_block_t *b;
+    int64_t start;
+    int stalled = 0;
+
+    for (;;) {
+        if (self->error)
+            return 0;
+        if (self->count) {
+            b = &self->blocks[self->head];
+            if (self->pos >= b->offset && self->pos < b->offset + b->size)
+                return b;
+            if (self->pos >= b->offset + b->size) {
+                if (b->size < PCM_PREFETCH_BLOCK_SIZE)
+                    return 0;
+                /* consumed, the thread can reuse it */
+                self->head = (self->head + 1) % self->nblocks;
+                --self->count;
+                pthread_cond_broadcast(&self->cond);
+                continue;
+            }
+        }
+        if (self->pos >= self->file_size)
+            return 0;
+        if (self->count || self->pos != self->next_offset) {
+            /* out of the ring: start over from pos */
+            ++self->generation;
+            self->count = 0;
+            self->next_offset = self->pos;
+            pthread_cond_broadcast(&self->cond);
+        }
+        start = aacenc_timer_usec();
+        pthread_cond_wait(&self->cond, &self->mutex);
+        self->stall_usec += aacenc_timer_usec() - start;
+        if (!stalled++)
+            ++self->stalls;
+    }
+}
+
+static int prefetch_read(void *cookie, void *data, uint32_t count)
+{
+    pcm_prefetch_io_t *self = cookie;
+    prefetch_block_t *b;
+    int error;
+
+    pthread_mutex_lock(&self->mutex);
+    b = find_block(self);
+    error = self->error;
+    pthread_mutex_unlock(&self->mutex);
+    if (!b)
+        return error ? -1 : 0;
+    if (count > b->offset + b->size - self->pos)
+        count = b->offset + b->size - self->pos;
+    memcpy(data, b->data + (self->pos - b->offset), count);
+    self->pos += count;
+    return count;
+}
+
+static int prefetch_seek(void *cookie, int64_t off, int whence)
+{
+    pcm_prefetch_io_t *self = cookie;
+    int64_t pos;
+
+    switch (whence) {
+    case SEEK_SET: pos = off; break;
+    case SEEK_CUR: pos = self->pos + off; break;
+    case SEEK_END: pos = self->file_size + off; break;
+    default: return -1;
+    }
+    if (pos < 0)
+        return -1;
+    /* the ring moves on the next read */
+    self->pos = pos;
+    return 0;
+}
+
+static int64_t prefetch_tell(void *cookie)
+{
+    return ((pcm_prefetch_io_t *)cookie)->pos;
+}
+
+static pcm_io_vtbl_t prefetch_io_vtbl = {
+    prefetch_read, prefetch_seek, prefetch_tell
+};
+
+static void free_prefetch_io(pcm_prefetch_io_t *self)
+{
+    unsigned i;
+
+    for (i = 0; i < self->nblocks; ++i)
+        free(self->blocks[i].data);
+    free(self);
+}
+
+int pcm_open_prefetch_io(pcm_io_context_t *io, FILE *fp, unsigned depth)
+{
+    pcm_prefetch_io_t *self;
+    struct stat st;
+    int64_t pos;
+    unsigned i;
+
+    if (fstat(fileno(fp), &st) < 0 || !S_ISREG(st.st_mode) ||
+        st.st_size == 0 || (pos = ftello(fp)) < 0)
+        return -1;
+    self = calloc(1, sizeof(pcm_prefetch_io_t)
+                     + (depth - 1) * sizeof(prefetch_block_t));
+    if (!self)
+        return -1;
+    self->nblocks = depth;
+    for (i = 0; i < depth; ++i) {
+        if ((self->blocks[i].data = malloc(PCM_PREFETCH_BLOCK_SIZE)) == 0) {
+            free_prefetch_io(self);
+            return -1;
+        }
+    }
+    self->fd = fileno(fp);
+    self->file_size = st.st_size;
+    self->pos = pos;
+    self->next_offset = pos;
+    pthread_mutex_init(&self->mutex, 0);
+    pthread_cond_init(&self->cond, 0);
+    if (pthread_create(&self->thread, 0, prefetch_thread, self)) {
+        pthread_mutex_destroy(&self->mutex);
+        pthread_cond_destroy(&self->cond);
+        free_prefetch_io(self);
+        return -1;
+    }
+#if HAVE_POSIX_FADVISE
+    posix_fadvise(self->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    io->vtbl = &prefetch_io_vtbl;
+    io->cookie = self;
+    return 0;
+}
+
+void pcm_get_prefetch_stats(pcm_io_context_t *io, int64_t *blocks,
+                            int64_t *stalls, int64_t *stall_usec)
+{
+    pcm_prefetch_io_t *self = io->cookie;
+
+    pthread_mutex_lock(&self->mutex);
+    *blocks = self->blocks_read;
+    *stalls = self->stalls;
+    *stall_usec = self->stall_usec;
+    pthread_mutex_unlock(&self->mutex);
+}
+
+void pcm_close_prefetch_io(pcm_io_context_t *io)
+{
+    pcm_prefetch_io_t *self = io->cookie;
+
+    pthread_mutex_lock(&self->mutex);
+    self->quit = 1;
+    pthread_cond_broadcast(&self->cond);
+    pthread_mutex_unlock(&self->mutex);
+    pthread_join(self->thread, 0);
+    pthread_mutex_destroy(&self->mutex);
+    pthread_cond_destroy(&self->cond);
+    free_prefetch_io(self);
+    io->cookie = 0;
+}
+
+#else
+
+int pcm_open_prefetch_io(pcm_io_context_t *io, FILE *fp, unsigned depth)
+{
+    return -1;
+}
+
+void pcm_get_prefetch_stats(pcm_io_context_t *io, int64_t *blocks,
+                            int64_t *stalls, int64_t *stall_usec)
+{
+    *blocks = *stalls = *stall_usec = 0;
+}
+
+void pcm_close_prefetch_io(pcm_io_context_t *io)
+{
+}
+
+#endif
@@ -5,6 +5,7 @@
 #ifndef PCM_READER_H
 #define PCM_READER_H
 
+#include <stdio.h>
 #include "lpcm.h"
 #include "metadata.h"
 
@@ -16,6 +17,15 @@ typedef struct pcm_reader_vtbl_t {
     int64_t (*get_position)(pcm_reader_t *);
     int (*read_frames)(pcm_reader_t *, void *, unsigned);
     void (*teardown)(pcm_reader_t **);
+    /*
+     * Optional, for readers which can hand out PCM in their own buffer
+     * (or in the buffer of the source) without copying.
+     * acquire_frames() returns up to nframes (0 on EOF), which stay valid
+     * until release_frames(). Position advances on release_frames().
+     * release_frames() without acquire_frames() does nothing.
+     */
+    int (*acquire_frames)(pcm_reader_t *, const void **, unsigned);
+    void (*release_frames)(pcm_reader_t *);
 } pcm_reader_vtbl_t;
 
 struct pcm_reader_t {
@@ -25,11 +35,15 @@ struct pcm_reader_t {
 typedef int (*pcm_read_callback)(void *cookie, void *data, uint32_t count);
 typedef int (*pcm_seek_callback)(void *cookie, int64_t off, int whence);
 typedef int64_t (*pcm_tell_callback)(void *cookie);
+/* pointer to up to count bytes at the current position, which is kept */
+typedef int (*pcm_peek_callback)(void *cookie, const void **data,
+                                 uint32_t count);
 
 typedef struct pcm_io_vtbl_t {
     pcm_read_callback read;
     pcm_seek_callback seek;
     pcm_tell_callback tell;
+    pcm_peek_callback peek; /* optional */
 } pcm_io_vtbl_t;
 
 typedef struct pcm_io_context_t {
@@ -57,6 +71,21 @@ int64_t pcm_get_position(pcm_reader_t *r)
 
 int pcm_read_frames(pcm_reader_t *r, void *data, unsigned nframes);
 
+/*
+ * Same as pcm_read_frames(), except that *data points to the buffer of the
+ * reader when it supports acquire_frames(), and to buffer otherwise.
+ * pcm_release_frames() must be called when *data is no longer used.
+ */
+int pcm_acquire_frames(pcm_reader_t *r, const void **data, void *buffer,
+                       unsigned nframes);
+
+static inline
+void pcm_release_frames(pcm_reader_t *r)
+{
+    if (r->vtbl->release_frames)
+        r->vtbl->release_frames(r);
+}
+
 static inline
 void pcm_teardown(pcm_reader_t **r)
 {
@@ -96,6 +125,29 @@ static inline int64_t pcm_tell(pcm_io_context_t *io)
     return io->vtbl->tell ? io->vtbl->tell(io->cookie) : -1;
 }
 
+/*
+ * Sets up io to read a regular file via memory mapping, from the current
+ * position of fp. Returns -1 when not applicable, leaving io untouched.
+ * fp must be kept open until pcm_close_mmap_io().
+ */
+int pcm_open_mmap_io(pcm_io_context_t *io, FILE *fp);
+void pcm_close_mmap_io(pcm_io_context_t *io);
+
+/*
+ * Sets up io to read a regular file from the current position of fp, by a
+ * background thread keeping up to depth blocks of PCM_PREFETCH_BLOCK_SIZE
+ * read ahead. Returns -1 when not applicable, leaving io untouched.
+ * fp must be kept open until pcm_close_prefetch_io().
+ */
+#define PCM_PREFETCH_BLOCK_SIZE (1 << 20)
+
+int pcm_open_prefetch_io(pcm_io_context_t *io, FILE *fp, unsigned depth);
+
+/* stalls: reads that had to wait for the thread, stall_usec in total */
+void pcm_get_prefetch_stats(pcm_io_context_t *io, int64_t *blocks,
+                            int64_t *stalls, int64_t *stall_usec);
+void pcm_close_prefetch_io(pcm_io_context_t *io);
+
 int pcm_read16le(pcm_io_context_t *io, uint16_t *value);
 int pcm_read16be(pcm_io_context_t *io, uint16_t *value);
 int pcm_read32le(pcm_io_context_t *io, uint32_t *value);
@@ -121,4 +173,26 @@ pcm_reader_t *pcm_open_sint16_converter(pcm_reader_t *reader);
 pcm_reader_t *extrapolater_open(pcm_reader_t *reader);
 pcm_reader_t *limiter_open(pcm_reader_t *reader);
 
+/*
+ * Reads the source by block_frames at a time, for the readers below it.
+ * pcm_get_block_stats() returns the number of blocks read, and the time
+ * spent reading them.
+ */
+pcm_reader_t *pcm_open_block_reader(pcm_reader_t *reader,
+                                    unsigned block_frames);
+void pcm_get_block_stats(pcm_reader_t *block_reader, int64_t *blocks,
+                         int64_t *usec);
+
+pcm_reader_t *pcm_open_threaded_reader(pcm_reader_t *reader,
+                                       unsigned block_frames,
+                                       unsigned depth);
+
+typedef struct pcm_fanout_t pcm_fanout_t;
+
+pcm_fanout_t *pcm_fanout_open(pcm_reader_t *reader, unsigned ntaps,
+                              unsigned block_frames, unsigned depth);
+pcm_reader_t *pcm_fanout_get_tap(pcm_fanout_t *fanout, unsigned index);
+void pcm_fanout_run(pcm_fanout_t *fanout);
+void pcm_fanout_teardown(pcm_fanout_t **fanout);
+
 #endif
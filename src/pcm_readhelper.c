@@ -36,6 +36,35 @@ int pcm_read_frames(pcm_reader_t *r, void *data, unsigned nframes)
     return count;
 }
 
+int pcm_acquire_frames(pcm_reader_t *r, const void **data, void *buffer,
+                       unsigned nframes)
+{
+    int n;
+    unsigned count = 0;
+    uint8_t *bp = buffer;
+    const void *p;
+    unsigned bpf = pcm_get_format(r)->bytes_per_frame;
+
+    *data = buffer;
+    if (!r->vtbl->acquire_frames)
+        return pcm_read_frames(r, buffer, nframes);
+    if ((n = r->vtbl->acquire_frames(r, &p, nframes)) == (int)nframes) {
+        *data = p;
+        return n;
+    }
+    /* short, gather into buffer */
+    while (n > 0) {
+        memcpy(bp, p, n * bpf);
+        r->vtbl->release_frames(r);
+        count += n;
+        bp += n * bpf;
+        if (count == nframes)
+            break;
+        n = r->vtbl->acquire_frames(r, &p, nframes - count);
+    }
+    return count;
+}
+
 int pcm_read(pcm_io_context_t *io, void *buffer, uint32_t size)
 {
     int rc;
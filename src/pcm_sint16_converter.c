@@ -43,22 +43,32 @@ static int64_t get_position(pcm_reader_t *reader)
     return pcm_get_position(get_source(reader));
 }
 
-static int read_frames(pcm_reader_t *reader, void *buffer, unsigned nframes)
+static int reserve_pivot(pcm_sint16_converter_t *self, unsigned nframes)
 {
-    unsigned i, count;
-    pcm_sint16_converter_t *self = (pcm_sint16_converter_t *)reader;
-    const pcm_sample_description_t *sfmt = pcm_get_format(self->src);
-    unsigned bytes = nframes * sfmt->bytes_per_frame;
+    unsigned bytes = nframes * pcm_get_format(self->src)->bytes_per_frame;
+
     if (self->capacity < bytes) {
         void *p = realloc(self->pivot, bytes);
         if (!p) return -1;
         self->pivot = p;
         self->capacity = bytes;
     }
-    nframes = pcm_read_frames(self->src, self->pivot, nframes);
+    return 0;
+}
+
+static int read_frames(pcm_reader_t *reader, void *buffer, unsigned nframes)
+{
+    unsigned i, count;
+    pcm_sint16_converter_t *self = (pcm_sint16_converter_t *)reader;
+    const pcm_sample_description_t *sfmt = pcm_get_format(self->src);
+    const void *input;
+
+    if (reserve_pivot(self, nframes) < 0)
+        return -1;
+    nframes = pcm_acquire_frames(self->src, &input, self->pivot, nframes);
     count = nframes * sfmt->channels_per_frame;
     if (PCM_IS_FLOAT(sfmt)) {
-        float   *ip = self->pivot;
+        const float *ip = input;
         INT_PCM *op = buffer;
 #if SAMPLE_BITS == 16
         for (i = 0; i < count; ++i)
@@ -67,8 +77,13 @@ static int read_frames(pcm_reader_t *reader, void *buffer, unsigned nframes)
         for (i = 0; i < count; ++i)
             op[i] = (int32_t)pcm_clip(ip[i] * 2147483648.0, -2147483648.0, 2147483647.0);
 #endif
+    } else if (PCM_BYTES_PER_CHANNEL(sfmt) == 2) {
+        const int16_t *ip = input;
+        INT_PCM *op = buffer;
+        for (i = 0; i < count; ++i)
+            op[i] = ip[i] << (SAMPLE_BITS - 16);
     } else {
-        int32_t *ip = self->pivot;
+        const int32_t *ip = input;
         INT_PCM *op = buffer;
 #if SAMPLE_BITS == 16
         if (sfmt->bits_per_channel <= 16) {
@@ -85,9 +100,34 @@ static int read_frames(pcm_reader_t *reader, void *buffer, unsigned nframes)
             op[i] = ip[i];
 #endif
     }
+    pcm_release_frames(self->src);
     return nframes;
 }
 
+/* source is already in INT_PCM */
+
+static int passthrough_read_frames(pcm_reader_t *reader, void *buffer,
+                                   unsigned nframes)
+{
+    pcm_reader_t *src = get_source(reader);
+    return src->vtbl->read_frames(src, buffer, nframes);
+}
+
+static int passthrough_acquire_frames(pcm_reader_t *reader, const void **data,
+                                      unsigned nframes)
+{
+    pcm_sint16_converter_t *self = (pcm_sint16_converter_t *)reader;
+
+    if (reserve_pivot(self, nframes) < 0)
+        return -1;
+    return pcm_acquire_frames(self->src, data, self->pivot, nframes);
+}
+
+static void passthrough_release_frames(pcm_reader_t *reader)
+{
+    pcm_release_frames(get_source(reader));
+}
+
 static void teardown(pcm_reader_t **reader)
 {
     pcm_sint16_converter_t *self = (pcm_sint16_converter_t *)*reader;
@@ -101,6 +141,11 @@ static pcm_reader_vtbl_t my_vtable = {
     get_format, get_length, get_position, read_frames, teardown
 };
 
+static pcm_reader_vtbl_t passthrough_vtable = {
+    get_format, get_length, get_position, passthrough_read_frames, teardown,
+    passthrough_acquire_frames, passthrough_release_frames
+};
+
 pcm_reader_t *pcm_open_sint16_converter(pcm_reader_t *reader)
 {
     pcm_sint16_converter_t *self = 0;
@@ -114,6 +159,8 @@ pcm_reader_t *pcm_open_sint16_converter(pcm_reader_t *reader)
     self->vtbl = &my_vtable;
     memcpy(&self->format, pcm_get_format(reader), sizeof(self->format));
     fmt = &self->format;
+    if (!PCM_IS_FLOAT(fmt) && PCM_BYTES_PER_CHANNEL(fmt) == sizeof(INT_PCM))
+        self->vtbl = &passthrough_vtable;
     fmt->bits_per_channel = SAMPLE_BITS;
     fmt->sample_type = PCM_TYPE_SINT;
     fmt->bytes_per_frame = sizeof(INT_PCM) * fmt->channels_per_frame;
@@ -0,0 +1,200 @@
+/* 
+ * Copyright (C) 2013 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#if HAVE_CONFIG_H
+#  include "config.h"
+#endif
+#if HAVE_STDINT_H
+#  include <stdint.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pcm_reader.h"
+
+#if HAVE_PTHREAD_H && HAVE_STDATOMIC_H
+#include <pthread.h>
+#include "spsc_ring.h"
+
+/*
+ * Runs the source reader on a dedicated thread, and passes the result
+ * through a ring of fixed size blocks.
+ * Source is always read by block_frames, therefore readers sensitive to
+ * the request size (such as extrapolater) behave in the same way as long
+ * as the consumer also reads by block_frames.
+ */
+
+typedef struct pcm_block_t {
+    int64_t position;   /* position of the source after this block */
+    int nframes;
+} pcm_block_t;
+
+typedef struct pcm_threaded_reader_t {
+    pcm_reader_vtbl_t *vtbl;
+    pcm_reader_t *src;
+    pcm_sample_description_t format;
+    spsc_ring_t *ring;
+    pthread_t thread;
+    int thread_started;
+    unsigned block_frames;
+    size_t data_offset;
+
+    pcm_block_t *block;     /* block being consumed */
+    unsigned block_pos;
+    unsigned acquired;
+    int64_t position;
+} pcm_threaded_reader_t;
+
+static inline pcm_reader_t *get_source(pcm_reader_t *reader)
+{
+    return ((pcm_threaded_reader_t *)reader)->src;
+}
+
+static inline uint8_t *block_data(pcm_threaded_reader_t *self,
+                                  pcm_block_t *block)
+{
+    return (uint8_t *)block + self->data_offset;
+}
+
+static const
+pcm_sample_description_t *get_format(pcm_reader_t *reader)
+{
+    return &((pcm_threaded_reader_t *)reader)->format;
+}
+
+static int64_t get_length(pcm_reader_t *reader)
+{
+    return pcm_get_length(get_source(reader));
+}
+
+static int64_t get_position(pcm_reader_t *reader)
+{
+    return ((pcm_threaded_reader_t *)reader)->position;
+}
+
+static void *reader_main(void *arg)
+{
+    pcm_threaded_reader_t *self = arg;
+    pcm_block_t *block;
+    int nframes;
+
+    while ((block = spsc_ring_reserve(self->ring)) != 0) {
+        nframes = pcm_read_frames(self->src, block_data(self, block),
+                                  self->block_frames);
+        block->nframes = nframes;
+        block->position = pcm_get_position(self->src);
+        spsc_ring_commit(self->ring);
+        if (nframes <= 0)
+            break;
+    }
+    spsc_ring_close(self->ring);
+    return 0;
+}
+
+/* returns 0 on EOF */
+static int next_block(pcm_threaded_reader_t *self)
+{
+    if (!self->block || self->block_pos == self->block->nframes) {
+        if (self->block) {
+            spsc_ring_release(self->ring);
+            self->block = 0;
+        }
+        if ((self->block = spsc_ring_peek(self->ring)) == 0)
+            return 0;
+        self->block_pos = 0;
+        self->position = self->block->position;
+    }
+    return 1;
+}
+
+static int read_frames(pcm_reader_t *reader, void *buffer, unsigned nframes)
+{
+    pcm_threaded_reader_t *self = (pcm_threaded_reader_t *)reader;
+    unsigned n, bpf = self->format.bytes_per_frame;
+
+    if (!next_block(self))
+        return 0;
+    n = self->block->nframes - self->block_pos;
+    if (n > nframes)
+        n = nframes;
+    memcpy(buffer, block_data(self, self->block) + self->block_pos * bpf,
+           n * bpf);
+    self->block_pos += n;
+    return n;
+}
+
+/* hands out the block in the ring as is */
+static int acquire_frames(pcm_reader_t *reader, const void **data,
+                          unsigned nframes)
+{
+    pcm_threaded_reader_t *self = (pcm_threaded_reader_t *)reader;
+    unsigned n, bpf = self->format.bytes_per_frame;
+
+    if (!next_block(self))
+        return 0;
+    n = self->block->nframes - self->block_pos;
+    if (n > nframes)
+        n = nframes;
+    *data = block_data(self, self->block) + self->block_pos * bpf;
+    self->acquired = n;
+    return n;
+}
+
+static void release_frames(pcm_reader_t *reader)
+{
+    pcm_threaded_reader_t *self = (pcm_threaded_reader_t *)reader;
+
+    self->block_pos += self->acquired;
+    self->acquired = 0;
+}
+
+static void teardown(pcm_reader_t **reader)
+{
+    pcm_threaded_reader_t *self = (pcm_threaded_reader_t *)*reader;
+
+    if (self->thread_started) {
+        spsc_ring_close(self->ring);
+        pthread_join(self->thread, 0);
+    }
+    if (self->ring) spsc_ring_teardown(&self->ring);
+    pcm_teardown(&self->src);
+    free(self);
+    *reader = 0;
+}
+
+static pcm_reader_vtbl_t my_vtable = {
+    get_format, get_length, get_position, read_frames, teardown,
+    acquire_frames, release_frames
+};
+
+pcm_reader_t *pcm_open_threaded_reader(pcm_reader_t *reader,
+                                       unsigned block_frames,
+                                       unsigned depth)
+{
+    pcm_threaded_reader_t *self = 0;
+    size_t block_size;
+
+    if ((self = calloc(1, sizeof(pcm_threaded_reader_t))) == 0)
+        return 0;
+    self->src = reader;
+    self->vtbl = &my_vtable;
+    memcpy(&self->format, pcm_get_format(reader), sizeof(self->format));
+    self->block_frames = block_frames;
+    self->data_offset = (sizeof(pcm_block_t) + 15) & ~15;
+    block_size = self->data_offset
+               + block_frames * self->format.bytes_per_frame;
+    if ((self->ring = spsc_ring_create(depth, block_size)) == 0)
+        goto FAIL;
+    if (pthread_create(&self->thread, 0, reader_main, self) != 0) {
+        fprintf(stderr, "ERROR: failed to create thread\n");
+        goto FAIL;
+    }
+    self->thread_started = 1;
+    return (pcm_reader_t *)self;
+FAIL:
+    teardown((pcm_reader_t **)&self);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,200 @@
+/* 
+ * Copyright (C) 2013 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+/* for vmsplice() */
+#define _GNU_SOURCE
+#if HAVE_CONFIG_H
+#  include "config.h"
+#endif
+#if HAVE_STDINT_H
+#  include <stdint.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "compat.h"
+#include "pipe_output.h"
+
+#if HAVE_VMSPLICE && HAVE_SYS_MMAN_H && HAVE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+struct aacenc_pipe_output_t {
+    int fd;
+    int error;
+    int use_vmsplice;
+    unsigned flush_frames;
+    uint8_t *block;         /* mapped on demand, after the previous flush */
+    uint32_t size;          /* bytes in the block */
+    unsigned frames;        /* frames in the block */
+    int64_t pos;
+};
+
+static int write_fully(int fd, const uint8_t *data, uint32_t size)
+{
+    ssize_t n;
+
+    for (; size > 0; data += n, size -= n) {
+        if ((n = write(fd, data, size)) < 0) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int splice_fully(aacenc_pipe_output_t *self)
+{
+    struct iovec iov;
+    ssize_t n;
+
+    iov.iov_base = self->block;
+    iov.iov_len = self->size;
+    while (iov.iov_len > 0) {
+        if ((n = vmsplice(self->fd, &iov, 1, SPLICE_F_GIFT)) < 0) {
+            if (errno == EINTR)
+                continue;
+            /* nothing has been spliced yet: not supported on this fd */
+            if (iov.iov_base == self->block &&
+                (errno == EINVAL || errno == ENOSYS)) {
+                self->use_vmsplice = 0;
+                return write_fully(self->fd, self->block, self->size);
+            }
+            return -1;
+        }
+        iov.iov_base = (uint8_t *)iov.iov_base + n;
+        iov.iov_len -= n;
+    }
+    return 0;
+}
+
+static void flush_block(aacenc_pipe_output_t *self)
+{
+    int rc;
+
+    if (!self->size)
+        return;
+    if (self->use_vmsplice) {
+        rc = splice_fully(self);
+        /* pages can still be referenced by the pipe, never reuse them */
+        if (self->use_vmsplice) {
+            munmap(self->block, PIPE_BLOCK_SIZE);
+            self->block = 0;
+        }
+    } else
+        rc = write_fully(self->fd, self->block, self->size);
+    if (rc < 0)
+        self->error = 1;
+    self->size = 0;
+    self->frames = 0;
+}
+
+static int pipe_write(void *cookie, const void *data, uint32_t size)
+{
+    aacenc_pipe_output_t *self = cookie;
+    void *p;
+
+    if (self->error)
+        return -1;
+    if (self->size + size > PIPE_BLOCK_SIZE)
+        flush_block(self);
+    if (size > PIPE_BLOCK_SIZE) {
+        if (write_fully(self->fd, data, size) < 0)
+            self->error = 1;
+    } else {
+        if (!self->block) {
+            p = mmap(0, PIPE_BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) {
+                self->error = 1;
+                return -1;
+            }
+            self->block = p;
+        }
+        memcpy(self->block + self->size, data, size);
+        self->size += size;
+        if (++self->frames >= self->flush_frames)
+            flush_block(self);
+    }
+    self->pos += size;
+    return self->error ? -1 : (int)size;
+}
+
+static int pipe_seek(void *cookie, int64_t off, int whence)
+{
+    return -1;
+}
+
+static int64_t pipe_tell(void *cookie)
+{
+    return ((aacenc_pipe_output_t *)cookie)->pos;
+}
+
+static m4af_io_callbacks_t pipe_output_io = {
+    0, pipe_write, pipe_seek, pipe_tell
+};
+
+m4af_io_callbacks_t *aacenc_pipe_get_output_io(void)
+{
+    return &pipe_output_io;
+}
+
+aacenc_pipe_output_t *aacenc_pipe_open_output(FILE *fp,
+                                              unsigned flush_frames)
+{
+    aacenc_pipe_output_t *self;
+    struct stat st;
+
+    if (fstat(fileno(fp), &st) < 0 || !S_ISFIFO(st.st_mode))
+        return 0;
+    if ((self = calloc(1, sizeof(aacenc_pipe_output_t))) == 0)
+        return 0;
+    self->fd = fileno(fp);
+    self->use_vmsplice = 1;
+    self->flush_frames = flush_frames ? flush_frames : PIPE_FLUSH_FRAMES;
+    return self;
+}
+
+int aacenc_pipe_close_output(aacenc_pipe_output_t **output)
+{
+    aacenc_pipe_output_t *self = *output;
+    int error;
+
+    if (!self->error)
+        flush_block(self);
+    error = self->error;
+    if (self->block)
+        munmap(self->block, PIPE_BLOCK_SIZE);
+    free(self);
+    *output = 0;
+    return error ? -1 : 0;
+}
+
+#else
+
+aacenc_pipe_output_t *aacenc_pipe_open_output(FILE *fp,
+                                              unsigned flush_frames)
+{
+    return 0;
+}
+
+m4af_io_callbacks_t *aacenc_pipe_get_output_io(void)
+{
+    return 0;
+}
+
+int aacenc_pipe_close_output(aacenc_pipe_output_t **output)
+{
+    return 0;
+}
+
+#endif
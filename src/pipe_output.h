@@ -0,0 +1,40 @@
+/* 
+ * Copyright (C) 2013 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#ifndef PIPE_OUTPUT_H
+#define PIPE_OUTPUT_H
+
+#include <stdio.h>
+#include "m4af.h"
+
+/*
+ * Writes ADTS/LATM frames to a pipe, gathering them into page-aligned
+ * blocks of PIPE_BLOCK_SIZE, which are handed to the pipe by vmsplice()
+ * once every flush_frames frames or when full.
+ *
+ * Each block is gifted to the pipe and never written again, since pages
+ * of it can be referenced by the pipe (or wherever the reader splices
+ * them into) after vmsplice() returns. Falls back to write() where
+ * vmsplice() is not available.
+ */
+#define PIPE_BLOCK_SIZE (1 << 16)
+#define PIPE_FLUSH_FRAMES 16
+
+typedef struct aacenc_pipe_output_t aacenc_pipe_output_t;
+
+/*
+ * Returns NULL when fp is not a pipe.
+ * flush_frames is 0 for PIPE_FLUSH_FRAMES.
+ * fp must not be written by stdio while the output is open.
+ */
+aacenc_pipe_output_t *aacenc_pipe_open_output(FILE *fp,
+                                              unsigned flush_frames);
+
+/* write only, each call is taken as a frame */
+m4af_io_callbacks_t *aacenc_pipe_get_output_io(void);
+
+/* flushes the last block. returns -1 if any write has failed */
+int aacenc_pipe_close_output(aacenc_pipe_output_t **output);
+
+#endif
@@ -0,0 +1,388 @@
+/* 
+ * Copyright (C) 2013 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#if HAVE_CONFIG_H
+#  include "config.h"
+#endif
+#if HAVE_STDINT_H
+#  include <stdint.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "segment.h"
+
+/*
+ * Extra frames fed in front of a segment, in addition to the encoder delay.
+ * This gives psychoacoustic model and bit reservoir some time to settle.
+ */
+#define SEGMENT_WARMUP_FRAMES   4
+
+static
+uint32_t encoder_delay(const AACENC_InfoStruct *info)
+{
+#if AACENCODER_LIB_VL0 < 4
+    return info->encoderDelay;
+#else
+    return info->nDelay;
+#endif
+}
+
+unsigned segment_preroll_frames(const AACENC_InfoStruct *info)
+{
+    unsigned n = info->frameLength;
+    return (encoder_delay(info) + n - 1) / n + SEGMENT_WARMUP_FRAMES;
+}
+
+unsigned segment_postroll_frames(const AACENC_InfoStruct *info)
+{
+    unsigned n = info->frameLength;
+    return (encoder_delay(info) + n - 1) / n + 1;
+}
+
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+
+#define SEGMENT_SECONDS         10
+
+typedef struct segment_job_t {
+    INT_PCM *pcm;
+    unsigned nframes;       /* PCM frames including pre-roll/post-roll */
+    unsigned skip;          /* AAC frames to discard (pre-roll)        */
+    unsigned keep;          /* AAC frames to keep, 0 means all         */
+    uint8_t *data;          /* concatenation of resulting AAC frames   */
+    uint32_t data_size, data_capacity;
+    uint32_t *sizes;
+    unsigned count, capacity;
+    int done;
+    int error;
+} segment_job_t;
+
+struct segment_encoder_t {
+    aacenc_pool_t *pool;
+    aacenc_param_t params;
+    pcm_sample_description_t format;
+    unsigned frame_length;
+    unsigned preroll;        /* in PCM frames */
+    unsigned postroll;
+    unsigned segment_length;
+    aacenc_frame_callback_t callback;
+    void *cookie;
+
+    INT_PCM *window;         /* pre-roll + current segment + post-roll */
+    unsigned window_frames;
+    unsigned window_head;    /* offset of the current segment in window */
+
+    pthread_t *threads;
+    unsigned nthreads;
+    pthread_mutex_t mutex;
+    pthread_cond_t job_cond;
+    pthread_cond_t done_cond;
+    int shutdown;
+
+    segment_job_t **jobs;    /* ring buffer of jobs in flight */
+    unsigned max_jobs;
+    unsigned submitted;
+    unsigned started;
+    unsigned emitted;
+};
+
+static
+int append_frame(segment_job_t *job, const aacenc_frame_t *frame)
+{
+    if (job->data_size + frame->size > job->data_capacity) {
+        uint32_t n = job->data_capacity ? job->data_capacity * 2 : 65536;
+        uint8_t *p;
+        while (n < job->data_size + frame->size)
+            n *= 2;
+        if ((p = realloc(job->data, n)) == 0)
+            return -1;
+        job->data = p;
+        job->data_capacity = n;
+    }
+    if (job->count == job->capacity) {
+        unsigned n = job->capacity ? job->capacity * 2 : 256;
+        uint32_t *p;
+        if ((p = realloc(job->sizes, n * sizeof(uint32_t))) == 0)
+            return -1;
+        job->sizes = p;
+        job->capacity = n;
+    }
+    memcpy(job->data + job->data_size, frame->data, frame->size);
+    job->data_size += frame->size;
+    job->sizes[job->count++] = frame->size;
+    return 0;
+}
+
+static
+int encode_segment(segment_encoder_t *ctx, segment_job_t *job)
+{
+    HANDLE_AACENCODER encoder = 0;
+    AACENC_InfoStruct info = { 0 };
+    aacenc_frame_t frame = { 0 };
+    const INT_PCM *ip = job->pcm;
+    unsigned remaining = job->nframes;
+    unsigned produced = 0;
+    int consumed;
+    int rc = -1;
+
+    if (aacenc_pool_acquire(ctx->pool, &encoder, &ctx->params, &ctx->format,
+                            &info) < 0)
+        goto END;
+    for (;;) {
+        if (job->keep && remaining == 0) {
+            /* post-roll exhausted before getting enough frames */
+            fprintf(stderr, "ERROR: segment underrun\n");
+            goto END;
+        }
+        consumed = aac_encode_frame(encoder, &ctx->format, ip, remaining,
+                                    &frame);
+        if (consumed < 0) goto END;
+        if (consumed == 0 && frame.size == 0) break;
+
+        remaining -= consumed;
+        ip += consumed * ctx->format.channels_per_frame;
+        if (frame.size == 0 || produced++ < job->skip)
+            continue;
+        if (append_frame(job, &frame) < 0)
+            goto END;
+        if (job->keep && job->count == job->keep)
+            break;
+    }
+    rc = 0;
+END:
+    if (frame.data) free(frame.data);
+    if (encoder) aacenc_pool_release(ctx->pool, encoder);
+    return rc;
+}
+
+static
+void *worker_main(void *arg)
+{
+    segment_encoder_t *ctx = arg;
+    segment_job_t *job;
+
+    pthread_mutex_lock(&ctx->mutex);
+    for (;;) {
+        while (!ctx->shutdown && ctx->started == ctx->submitted)
+            pthread_cond_wait(&ctx->job_cond, &ctx->mutex);
+        if (ctx->shutdown)
+            break;
+        job = ctx->jobs[ctx->started++ % ctx->max_jobs];
+        pthread_mutex_unlock(&ctx->mutex);
+
+        job->error = encode_segment(ctx, job) < 0;
+        free(job->pcm);
+        job->pcm = 0;
+
+        pthread_mutex_lock(&ctx->mutex);
+        job->done = 1;
+        pthread_cond_broadcast(&ctx->done_cond);
+    }
+    pthread_mutex_unlock(&ctx->mutex);
+    return 0;
+}
+
+static
+void free_job(segment_job_t *job)
+{
+    if (job->pcm) free(job->pcm);
+    if (job->data) free(job->data);
+    if (job->sizes) free(job->sizes);
+    free(job);
+}
+
+/*
+ * Pass frames of the oldest job to the callback.
+ * When wait is not set, returns 0 without doing anything if the job is
+ * still in progress.
+ */
+static
+int emit_job(segment_encoder_t *ctx, int wait)
+{
+    segment_job_t *job = ctx->jobs[ctx->emitted % ctx->max_jobs];
+    aacenc_frame_t frame = { 0 };
+    unsigned i;
+    int done, rc = -1;
+
+    pthread_mutex_lock(&ctx->mutex);
+    while (wait && !job->done)
+        pthread_cond_wait(&ctx->done_cond, &ctx->mutex);
+    done = job->done;
+    pthread_mutex_unlock(&ctx->mutex);
+    if (!done)
+        return 0;
+    if (job->error)
+        goto END;
+
+    frame.data = job->data;
+    for (i = 0; i < job->count; ++i) {
+        frame.size = frame.capacity = job->sizes[i];
+        if (ctx->callback(ctx->cookie, &frame) < 0)
+            goto END;
+        frame.data += frame.size;
+    }
+    rc = 1;
+END:
+    ctx->jobs[ctx->emitted++ % ctx->max_jobs] = 0;
+    free_job(job);
+    return rc;
+}
+
+static
+int submit_job(segment_encoder_t *ctx, int is_last)
+{
+    segment_job_t *job;
+    unsigned nframes, channels = ctx->format.channels_per_frame;
+    int rc;
+
+    while (ctx->submitted - ctx->emitted == ctx->max_jobs)
+        if (emit_job(ctx, 1) < 0)
+            return -1;
+
+    nframes = ctx->window_head + ctx->segment_length + ctx->postroll;
+    if (is_last || nframes > ctx->window_frames)
+        nframes = ctx->window_frames;
+
+    if ((job = calloc(1, sizeof(segment_job_t))) == 0)
+        return -1;
+    if ((job->pcm = malloc(nframes * channels * sizeof(INT_PCM) + 1)) == 0) {
+        free(job);
+        return -1;
+    }
+    memcpy(job->pcm, ctx->window, nframes * channels * sizeof(INT_PCM));
+    job->nframes = nframes;
+    job->skip = ctx->window_head / ctx->frame_length;
+    job->keep = is_last ? 0 : ctx->segment_length / ctx->frame_length;
+
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->jobs[ctx->submitted++ % ctx->max_jobs] = job;
+    pthread_cond_signal(&ctx->job_cond);
+    pthread_mutex_unlock(&ctx->mutex);
+
+    if (!is_last) {
+        /* keep tail of the current segment as pre-roll of the next one */
+        unsigned off = ctx->window_head + ctx->segment_length - ctx->preroll;
+        memmove(ctx->window, ctx->window + off * channels,
+                (ctx->window_frames - off) * channels * sizeof(INT_PCM));
+        ctx->window_frames -= off;
+        ctx->window_head = ctx->preroll;
+    }
+    while (ctx->submitted != ctx->emitted)
+        if ((rc = emit_job(ctx, 0)) <= 0)
+            return rc;
+    return 0;
+}
+
+segment_encoder_t *segment_encoder_open(aacenc_pool_t *pool,
+                                        const aacenc_param_t *params,
+                                        const pcm_sample_description_t *format,
+                                        const AACENC_InfoStruct *info,
+                                        unsigned nthreads,
+                                        aacenc_frame_callback_t callback,
+                                        void *cookie)
+{
+    segment_encoder_t *ctx = 0;
+    unsigned n, window_size;
+
+    if ((ctx = calloc(1, sizeof(segment_encoder_t))) == 0)
+        return 0;
+    pthread_mutex_init(&ctx->mutex, 0);
+    pthread_cond_init(&ctx->job_cond, 0);
+    pthread_cond_init(&ctx->done_cond, 0);
+    ctx->pool = pool;
+    memcpy(&ctx->params, params, sizeof(aacenc_param_t));
+    memcpy(&ctx->format, format, sizeof(pcm_sample_description_t));
+    ctx->callback = callback;
+    ctx->cookie = cookie;
+
+    n = ctx->frame_length = info->frameLength;
+    ctx->preroll = segment_preroll_frames(info) * n;
+    ctx->postroll = segment_postroll_frames(info) * n;
+    ctx->segment_length = (format->sample_rate * SEGMENT_SECONDS + n - 1) / n;
+    if (ctx->segment_length * n < 4 * (ctx->preroll + ctx->postroll))
+        ctx->segment_length = 4 * (ctx->preroll + ctx->postroll) / n;
+    ctx->segment_length *= n;
+
+    window_size = ctx->preroll + ctx->segment_length + ctx->postroll;
+    ctx->window = malloc(window_size * format->channels_per_frame
+                         * sizeof(INT_PCM));
+    ctx->max_jobs = nthreads * 2;
+    ctx->jobs = calloc(ctx->max_jobs, sizeof(segment_job_t*));
+    ctx->threads = calloc(nthreads, sizeof(pthread_t));
+    if (!ctx->window || !ctx->jobs || !ctx->threads)
+        goto FAIL;
+
+    for (; ctx->nthreads < nthreads; ++ctx->nthreads) {
+        if (pthread_create(&ctx->threads[ctx->nthreads], 0,
+                           worker_main, ctx) != 0) {
+            fprintf(stderr, "ERROR: failed to create thread\n");
+            goto FAIL;
+        }
+    }
+    return ctx;
+FAIL:
+    segment_encoder_teardown(&ctx);
+    return 0;
+}
+
+int segment_encoder_push(segment_encoder_t *ctx, const INT_PCM *data,
+                         unsigned nframes)
+{
+    unsigned channels = ctx->format.channels_per_frame;
+    unsigned needed, n;
+
+    while (nframes > 0) {
+        needed = ctx->window_head + ctx->segment_length + ctx->postroll;
+        n = needed - ctx->window_frames;
+        if (n > nframes)
+            n = nframes;
+        memcpy(ctx->window + ctx->window_frames * channels, data,
+               n * channels * sizeof(INT_PCM));
+        ctx->window_frames += n;
+        data += n * channels;
+        nframes -= n;
+        if (ctx->window_frames == needed && submit_job(ctx, 0) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int segment_encoder_finish(segment_encoder_t *ctx)
+{
+    if (submit_job(ctx, 1) < 0)
+        return -1;
+    while (ctx->submitted != ctx->emitted)
+        if (emit_job(ctx, 1) < 0)
+            return -1;
+    return 0;
+}
+
+void segment_encoder_teardown(segment_encoder_t **ctx)
+{
+    unsigned i;
+
+    if ((*ctx)->nthreads) {
+        pthread_mutex_lock(&(*ctx)->mutex);
+        (*ctx)->shutdown = 1;
+        pthread_cond_broadcast(&(*ctx)->job_cond);
+        pthread_mutex_unlock(&(*ctx)->mutex);
+        for (i = 0; i < (*ctx)->nthreads; ++i)
+            pthread_join((*ctx)->threads[i], 0);
+    }
+    pthread_cond_destroy(&(*ctx)->done_cond);
+    pthread_cond_destroy(&(*ctx)->job_cond);
+    pthread_mutex_destroy(&(*ctx)->mutex);
+    if ((*ctx)->threads) free((*ctx)->threads);
+    if ((*ctx)->jobs) {
+        for (i = 0; i < (*ctx)->max_jobs; ++i)
+            if ((*ctx)->jobs[i]) free_job((*ctx)->jobs[i]);
+        free((*ctx)->jobs);
+    }
+    if ((*ctx)->window) free((*ctx)->window);
+    free(*ctx);
+    *ctx = 0;
+}
+
+#endif /* HAVE_PTHREAD_H */
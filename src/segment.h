@@ -0,0 +1,54 @@
+/* 
+ * Copyright (C) 2013 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include "aacenc.h"
+#include "encoder_pool.h"
+
+typedef int (*aacenc_frame_callback_t)(void *cookie, aacenc_frame_t *frame);
+
+typedef struct segment_encoder_t segment_encoder_t;
+
+/*
+ * Number of AAC frames to encode before and after a frame aligned segment,
+ * so that the segment joins its neighbors without a gap. State of the
+ * encoder such as psychoacoustic model only settles during pre-roll, and
+ * does not carry over from the previous segment.
+ */
+unsigned segment_preroll_frames(const AACENC_InfoStruct *info);
+
+unsigned segment_postroll_frames(const AACENC_InfoStruct *info);
+
+/*
+ * Splits the PCM stream pushed by the caller into frame aligned segments,
+ * and encodes them concurrently using one encoder instance per segment.
+ * Each segment is preceded by pre-roll taken from the previous segment,
+ * and followed by post-roll taken from the next one. Frames resulting
+ * from the overlapping region are discarded, therefore the callback
+ * receives a gapless and time-aligned sequence of frames, of the same
+ * number and timing as a single encoder would produce. Frames near
+ * boundaries differ from a single encoder run, since each segment is
+ * encoded from fresh state. In CBR, the bit reservoir does not carry over
+ * across boundaries either, so the bitrate is held per segment rather than
+ * over the whole stream.
+ * Encoders are taken from the pool.
+ */
+segment_encoder_t *segment_encoder_open(aacenc_pool_t *pool,
+                                        const aacenc_param_t *params,
+                                        const pcm_sample_description_t *format,
+                                        const AACENC_InfoStruct *info,
+                                        unsigned nthreads,
+                                        aacenc_frame_callback_t callback,
+                                        void *cookie);
+
+int segment_encoder_push(segment_encoder_t *ctx, const INT_PCM *data,
+                         unsigned nframes);
+
+int segment_encoder_finish(segment_encoder_t *ctx);
+
+void segment_encoder_teardown(segment_encoder_t **ctx);
+
+#endif
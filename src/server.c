@@ -0,0 +1,516 @@
+/* 
+ * Copyright (C) 2013 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#if HAVE_CONFIG_H
+#  include "config.h"
+#endif
+#if HAVE_STDINT_H
+#  include <stdint.h>
+#endif
+#if HAVE_INTTYPES_H
+#  include <inttypes.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include "compat.h"
+#include "server.h"
+
+#if HAVE_PTHREAD_H && HAVE_SYS_UN_H
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define MAX_REQUEST_SIZE (1024 * 1024)
+#define PROGRESS_INTERVAL 250   /* in milliseconds */
+
+typedef struct aacenc_server_t aacenc_server_t;
+
+/*
+ * Referenced by the reader thread and by jobs submitted through it,
+ * and freed when all of them have gone.
+ */
+typedef struct connection_t {
+    struct connection_t *next;
+    aacenc_server_t *server;
+    int fd;
+    unsigned refcount;
+    int broken;             /* failed to write */
+    pthread_mutex_t mutex;  /* serializes writes */
+} connection_t;
+
+struct aacenc_server_job_t {
+    struct aacenc_server_job_t *next;
+    unsigned id;
+    connection_t *conn;
+    JSON_Value *request;
+    volatile int cancel;
+    int64_t last_report;
+    char *error;
+};
+
+struct aacenc_server_t {
+    const volatile int *stop;
+    aacenc_server_handler_t handler;
+    void *cookie;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    aacenc_server_job_t *queue;     /* waiting jobs, in FIFO order */
+    aacenc_server_job_t *running;
+    connection_t *connections;
+    unsigned next_id;
+    int draining;
+};
+
+static
+void json_put_string(char *buf, size_t size, const char *s)
+{
+    size_t n = 0;
+
+    for (; *s && n + 8 < size; ++s) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            buf[n++] = '\\';
+            buf[n++] = c;
+        } else if (c < 0x20)
+            n += sprintf(buf + n, "\\u%04x", c);
+        else
+            buf[n++] = c;
+    }
+    buf[n] = 0;
+}
+
+/* caller holds conn->mutex */
+static
+void send_locked(connection_t *conn, const char *msg)
+{
+    size_t len = strlen(msg);
+    ssize_t n;
+
+    while (!conn->broken && len > 0) {
+        if ((n = send(conn->fd, msg, len, MSG_NOSIGNAL)) < 0) {
+            if (errno != EINTR)
+                conn->broken = 1;
+            continue;
+        }
+        msg += n;
+        len -= n;
+    }
+}
+
+static
+void send_reply(connection_t *conn, const char *fmt, ...)
+{
+    char buf[1024];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf) - 1, fmt, ap);
+    va_end(ap);
+    strcat(buf, "\n");
+    pthread_mutex_lock(&conn->mutex);
+    send_locked(conn, buf);
+    pthread_mutex_unlock(&conn->mutex);
+}
+
+/* caller holds server->mutex */
+static
+void release_connection(connection_t *conn)
+{
+    aacenc_server_t *server = conn->server;
+    connection_t **pp;
+
+    if (--conn->refcount)
+        return;
+    for (pp = &server->connections; *pp != conn; pp = &(*pp)->next)
+        ;
+    *pp = conn->next;
+    close(conn->fd);
+    pthread_mutex_destroy(&conn->mutex);
+    free(conn);
+    pthread_cond_broadcast(&server->cond);
+}
+
+/* caller holds server->mutex */
+static
+void free_job(aacenc_server_job_t *job)
+{
+    release_connection(job->conn);
+    json_value_free(job->request);
+    free(job->error);
+    free(job);
+}
+
+static
+void submit_job(connection_t *conn, JSON_Value *request)
+{
+    aacenc_server_t *server = conn->server;
+    aacenc_server_job_t *job, **pp;
+    unsigned id;
+
+    if ((job = calloc(1, sizeof(aacenc_server_job_t))) == 0) {
+        json_value_free(request);
+        send_reply(conn, "{\"error\": \"out of memory\"}");
+        return;
+    }
+    job->request = request;
+    job->conn = conn;
+
+    /* hold the connection so that "queued" is sent before anything else */
+    pthread_mutex_lock(&conn->mutex);
+    pthread_mutex_lock(&server->mutex);
+    if (server->draining) {
+        pthread_mutex_unlock(&server->mutex);
+        send_locked(conn, "{\"error\": \"shutting down\"}\n");
+        pthread_mutex_unlock(&conn->mutex);
+        json_value_free(request);
+        free(job);
+        return;
+    }
+    id = job->id = ++server->next_id;
+    ++conn->refcount;
+    for (pp = &server->queue; *pp; pp = &(*pp)->next)
+        ;
+    *pp = job;
+    pthread_cond_broadcast(&server->cond);
+    pthread_mutex_unlock(&server->mutex);
+    {
+        char buf[64];
+        sprintf(buf, "{\"job\": %u, \"status\": \"queued\"}\n", id);
+        send_locked(conn, buf);
+    }
+    pthread_mutex_unlock(&conn->mutex);
+}
+
+static
+void cancel_job(connection_t *conn, unsigned id)
+{
+    aacenc_server_t *server = conn->server;
+    aacenc_server_job_t *job, **pp;
+    connection_t *owner = 0;
+
+    pthread_mutex_lock(&server->mutex);
+    for (pp = &server->queue; (job = *pp) != 0; pp = &job->next)
+        if (job->id == id)
+            break;
+    if (job) {
+        /* not started yet. just drop it */
+        *pp = job->next;
+        owner = job->conn;
+        ++owner->refcount;
+        free_job(job);
+    } else {
+        for (job = server->running; job; job = job->next)
+            if (job->id == id)
+                break;
+        if (job)
+            job->cancel = 1;
+    }
+    pthread_mutex_unlock(&server->mutex);
+
+    if (owner) {
+        send_reply(owner, "{\"job\": %u, \"status\": \"cancelled\"}", id);
+        if (owner != conn)
+            send_reply(conn, "{\"job\": %u, \"status\": \"cancelled\"}", id);
+        pthread_mutex_lock(&server->mutex);
+        release_connection(owner);
+        pthread_mutex_unlock(&server->mutex);
+    } else if (job)
+        send_reply(conn, "{\"job\": %u, \"status\": \"cancelling\"}", id);
+    else
+        send_reply(conn, "{\"job\": %u, \"error\": \"no such job\"}", id);
+}
+
+static
+void handle_request(connection_t *conn, const char *line)
+{
+    JSON_Value *value;
+    JSON_Object *request;
+
+    if ((value = json_parse_string(line)) == 0 ||
+        (request = json_value_get_object(value)) == 0) {
+        if (value) json_value_free(value);
+        send_reply(conn, "{\"error\": \"invalid request\"}");
+        return;
+    }
+    if (json_object_get_value(request, "cancel")) {
+        cancel_job(conn, (unsigned)json_object_get_number(request, "cancel"));
+        json_value_free(value);
+    } else
+        submit_job(conn, value);
+}
+
+static
+void *connection_main(void *arg)
+{
+    connection_t *conn = arg;
+    aacenc_server_t *server = conn->server;
+    char *buf = 0, *line, *eol;
+    size_t size = 0, capacity = 0;
+    ssize_t n;
+
+    for (;;) {
+        if (size == capacity) {
+            char *p;
+            if (capacity == MAX_REQUEST_SIZE) {
+                send_reply(conn, "{\"error\": \"request too large\"}");
+                break;
+            }
+            capacity = capacity ? capacity * 2 : 4096;
+            if ((p = realloc(buf, capacity)) == 0)
+                break;
+            buf = p;
+        }
+        if ((n = recv(conn->fd, buf + size, capacity - size, 0)) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (n == 0)
+            break;
+        size += n;
+        for (line = buf; (eol = memchr(line, '\n', buf + size - line)) != 0;
+             line = eol + 1) {
+            *eol = 0;
+            if (eol > line)
+                handle_request(conn, line);
+        }
+        size -= line - buf;
+        memmove(buf, line, size);
+    }
+    free(buf);
+    pthread_mutex_lock(&server->mutex);
+    release_connection(conn);
+    pthread_mutex_unlock(&server->mutex);
+    return 0;
+}
+
+static
+void accept_connection(aacenc_server_t *server, int listen_fd)
+{
+    connection_t *conn;
+    pthread_t thread;
+    pthread_attr_t attr;
+    int fd;
+
+    if ((fd = accept(listen_fd, 0, 0)) < 0)
+        return;
+    if ((conn = calloc(1, sizeof(connection_t))) == 0) {
+        close(fd);
+        return;
+    }
+    conn->server = server;
+    conn->fd = fd;
+    conn->refcount = 1;
+    pthread_mutex_init(&conn->mutex, 0);
+
+    pthread_mutex_lock(&server->mutex);
+    conn->next = server->connections;
+    server->connections = conn;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, connection_main, conn) != 0) {
+        fprintf(stderr, "ERROR: failed to create thread\n");
+        release_connection(conn);
+    }
+    pthread_attr_destroy(&attr);
+    pthread_mutex_unlock(&server->mutex);
+}
+
+static
+void *worker_main(void *arg)
+{
+    aacenc_server_t *server = arg;
+    aacenc_server_job_t *job, **pp;
+    char error[512];
+    int64_t start;
+    int rc;
+
+    pthread_mutex_lock(&server->mutex);
+    for (;;) {
+        while (!server->queue && !server->draining)
+            pthread_cond_wait(&server->cond, &server->mutex);
+        if ((job = server->queue) == 0)
+            break;
+        server->queue = job->next;
+        job->next = server->running;
+        server->running = job;
+        pthread_mutex_unlock(&server->mutex);
+
+        send_reply(job->conn, "{\"job\": %u, \"status\": \"running\"}",
+                   job->id);
+        start = aacenc_timer();
+        rc = server->handler(server->cookie, job,
+                             json_value_get_object(job->request));
+        if (rc) {
+            json_put_string(error, sizeof(error),
+                            job->error ? job->error : "encoding failed");
+            send_reply(job->conn, "{\"job\": %u, \"status\": \"failed\", "
+                       "\"error\": \"%s\"}", job->id, error);
+        } else
+            send_reply(job->conn, "{\"job\": %u, \"status\": \"%s\", "
+                       "\"elapsed\": %.3f}", job->id,
+                       job->cancel ? "cancelled" : "done",
+                       (aacenc_timer() - start) / 1000.0);
+
+        pthread_mutex_lock(&server->mutex);
+        for (pp = &server->running; *pp != job; pp = &(*pp)->next)
+            ;
+        *pp = job->next;
+        free_job(job);
+    }
+    pthread_mutex_unlock(&server->mutex);
+    return 0;
+}
+
+static
+int open_socket(const char *path)
+{
+    struct sockaddr_un addr = { 0 };
+    struct stat st;
+    mode_t mask;
+    int fd, rc;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "ERROR: %s: socket path too long\n", path);
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        fprintf(stderr, "ERROR: socket(): %s\n", strerror(errno));
+        return -1;
+    }
+    /* remove stale socket left by a dead server, but not a living one */
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            fprintf(stderr, "ERROR: %s: already in use\n", path);
+            goto FAIL;
+        }
+        unlink(path);
+        close(fd);
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+            fprintf(stderr, "ERROR: socket(): %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    /*
+     * Jobs read and write files with the privileges of the server, so that
+     * only the owner may connect. umask is process wide, but no job is
+     * running to create files yet.
+     */
+    mask = umask(0177);
+    rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (rc < 0 || listen(fd, 16) < 0) {
+        fprintf(stderr, "ERROR: %s: %s\n", path, strerror(errno));
+        goto FAIL;
+    }
+    return fd;
+FAIL:
+    close(fd);
+    return -1;
+}
+
+int aacenc_server_run(const char *path, unsigned nworkers,
+                      const volatile int *stop,
+                      aacenc_server_handler_t handler, void *cookie)
+{
+    aacenc_server_t server = { 0 };
+    pthread_t *workers = 0;
+    unsigned i, nstarted = 0;
+    int listen_fd;
+    connection_t *conn;
+
+    if ((listen_fd = open_socket(path)) < 0)
+        return -1;
+    signal(SIGPIPE, SIG_IGN);
+
+    server.stop = stop;
+    server.handler = handler;
+    server.cookie = cookie;
+    pthread_mutex_init(&server.mutex, 0);
+    pthread_cond_init(&server.cond, 0);
+
+    if ((workers = calloc(nworkers, sizeof(pthread_t))) != 0) {
+        for (; nstarted < nworkers; ++nstarted)
+            if (pthread_create(&workers[nstarted], 0, worker_main, &server))
+                break;
+    }
+    if (!nstarted)
+        fprintf(stderr, "ERROR: failed to create thread\n");
+
+    while (nstarted && !*server.stop) {
+        struct pollfd pfd;
+        pfd.fd = listen_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 200) > 0)
+            accept_connection(&server, listen_fd);
+    }
+    close(listen_fd);
+    unlink(path);
+
+    /* drain: finish accepted jobs, then wait for the clients to go */
+    pthread_mutex_lock(&server.mutex);
+    server.draining = 1;
+    pthread_cond_broadcast(&server.cond);
+    pthread_mutex_unlock(&server.mutex);
+    for (i = 0; i < nstarted; ++i)
+        pthread_join(workers[i], 0);
+    free(workers);
+
+    pthread_mutex_lock(&server.mutex);
+    for (conn = server.connections; conn; conn = conn->next)
+        shutdown(conn->fd, SHUT_RDWR);
+    while (server.connections)
+        pthread_cond_wait(&server.cond, &server.mutex);
+    pthread_mutex_unlock(&server.mutex);
+
+    pthread_mutex_destroy(&server.mutex);
+    pthread_cond_destroy(&server.cond);
+    return nstarted ? 0 : -1;
+}
+
+const volatile int *aacenc_server_job_get_cancel(aacenc_server_job_t *job)
+{
+    return &job->cancel;
+}
+
+void aacenc_server_job_progress(void *cookie, int64_t position, int64_t length)
+{
+    aacenc_server_job_t *job = cookie;
+    int64_t now = aacenc_timer();
+
+    if (now - job->last_report < PROGRESS_INTERVAL)
+        return;
+    job->last_report = now;
+    if (length == INT64_MAX)
+        send_reply(job->conn, "{\"job\": %u, \"position\": %" PRId64 "}",
+                   job->id, position);
+    else
+        send_reply(job->conn, "{\"job\": %u, \"position\": %" PRId64 ", "
+                   "\"progress\": %.1f}", job->id, position,
+                   length ? 100.0 * position / length : 100.0);
+}
+
+void aacenc_server_job_set_error(aacenc_server_job_t *job,
+                                 const char *message)
+{
+    free(job->error);
+    job->error = strdup(message);
+}
+
+#endif
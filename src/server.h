@@ -0,0 +1,44 @@
+/* 
+ * Copyright (C) 2013 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "parson.h"
+
+/*
+ * Accepts encoding jobs over a Unix domain socket, and runs them on a pool
+ * of worker threads.
+ *
+ * Requests and replies are JSON objects, one per line.
+ * A request is either a job description (passed to the handler as is), or
+ * {"cancel": <job id>}.
+ * Replies are in the form of {"job": <id>, ...}, and carry "status"
+ * ("queued", "running", "cancelling", "done", "failed" or "cancelled"),
+ * or "position" (in sample frames) and "progress" (in percent).
+ * Replies for a job are sent to the connection which submitted it.
+ *
+ * When *stop becomes non-zero, new connections and jobs are refused,
+ * and aacenc_server_run() returns when all accepted jobs have finished.
+ */
+typedef struct aacenc_server_job_t aacenc_server_job_t;
+
+/* returns non-zero on failure */
+typedef int (*aacenc_server_handler_t)(void *cookie, aacenc_server_job_t *job,
+                                       JSON_Object *request);
+
+int aacenc_server_run(const char *path, unsigned nworkers,
+                      const volatile int *stop,
+                      aacenc_server_handler_t handler, void *cookie);
+
+const volatile int *aacenc_server_job_get_cancel(aacenc_server_job_t *job);
+
+/* can be used as aacenc_progress_callback_t */
+void aacenc_server_job_progress(void *job, int64_t position, int64_t length);
+
+/* reported to the client in the final reply */
+void aacenc_server_job_set_error(aacenc_server_job_t *job,
+                                 const char *message);
+
+#endif
@@ -0,0 +1,897 @@
+/* 
+ * Copyright (C) 2013 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#if HAVE_CONFIG_H
+#  include "config.h"
+#endif
+#if HAVE_STDINT_H
+#  include <stdint.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#include "compat.h"
+#include "session.h"
+#include "spsc_ring.h"
+
+/* number of PCM blocks / AAC frames buffered between threads */
+#define PIPELINE_DEPTH 64
+
+/*
+ * In PCM frames. Per-frame cost of reading is lowest around here; larger
+ * blocks no longer fit in cache through the conversion stages.
+ */
+#define DEFAULT_BLOCK_SIZE 16384
+
+/*
+ * Source of push mode.
+ * Read returns 0 when the buffer is empty, which is taken as EOF by the
+ * readers on top of it. Therefore, session reads from it only when enough
+ * frames are buffered, or the input is finished.
+ */
+typedef struct push_source_t {
+    pcm_reader_vtbl_t *vtbl;
+    pcm_sample_description_t format;
+    uint8_t *data;
+    size_t size;            /* in bytes, including consumed part */
+    size_t capacity;
+    size_t offset;          /* consumed bytes */
+    int64_t position;
+} push_source_t;
+
+struct aacenc_session_t {
+    aacenc_session_params_t params;
+    pcm_reader_t *reader;
+    push_source_t *source;  /* push mode only. owned by the reader */
+    pcm_sample_description_t format;    /* of the input to the encoder */
+    aacenc_pool_t *own_pool;
+    HANDLE_AACENCODER encoder;
+    AACENC_InfoStruct info;
+    int sbr_mode;
+    unsigned scale_shift;
+
+    m4af_io_callbacks_t io;
+    void *io_cookie;
+    m4af_ctx_t *m4af;
+    int m4af_started;       /* m4af_begin_write() is deferred */
+    aacenc_frame_callback_t frame_callback;
+    void *frame_cookie;
+    aacenc_progress_callback_t progress_callback;
+    void *progress_cookie;
+
+    segment_encoder_t *segenc;
+    INT_PCM *ibuf;
+    aacenc_frame_t obuf;
+    int is_padding;
+    int encoded;            /* index of the next frame from the encoder */
+    int frames_written;
+    aacenc_frame_t last;
+    int last_index;
+
+    /*
+     * Segment mode: frames out of [segment_first, segment_last) are
+     * discarded. Indices are counted in frames of the stream fed to the
+     * encoder, including padding by the extrapolater.
+     */
+    int segment_first;
+    int segment_last;
+    int64_t skip_until;     /* read but not encoded (before pre-roll) */
+    int64_t read_limit;     /* end of post-roll */
+    int64_t fed;            /* PCM frames read from the reader */
+    int eof;
+#if HAVE_PTHREAD_H && HAVE_STDATOMIC_H
+    spsc_ring_t *ring;      /* queue of frames to the writer thread */
+    uint32_t max_frame_size;
+    pthread_t writer;
+    int writer_started;
+    int writer_failed;
+#endif
+    int64_t frames_read;
+    int finalized;
+
+    pcm_reader_t *block_reader; /* owned by the reader */
+    int64_t blocks;
+    int64_t block_usec;
+
+    /* low-latency mode only, in microseconds */
+    int64_t read_time;
+    int64_t processing_total;
+    int64_t processing_max;
+    int frames_timed;
+};
+
+static const
+pcm_sample_description_t *push_source_get_format(pcm_reader_t *reader)
+{
+    return &((push_source_t *)reader)->format;
+}
+
+static int64_t push_source_get_length(pcm_reader_t *reader)
+{
+    return INT64_MAX;
+}
+
+static int64_t push_source_get_position(pcm_reader_t *reader)
+{
+    return ((push_source_t *)reader)->position;
+}
+
+static int push_source_read_frames(pcm_reader_t *reader, void *buffer,
+                                   unsigned nframes)
+{
+    push_source_t *self = (push_source_t *)reader;
+    unsigned bpf = self->format.bytes_per_frame;
+    unsigned n = (self->size - self->offset) / bpf;
+
+    if (n > nframes)
+        n = nframes;
+    memcpy(buffer, self->data + self->offset, n * bpf);
+    self->offset += n * bpf;
+    self->position += n;
+    return n;
+}
+
+static void push_source_teardown(pcm_reader_t **reader)
+{
+    push_source_t *self = (push_source_t *)*reader;
+    free(self->data);
+    free(self);
+    *reader = 0;
+}
+
+static pcm_reader_vtbl_t push_source_vtable = {
+    push_source_get_format,
+    push_source_get_length,
+    push_source_get_position,
+    push_source_read_frames,
+    push_source_teardown
+};
+
+static
+push_source_t *push_source_open(const pcm_sample_description_t *format)
+{
+    push_source_t *self;
+
+    if ((self = calloc(1, sizeof(push_source_t))) == 0)
+        return 0;
+    self->vtbl = &push_source_vtable;
+    memcpy(&self->format, format, sizeof(self->format));
+    return self;
+}
+
+static
+int push_source_append(push_source_t *self, const void *data,
+                       unsigned nframes)
+{
+    size_t bytes = nframes * self->format.bytes_per_frame;
+
+    if (self->offset) {
+        memmove(self->data, self->data + self->offset,
+                self->size - self->offset);
+        self->size -= self->offset;
+        self->offset = 0;
+    }
+    if (self->size + bytes > self->capacity) {
+        size_t capacity = self->capacity ? self->capacity : 4096;
+        uint8_t *p;
+        while (capacity < self->size + bytes)
+            capacity *= 2;
+        if ((p = realloc(self->data, capacity)) == 0)
+            return -1;
+        self->data = p;
+        self->capacity = capacity;
+    }
+    memcpy(self->data + self->size, data, bytes);
+    self->size += bytes;
+    return 0;
+}
+
+static
+unsigned push_source_available(push_source_t *self)
+{
+    return (self->size - self->offset) / self->format.bytes_per_frame;
+}
+
+static int do_smart_padding(const aacenc_session_params_t *params)
+{
+    int profile = params->profile;
+
+    if (params->low_latency)
+        return 0;
+    return profile == 2 || profile == 5 || profile == 29;
+}
+
+static int is_cancelled(aacenc_session_t *s)
+{
+    return s->params.cancel && *s->params.cancel;
+}
+
+static
+int write_sample(aacenc_session_t *s, aacenc_frame_t *frame)
+{
+    if (s->frame_callback) {
+        if (s->frame_callback(s->frame_cookie, frame) < 0)
+            return -1;
+    } else if (s->m4af) {
+        if (!s->m4af_started) {
+            m4af_begin_write(s->m4af);
+            s->m4af_started = 1;
+        }
+        if (m4af_write_sample(s->m4af, 0, frame->data, frame->size, 0) < 0) {
+            fprintf(stderr, "ERROR: failed to write m4a sample\n");
+            return -1;
+        }
+    } else if (!s->io.write ||
+               s->io.write(s->io_cookie, frame->data, frame->size) < 0) {
+        fprintf(stderr, "ERROR: write failed: %s\n", strerror(errno));
+        return -1;
+    }
+    if (s->params.low_latency) {
+        int64_t elapsed = aacenc_timer_usec() - s->read_time;
+        s->processing_total += elapsed;
+        if (s->processing_max < elapsed)
+            s->processing_max = elapsed;
+        ++s->frames_timed;
+    }
+    return 0;
+}
+
+static
+int write_frame(aacenc_session_t *s, aacenc_frame_t *frame)
+{
+    int index = s->encoded++;
+
+    if (index < s->segment_first || index >= s->segment_last)
+        return 0;
+    if (!s->is_padding) {
+        if (write_sample(s, frame) < 0)
+            return -1;
+        ++s->frames_written;
+        return 0;
+    }
+    /*
+     * As we pad 1 frame at beginning and ending by our extrapolater,
+     * we want to drop them.
+     * We delay output by 1 frame, and discard second frame and final
+     * frame from the encoder.
+     * Since sbr_header is included in the first frame (in case of SBR),
+     * we cannot discard first frame. So we pick second instead.
+     */
+    if (index != s->segment_first && index != 2) {
+        if (write_sample(s, &s->last) < 0)
+            return -1;
+        ++s->frames_written;
+    }
+    if (s->last.capacity < frame->size) {
+        uint8_t *p = realloc(s->last.data, frame->size);
+        if (!p) return -1;
+        s->last.data = p;
+        s->last.capacity = frame->size;
+    }
+    memcpy(s->last.data, frame->data, frame->size);
+    s->last.size = frame->size;
+    s->last_index = index;
+    return 0;
+}
+
+#if HAVE_PTHREAD_H && HAVE_STDATOMIC_H
+static
+void *writer_main(void *arg)
+{
+    aacenc_session_t *s = arg;
+    aacenc_frame_t frame = { 0 };
+    uint8_t *slot;
+
+    while ((slot = spsc_ring_peek(s->ring)) != 0) {
+        memcpy(&frame.size, slot, sizeof(uint32_t));
+        frame.data = slot + sizeof(uint32_t);
+        frame.capacity = frame.size;
+        if (write_frame(s, &frame) < 0) {
+            s->writer_failed = 1;
+            /* let the producer fail in spsc_ring_reserve() */
+            spsc_ring_close(s->ring);
+            break;
+        }
+        spsc_ring_release(s->ring);
+    }
+    return 0;
+}
+
+static
+int start_writer(aacenc_session_t *s)
+{
+    unsigned channel_mode = aacEncoder_GetParam(s->encoder,
+                                                AACENC_CHANNELMODE);
+    /* same as the output buffer size of aac_encode_frame() */
+    s->max_frame_size = 6144 / 8 * channel_mode;
+    s->ring = spsc_ring_create(PIPELINE_DEPTH,
+                               s->max_frame_size + sizeof(uint32_t));
+    if (!s->ring)
+        return -1;
+    if (pthread_create(&s->writer, 0, writer_main, s) != 0) {
+        fprintf(stderr, "ERROR: failed to create thread\n");
+        return -1;
+    }
+    s->writer_started = 1;
+    return 0;
+}
+#endif
+
+static
+int finish_writer(aacenc_session_t *s)
+{
+    int rc = 0;
+#if HAVE_PTHREAD_H && HAVE_STDATOMIC_H
+    if (s->writer_started) {
+        spsc_ring_close(s->ring);
+        pthread_join(s->writer, 0);
+        s->writer_started = 0;
+        if (s->writer_failed)
+            rc = -1;
+    }
+    if (s->ring) spsc_ring_teardown(&s->ring);
+#endif
+    return rc;
+}
+
+static
+int put_frame(void *cookie, aacenc_frame_t *frame)
+{
+    aacenc_session_t *s = cookie;
+#if HAVE_PTHREAD_H && HAVE_STDATOMIC_H
+    uint8_t *slot;
+
+    if (s->ring) {
+        if (frame->size > s->max_frame_size)
+            return -1;
+        if ((slot = spsc_ring_reserve(s->ring)) == 0)
+            return -1;
+        memcpy(slot, &frame->size, sizeof(uint32_t));
+        memcpy(slot + sizeof(uint32_t), frame->data, frame->size);
+        spsc_ring_commit(s->ring);
+        return 0;
+    }
+#endif
+    return write_frame(s, frame);
+}
+
+/*
+ * Feed PCM frames (or EOF when nframes is 0) to the encoder.
+ * Returns 1 when the encoder has been completely flushed.
+ */
+static
+int encode_frames(aacenc_session_t *s, const INT_PCM *ip, int nframes)
+{
+    const pcm_sample_description_t *fmt = &s->format;
+    int consumed;
+
+#if HAVE_PTHREAD_H
+    if (s->segenc) {
+        if (nframes)
+            return segment_encoder_push(s->segenc, ip, nframes);
+        return segment_encoder_finish(s->segenc) < 0 ? -1 : 1;
+    }
+#endif
+    do {
+        consumed = aac_encode_frame(s->encoder, fmt, ip, nframes, &s->obuf);
+        if (consumed < 0) return -1;
+        if (consumed == 0 && s->obuf.size == 0) return 1;
+        if (s->obuf.size == 0) break;
+
+        nframes -= consumed;
+        ip += consumed * fmt->channels_per_frame;
+        if (put_frame(s, &s->obuf) < 0)
+            return -1;
+    } while (nframes > 0);
+    return 0;
+}
+
+/*
+ * Always read by frameLength, so that extrapolater can pad exactly 1 frame
+ * at beginning and ending.
+ */
+static
+int encode_next(aacenc_session_t *s)
+{
+    int nread, rc = 0;
+    const void *ip;
+
+    if (s->fed >= s->read_limit)
+        return 0;
+    if ((nread = pcm_acquire_frames(s->reader, &ip, s->ibuf,
+                                    s->info.frameLength)) < 0) {
+        fprintf(stderr, "ERROR: read failed\n");
+        return -1;
+    }
+    s->eof = nread == 0;
+    s->fed += nread;
+    if (s->params.low_latency)
+        s->read_time = aacenc_timer_usec();
+    if (s->fed > s->skip_until && nread > 0)
+        rc = encode_frames(s, ip, nread);
+    pcm_release_frames(s->reader);
+    if (s->progress_callback)
+        s->progress_callback(s->progress_cookie, pcm_get_position(s->reader),
+                             pcm_get_length(s->reader));
+    return rc < 0 ? -1 : nread;
+}
+
+/*
+ * Segment boundary (in frames of the input) into index of the frame fed to
+ * the encoder, which is shifted by the padding except for the beginning.
+ */
+static
+int segment_boundary(aacenc_session_t *s, int64_t position)
+{
+    int64_t index = position / s->info.frameLength;
+
+    if (index > 0 && s->is_padding)
+        ++index;
+    return index < INT_MAX ? (int)index : INT_MAX;
+}
+
+static
+void setup_segment(aacenc_session_t *s)
+{
+    aacenc_session_params_t *params = &s->params;
+    unsigned n = s->info.frameLength;
+    int preroll;
+
+    s->segment_last = INT_MAX;
+    s->read_limit = INT64_MAX;
+    if (!params->segment_start && !params->segment_end)
+        return;
+    s->segment_first = segment_boundary(s, params->segment_start);
+    preroll = segment_preroll_frames(&s->info);
+    if (s->segment_first > preroll) {
+        s->encoded = s->segment_first - preroll;
+        s->skip_until = (int64_t)s->encoded * n;
+    }
+    if (params->segment_end) {
+        s->segment_last = segment_boundary(s, params->segment_end);
+        s->read_limit = ((int64_t)s->segment_last
+                         + segment_postroll_frames(&s->info)) * n;
+    }
+}
+
+/*
+ * Upper bound of the number of frames for the whole input, including the
+ * frames for the encoder delay. 0 when the length is unknown.
+ */
+static
+uint32_t estimate_frame_count(aacenc_session_t *s)
+{
+    int64_t length = pcm_get_length(s->reader);
+    int64_t frames;
+
+    if (length < 0 || length == INT64_MAX)
+        return 0;
+    frames = (length + aacenc_session_get_delay(s)) / s->info.frameLength + 4;
+    return frames < UINT32_MAX ? frames : 0;
+}
+
+static
+int setup_encoder(aacenc_session_t *s)
+{
+    aacenc_session_params_t *params = &s->params;
+
+    if (params->low_latency) {
+        /* both of them hold PCM or frames in their queues */
+        params->pipeline = 0;
+        params->num_threads = 1;
+    }
+    /* extrapolater doesn't change the format */
+    memcpy(&s->format, pcm_get_format(s->reader), sizeof(s->format));
+    s->sbr_mode = aacenc_is_sbr_active((aacenc_param_t*)params);
+    if (s->sbr_mode && !aacenc_is_sbr_ratio_available()) {
+        fprintf(stderr, "WARNING: Only dual-rate SBR is available "
+                        "for this version\n");
+        params->sbr_ratio = 2;
+    }
+    s->scale_shift = aacenc_is_dual_rate_sbr((aacenc_param_t*)params);
+    params->sbr_signaling = 0;
+    if (s->sbr_mode) {
+        if (params->transport_format == TT_MP4_LOAS || !s->scale_shift)
+            params->sbr_signaling = 2;
+        if (params->transport_format == TT_MP4_RAW &&
+            aacenc_is_explicit_bw_compatible_sbr_signaling_available())
+            params->sbr_signaling = 1;
+    }
+    if (!params->pool) {
+        /* segment encoders of each thread are reused */
+        if ((s->own_pool =
+                aacenc_pool_create(params->num_threads + 1)) == 0)
+            return -1;
+        params->pool = s->own_pool;
+    }
+    if (aacenc_pool_acquire(params->pool, &s->encoder,
+                            (aacenc_param_t*)params, &s->format,
+                            &s->info) < 0)
+        return -1;
+    /*
+     * Push mode is not read by blocks, since the source is drained by
+     * frameLength as soon as pushed.
+     */
+    if (!params->block_size)
+        params->block_size = DEFAULT_BLOCK_SIZE;
+    if (params->block_size > s->info.frameLength &&
+        !params->low_latency && !s->source) {
+        pcm_reader_t *reader = pcm_open_block_reader(s->reader,
+                                                     params->block_size);
+        if (!reader)
+            return -1;
+        s->reader = s->block_reader = reader;
+    }
+    if (do_smart_padding(params)) {
+        pcm_reader_t *reader = extrapolater_open(s->reader);
+        if (!reader)
+            return -1;
+        s->reader = reader;
+    }
+#if HAVE_PTHREAD_H && HAVE_STDATOMIC_H
+    if (params->pipeline && !s->source) {
+        s->reader = pcm_open_threaded_reader(s->reader, s->info.frameLength,
+                                             PIPELINE_DEPTH);
+        if (!s->reader)
+            return -1;
+    }
+#endif
+    if ((s->ibuf = malloc(s->info.frameLength *
+                          s->format.bytes_per_frame)) == 0)
+        return -1;
+    s->is_padding = do_smart_padding(params);
+    setup_segment(s);
+#if HAVE_PTHREAD_H && HAVE_STDATOMIC_H
+    if (params->pipeline && start_writer(s) < 0)
+        return -1;
+#endif
+#if HAVE_PTHREAD_H
+    if (params->num_threads > 1) {
+        s->segenc = segment_encoder_open(params->pool,
+                                         (aacenc_param_t*)params,
+                                         &s->format, &s->info,
+                                         params->num_threads, put_frame, s);
+        if (!s->segenc) {
+            fprintf(stderr, "ERROR: failed to initialize segment encoder\n");
+            return -1;
+        }
+    }
+#endif
+    return 0;
+}
+
+static
+aacenc_session_t *session_open(const aacenc_session_params_t *params,
+                               pcm_reader_t *reader, push_source_t *source)
+{
+    aacenc_session_t *s;
+
+    if ((s = calloc(1, sizeof(aacenc_session_t))) == 0) {
+        pcm_teardown(&reader);
+        return 0;
+    }
+    s->params = *params;
+    s->reader = reader;
+    s->source = source;
+    if (setup_encoder(s) < 0)
+        aacenc_session_close(&s);
+    return s;
+}
+
+aacenc_session_t *aacenc_session_open(const aacenc_session_params_t *params,
+                                      const pcm_sample_description_t *format)
+{
+    push_source_t *source;
+    pcm_reader_t *reader, *converter;
+
+    if ((source = push_source_open(format)) == 0)
+        return 0;
+    reader = (pcm_reader_t *)source;
+    if ((converter = pcm_open_native_converter(reader)) == 0)
+        goto FAIL;
+    reader = converter;
+    if ((converter = pcm_open_sint16_converter(reader)) == 0)
+        goto FAIL;
+    return session_open(params, converter, source);
+FAIL:
+    pcm_teardown(&reader);
+    return 0;
+}
+
+aacenc_session_t *
+aacenc_session_open_reader(const aacenc_session_params_t *params,
+                           pcm_reader_t *reader)
+{
+    return session_open(params, reader, 0);
+}
+
+int aacenc_session_set_output(aacenc_session_t *session,
+                              m4af_io_callbacks_t *io, void *cookie)
+{
+    aacenc_session_t *s = session;
+
+    s->io = *io;
+    s->io_cookie = cookie;
+    if (s->params.transport_format)
+        return 0;
+    s->m4af = m4af_create(M4AF_CODEC_MP4A, aacenc_session_get_timescale(s, 0),
+                          io, cookie, s->params.no_timestamp);
+    if (!s->m4af)
+        return -1;
+    if (s->params.fragment_duration)
+        m4af_set_fragment_duration(s->m4af, s->params.fragment_duration);
+    aacenc_session_setup_m4a_track(s, s->m4af, 0);
+    m4af_set_priming_mode(s->m4af, s->params.gapless_mode + 1);
+    return 0;
+}
+
+void aacenc_session_set_frame_callback(aacenc_session_t *session,
+                                       aacenc_frame_callback_t callback,
+                                       void *cookie)
+{
+    session->frame_callback = callback;
+    session->frame_cookie = cookie;
+}
+
+void aacenc_session_set_progress_callback(aacenc_session_t *session,
+                                          aacenc_progress_callback_t callback,
+                                          void *cookie)
+{
+    session->progress_callback = callback;
+    session->progress_cookie = cookie;
+}
+
+int aacenc_session_push(aacenc_session_t *session, const void *data,
+                        unsigned nframes)
+{
+    if (!session->source || session->finalized)
+        return -1;
+    if (push_source_append(session->source, data, nframes) < 0)
+        return -1;
+    while (!is_cancelled(session) && session->fed < session->read_limit &&
+           push_source_available(session->source) >= session->info.frameLength)
+        if (encode_next(session) < 0)
+            return -1;
+    return 0;
+}
+
+int aacenc_session_run(aacenc_session_t *session)
+{
+    int nread;
+
+    if (session->source || session->finalized)
+        return -1;
+    do {
+        if (is_cancelled(session))
+            break;
+        if ((nread = encode_next(session)) < 0)
+            return -1;
+    } while (nread > 0);
+    return 0;
+}
+
+int aacenc_session_finalize(aacenc_session_t *session)
+{
+    aacenc_session_t *s = session;
+    int done, nread;
+
+    if (s->finalized)
+        return -1;
+    s->finalized = 1;
+    if (s->source) {
+        do {
+            if (is_cancelled(s))
+                break;
+            if ((nread = encode_next(s)) < 0)
+                return -1;
+        } while (nread > 0);
+    }
+    while ((done = encode_frames(s, 0, 0)) == 0)
+        ;
+    if (done < 0 || finish_writer(s) < 0)
+        return -1;
+    /*
+     * When cancelled, we haven't pulled out last extrapolated frames
+     * from the reader. Therefore, we have to write the final outcome.
+     * Same for a segment ending before the final frame.
+     */
+    if (s->last.size && (is_cancelled(s) ||
+                         (s->last_index + 1 < s->encoded &&
+                          s->last_index != 1))) {
+        if (write_sample(s, &s->last) < 0)
+            return -1;
+        ++s->frames_written;
+    }
+    /* nothing is read anymore. let the source (and threads) go */
+    s->frames_read = pcm_get_position(s->reader);
+    if (s->block_reader) {
+        pcm_get_block_stats(s->block_reader, &s->blocks, &s->block_usec);
+        s->block_reader = 0;
+    }
+    pcm_teardown(&s->reader);
+
+    if (s->m4af) {
+        if (!s->m4af_started) {
+            m4af_begin_write(s->m4af);
+            s->m4af_started = 1;
+        }
+        aacenc_session_set_m4a_priming(s, s->m4af, 0);
+        if (m4af_finalize(s->m4af, s->params.moov_before_mdat) < 0) {
+            fprintf(stderr, "ERROR: failed to finalize m4a\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void aacenc_session_close(aacenc_session_t **session)
+{
+    aacenc_session_t *s = *session;
+
+#if HAVE_PTHREAD_H
+    if (s->segenc) segment_encoder_teardown(&s->segenc);
+#endif
+    finish_writer(s);
+    if (s->reader) pcm_teardown(&s->reader);
+    if (s->encoder) aacenc_pool_release(s->params.pool, s->encoder);
+    if (s->m4af) m4af_teardown(&s->m4af);
+    if (s->own_pool) aacenc_pool_teardown(&s->own_pool);
+    if (s->ibuf) free(s->ibuf);
+    if (s->obuf.data) free(s->obuf.data);
+    if (s->last.data) free(s->last.data);
+    free(s);
+    *session = 0;
+}
+
+m4af_ctx_t *aacenc_session_get_m4af(aacenc_session_t *session)
+{
+    return session->m4af;
+}
+
+HANDLE_AACENCODER aacenc_session_get_encoder(aacenc_session_t *session)
+{
+    return session->encoder;
+}
+
+const pcm_sample_description_t *
+aacenc_session_get_format(aacenc_session_t *session)
+{
+    return &session->format;
+}
+
+uint32_t aacenc_session_get_timescale(aacenc_session_t *session,
+                                      uint32_t *frame_duration)
+{
+    if (frame_duration)
+        *frame_duration = session->info.frameLength >> session->scale_shift;
+    return session->format.sample_rate >> session->scale_shift;
+}
+
+int64_t aacenc_session_get_position(aacenc_session_t *session)
+{
+    if (session->reader)
+        return pcm_get_position(session->reader);
+    return session->frames_read;
+}
+
+int aacenc_session_get_frame_count(aacenc_session_t *session)
+{
+    return session->frames_written;
+}
+
+int aacenc_session_is_complete(aacenc_session_t *session)
+{
+    return session->eof && !is_cancelled(session)
+        && session->encoded <= session->segment_last;
+}
+
+int aacenc_session_get_latency(aacenc_session_t *session,
+                               aacenc_latency_t *latency)
+{
+    aacenc_session_t *s = session;
+    double rate = s->format.sample_rate;
+#if AACENCODER_LIB_VL0 < 4
+    uint32_t delay = s->info.encoderDelay;
+#else
+    uint32_t delay = s->info.nDelay;
+#endif
+
+    if (!s->params.low_latency)
+        return -1;
+    latency->frame = s->info.frameLength * 1000.0 / rate;
+    latency->algorithmic = delay * 1000.0 / rate;
+    latency->processing_avg = s->frames_timed ?
+        s->processing_total / 1000.0 / s->frames_timed : 0.0;
+    latency->processing_max = s->processing_max / 1000.0;
+    return 0;
+}
+
+int aacenc_session_get_block_stats(aacenc_session_t *session,
+                                   unsigned *block_size, int64_t *blocks,
+                                   int64_t *usec)
+{
+    if (!session->blocks)
+        return -1;
+    *block_size = session->params.block_size;
+    *blocks = session->blocks;
+    *usec = session->block_usec;
+    return 0;
+}
+
+int aacenc_session_get_asc(aacenc_session_t *session, uint8_t *asc,
+                           uint32_t *size)
+{
+    AACENC_InfoStruct *aacinfo = &session->info;
+
+    if (aacenc_is_explicit_bw_compatible_sbr_signaling_available()) {
+        if (*size < aacinfo->confSize)
+            return -1;
+        memcpy(asc, aacinfo->confBuf, aacinfo->confSize);
+        *size = aacinfo->confSize;
+        return 0;
+    }
+    return aacenc_mp4asc((aacenc_param_t*)&session->params, aacinfo->confBuf,
+                         aacinfo->confSize, asc, size);
+}
+
+uint32_t aacenc_session_get_delay(aacenc_session_t *session)
+{
+    aacenc_session_t *s = session;
+#if AACENCODER_LIB_VL0 < 4
+    uint32_t delay = s->info.encoderDelay;
+    if (s->sbr_mode && s->params.profile != AOT_ER_AAC_ELD
+        && !s->params.include_sbr_delay)
+        delay -= 481 << s->scale_shift;
+    return delay;
+#else
+    return s->params.include_sbr_delay ? s->info.nDelay : s->info.nDelayCore;
+#endif
+}
+
+void aacenc_session_setup_m4a_track(aacenc_session_t *session,
+                                    m4af_ctx_t *m4af, uint32_t track_idx)
+{
+    const pcm_sample_description_t *sample_format = &session->format;
+    AACENC_InfoStruct *aacinfo = &session->info;
+    aacenc_session_params_t *params = &session->params;
+    uint8_t mp4asc[64];
+    uint32_t ascsize = sizeof(mp4asc);
+
+    m4af_set_num_channels(m4af, track_idx, sample_format->channels_per_frame);
+    m4af_set_fixed_frame_duration(m4af, track_idx,
+                                  aacinfo->frameLength >> session->scale_shift);
+    aacenc_session_get_asc(session, mp4asc, &ascsize);
+    m4af_set_decoder_specific_info(m4af, track_idx, mp4asc, ascsize);
+    m4af_set_vbr_mode(m4af, track_idx, params->bitrate_mode);
+    m4af_set_bitrate_hint(m4af, track_idx,
+                          aacEncoder_GetParam(session->encoder,
+                                              AACENC_BITRATE),
+                          aacinfo->maxOutBufBytes);
+    if (params->moov_before_mdat)
+        m4af_set_expected_samples(m4af, track_idx,
+                                  estimate_frame_count(session));
+    /* fragmented moov is written first, when only the delay is known */
+    if (params->fragment_duration)
+        m4af_set_priming(m4af, track_idx,
+                         aacenc_session_get_delay(session)
+                            >> session->scale_shift, 0);
+}
+
+void aacenc_session_set_m4a_priming(aacenc_session_t *session,
+                                    m4af_ctx_t *m4af, uint32_t track_idx)
+{
+    aacenc_session_t *s = session;
+    uint32_t padding;
+    uint32_t delay = aacenc_session_get_delay(s);
+
+    padding = s->frames_written * s->info.frameLength - s->frames_read
+            - delay;
+    m4af_set_priming(m4af, track_idx, delay >> s->scale_shift,
+                     padding >> s->scale_shift);
+}
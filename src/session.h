@@ -0,0 +1,178 @@
+/* 
+ * Copyright (C) 2013 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "aacenc.h"
+#include "m4af.h"
+#include "pcm_reader.h"
+#include "encoder_pool.h"
+#include "segment.h"
+
+/*
+ * Encoding session: takes PCM, and produces either AAC frames or an M4A
+ * file.
+ * Sessions share no state with each other (except for the encoder pool,
+ * which is thread safe), therefore any number of sessions can be run
+ * concurrently on different threads.
+ *
+ * PCM is supplied in one of the following ways:
+ *
+ * - push mode (aacenc_session_open()): caller pushes PCM of the given
+ *   format by aacenc_session_push(). Floating point input is clipped,
+ *   since the limiter used by the CLI requires unbounded look-ahead.
+ * - pull mode (aacenc_session_open_reader()): session reads the given
+ *   pcm_reader until EOF by aacenc_session_run().
+ *
+ * Output is given by either of aacenc_session_set_output() or
+ * aacenc_session_set_frame_callback() before supplying PCM.
+ * With the former, the session writes a complete M4A file when
+ * transport_format is 0, otherwise each frame is written by io->write.
+ * M4A header is written on the first frame, so that tags added before
+ * supplying PCM are counted in the space reserved for moov on
+ * moov_before_mdat. With fragment_duration, the M4A is fragmented and
+ * written sequentially (see m4af_set_fragment_duration()).
+ * With the latter, each frame is passed to the callback as is.
+ * aacenc_session_finalize() flushes the encoder and finishes the output.
+ *
+ * In segment mode (segment_start or segment_end is set), only frames for
+ * the range of input [segment_start, segment_end) are output, with both
+ * ends rounded down to the frame boundary. segment_end of 0 means EOF.
+ * The input is still read from the beginning, but encoding starts at the
+ * pre-roll of the segment. Frames of adjacent segments are joined
+ * seamlessly (gapless, with correct priming), but frames around the
+ * boundaries are encoded independently, and are not the same as the
+ * result of encoding the whole input.
+ *
+ * In pull mode, the reader is read by block_size frames at a time, and
+ * the encoder is fed with frames sliced out of the block. Block size not
+ * larger than the frame length of the encoder turns it off.
+ *
+ * In low-latency mode, nothing is buffered by the session beyond what the
+ * encoder requires: smart padding is not done, and pipeline and
+ * num_threads are ignored. Meant for AAC-LD/ELD over ADTS/LOAS.
+ */
+
+/* can be embedded at the head of a larger structure, like AACENC_PARAMS */
+#define AACENC_SESSION_PARAMS \
+    AACENC_PARAMS \
+    unsigned gapless_mode; \
+    unsigned include_sbr_delay; \
+    int moov_before_mdat; \
+    unsigned fragment_duration; /* in ms, 0 for unfragmented M4A */ \
+    int no_timestamp; \
+    unsigned num_threads; \
+    int pipeline; \
+    unsigned block_size;        /* 0 for the default */ \
+    int low_latency; \
+    int64_t segment_start; \
+    int64_t segment_end; \
+    aacenc_pool_t *pool;        /* optional */ \
+    const volatile int *cancel; /* optional, stops reading when non-zero */
+
+typedef struct aacenc_session_params_t {
+    AACENC_SESSION_PARAMS
+} aacenc_session_params_t;
+
+/* length is INT64_MAX when unknown, like pcm_get_length() */
+typedef void (*aacenc_progress_callback_t)(void *cookie, int64_t position,
+                                           int64_t length);
+
+typedef struct aacenc_session_t aacenc_session_t;
+
+aacenc_session_t *aacenc_session_open(const aacenc_session_params_t *params,
+                                      const pcm_sample_description_t *format);
+
+/* ownership of the reader is taken, even on failure */
+aacenc_session_t *
+aacenc_session_open_reader(const aacenc_session_params_t *params,
+                           pcm_reader_t *reader);
+
+/* io->read and io->seek are required for M4A */
+int aacenc_session_set_output(aacenc_session_t *session,
+                              m4af_io_callbacks_t *io, void *cookie);
+
+/* called on the writer thread in pipeline mode */
+void aacenc_session_set_frame_callback(aacenc_session_t *session,
+                                       aacenc_frame_callback_t callback,
+                                       void *cookie);
+
+void aacenc_session_set_progress_callback(aacenc_session_t *session,
+                                          aacenc_progress_callback_t callback,
+                                          void *cookie);
+
+int aacenc_session_push(aacenc_session_t *session, const void *data,
+                        unsigned nframes);
+
+int aacenc_session_run(aacenc_session_t *session);
+
+int aacenc_session_finalize(aacenc_session_t *session);
+
+void aacenc_session_close(aacenc_session_t **session);
+
+/* NULL unless the session writes M4A. tags can be added before finalize */
+m4af_ctx_t *aacenc_session_get_m4af(aacenc_session_t *session);
+
+HANDLE_AACENCODER aacenc_session_get_encoder(aacenc_session_t *session);
+
+const pcm_sample_description_t *
+aacenc_session_get_format(aacenc_session_t *session);
+
+/* timescale and frame duration of the output, as stored in M4A */
+uint32_t aacenc_session_get_timescale(aacenc_session_t *session,
+                                      uint32_t *frame_duration);
+
+/* number of PCM frames consumed */
+int64_t aacenc_session_get_position(aacenc_session_t *session);
+
+/* number of AAC frames written */
+int aacenc_session_get_frame_count(aacenc_session_t *session);
+
+/*
+ * Whether the output reaches the end of the input, that is, not cancelled
+ * and the last segment. Valid after aacenc_session_finalize().
+ */
+int aacenc_session_is_complete(aacenc_session_t *session);
+
+/* AudioSpecificConfig, as stored in M4A */
+int aacenc_session_get_asc(aacenc_session_t *session, uint8_t *asc,
+                           uint32_t *size);
+
+/* encoder delay signaled for gapless playback, in frames of the input */
+uint32_t aacenc_session_get_delay(aacenc_session_t *session);
+
+/* in milliseconds */
+typedef struct aacenc_latency_t {
+    double frame;           /* duration of a frame */
+    double algorithmic;     /* encoder delay */
+    double processing_avg;  /* from reading the input to writing a frame */
+    double processing_max;
+} aacenc_latency_t;
+
+/* available only in low-latency mode */
+int aacenc_session_get_latency(aacenc_session_t *session,
+                               aacenc_latency_t *latency);
+
+/*
+ * Number of blocks read from the reader, and time spent reading them in
+ * microseconds. Valid after aacenc_session_finalize().
+ * Returns -1 when the input is not read by blocks.
+ */
+int aacenc_session_get_block_stats(aacenc_session_t *session,
+                                   unsigned *block_size, int64_t *blocks,
+                                   int64_t *usec);
+
+/*
+ * For writing the output into a track of m4af owned by the caller (such
+ * as multi-track M4A) via the frame callback.
+ * Priming can be set only after aacenc_session_finalize().
+ */
+void aacenc_session_setup_m4a_track(aacenc_session_t *session,
+                                    m4af_ctx_t *m4af, uint32_t track_idx);
+
+void aacenc_session_set_m4a_priming(aacenc_session_t *session,
+                                    m4af_ctx_t *m4af, uint32_t track_idx);
+
+#endif
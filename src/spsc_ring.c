@@ -0,0 +1,148 @@
+/* 
+ * Copyright (C) 2013 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#if HAVE_CONFIG_H
+#  include "config.h"
+#endif
+#if HAVE_STDINT_H
+#  include <stdint.h>
+#endif
+#include <stdlib.h>
+#include "spsc_ring.h"
+
+#if HAVE_PTHREAD_H && HAVE_STDATOMIC_H
+#include <stdatomic.h>
+#include <pthread.h>
+
+struct spsc_ring_t {
+    uint8_t *elements;
+    size_t element_size;
+    unsigned count;
+    atomic_uint head;       /* next element to be consumed */
+    atomic_uint tail;       /* next element to be produced */
+    atomic_int closed;
+    atomic_int waiters;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+spsc_ring_t *spsc_ring_create(unsigned count, size_t element_size)
+{
+    spsc_ring_t *ring;
+    unsigned n;
+
+    /* power of 2, so that wrap around of indices doesn't matter */
+    for (n = 1; n < count; n <<= 1)
+        ;
+    count = n;
+    if ((ring = calloc(1, sizeof(spsc_ring_t))) == 0)
+        return 0;
+    if ((ring->elements = calloc(count, element_size)) == 0) {
+        free(ring);
+        return 0;
+    }
+    ring->element_size = element_size;
+    ring->count = count;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->closed, 0);
+    atomic_init(&ring->waiters, 0);
+    pthread_mutex_init(&ring->mutex, 0);
+    pthread_cond_init(&ring->cond, 0);
+    return ring;
+}
+
+void spsc_ring_teardown(spsc_ring_t **ring)
+{
+    pthread_cond_destroy(&(*ring)->cond);
+    pthread_mutex_destroy(&(*ring)->mutex);
+    free((*ring)->elements);
+    free(*ring);
+    *ring = 0;
+}
+
+static
+int is_full(spsc_ring_t *ring)
+{
+    return atomic_load(&ring->tail) - atomic_load(&ring->head) == ring->count;
+}
+
+static
+int is_empty(spsc_ring_t *ring)
+{
+    return atomic_load(&ring->tail) == atomic_load(&ring->head);
+}
+
+/*
+ * Block until cond() turns false or the ring is closed.
+ * Waiter count is incremented before re-checking the condition, so that
+ * the other side, which updates index before checking waiters, never
+ * misses to wake us up.
+ */
+static
+void wait_while(spsc_ring_t *ring, int (*cond)(spsc_ring_t *))
+{
+    pthread_mutex_lock(&ring->mutex);
+    atomic_fetch_add(&ring->waiters, 1);
+    while (cond(ring) && !atomic_load(&ring->closed))
+        pthread_cond_wait(&ring->cond, &ring->mutex);
+    atomic_fetch_sub(&ring->waiters, 1);
+    pthread_mutex_unlock(&ring->mutex);
+}
+
+static
+void wake(spsc_ring_t *ring)
+{
+    if (atomic_load(&ring->waiters)) {
+        pthread_mutex_lock(&ring->mutex);
+        pthread_cond_broadcast(&ring->cond);
+        pthread_mutex_unlock(&ring->mutex);
+    }
+}
+
+void *spsc_ring_reserve(spsc_ring_t *ring)
+{
+    unsigned tail;
+
+    if (is_full(ring))
+        wait_while(ring, is_full);
+    if (atomic_load(&ring->closed))
+        return 0;
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    return ring->elements + (tail % ring->count) * ring->element_size;
+}
+
+void spsc_ring_commit(spsc_ring_t *ring)
+{
+    atomic_fetch_add(&ring->tail, 1);
+    wake(ring);
+}
+
+void *spsc_ring_peek(spsc_ring_t *ring)
+{
+    unsigned head;
+
+    if (is_empty(ring))
+        wait_while(ring, is_empty);
+    if (is_empty(ring))
+        return 0;
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    return ring->elements + (head % ring->count) * ring->element_size;
+}
+
+void spsc_ring_release(spsc_ring_t *ring)
+{
+    atomic_fetch_add(&ring->head, 1);
+    wake(ring);
+}
+
+void spsc_ring_close(spsc_ring_t *ring)
+{
+    atomic_store(&ring->closed, 1);
+    pthread_mutex_lock(&ring->mutex);
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->mutex);
+}
+
+#endif
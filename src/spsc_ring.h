@@ -0,0 +1,34 @@
+/* 
+ * Copyright (C) 2013 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+/*
+ * Bounded single producer / single consumer queue of fixed size elements.
+ * Elements are accessed in place: producer reserves a slot, fills it and
+ * commits it, and consumer peeks a slot, uses it and releases it.
+ * Indices are updated without lock; mutex/condvar is only touched when
+ * either side has to wait.
+ */
+typedef struct spsc_ring_t spsc_ring_t;
+
+spsc_ring_t *spsc_ring_create(unsigned count, size_t element_size);
+void spsc_ring_teardown(spsc_ring_t **ring);
+
+/* returns 0 when the ring is closed */
+void *spsc_ring_reserve(spsc_ring_t *ring);
+void spsc_ring_commit(spsc_ring_t *ring);
+
+/* returns 0 when the ring is closed and empty */
+void *spsc_ring_peek(spsc_ring_t *ring);
+void spsc_ring_release(spsc_ring_t *ring);
+
+/*
+ * Called by producer to signal end of stream, or by consumer to cancel
+ * producer.
+ */
+void spsc_ring_close(spsc_ring_t *ring);
+
+#endif
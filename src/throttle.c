@@ -0,0 +1,264 @@
+/* 
+ * Copyright (C) 2013 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#if HAVE_CONFIG_H
+#  include "config.h"
+#endif
+#if HAVE_STDINT_H
+#  include <stdint.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+#include "compat.h"
+#include "throttle.h"
+
+/*
+ * Instead of counting tokens, the time when the bucket becomes empty is
+ * kept: each request pushes it by size / rate, and waits until it is in
+ * the past. A full bucket is THROTTLE_BURST_USEC before now.
+ * Requests are served in order of arrival, therefore bandwidth is shared
+ * evenly by concurrent users.
+ * A request never waits longer than its own share plus the burst and the
+ * shares of the requests still waiting ahead of it, so that a bogus
+ * empty_at cannot stall the users for long.
+ */
+struct aacenc_throttle_t {
+#if HAVE_PTHREAD_H
+    pthread_mutex_t mutex;
+#endif
+    double usec_per_byte;
+    double empty_at;        /* in usec of aacenc_timer_usec() */
+    double queued;          /* usec reserved by requests still waiting */
+    int64_t wait;
+};
+
+aacenc_throttle_t *aacenc_throttle_create(double rate)
+{
+    aacenc_throttle_t *self;
+
+    if ((self = calloc(1, sizeof(aacenc_throttle_t))) == 0)
+        return 0;
+#if HAVE_PTHREAD_H
+    pthread_mutex_init(&self->mutex, 0);
+#endif
+    self->usec_per_byte = 1000000.0 / rate;
+    return self;
+}
+
+void aacenc_throttle_destroy(aacenc_throttle_t **throttle)
+{
+#if HAVE_PTHREAD_H
+    pthread_mutex_destroy(&(*throttle)->mutex);
+#endif
+    free(*throttle);
+    *throttle = 0;
+}
+
+int64_t aacenc_throttle_consume(aacenc_throttle_t *throttle, uint32_t size)
+{
+    int64_t now, wait;
+    double share = size * throttle->usec_per_byte;
+    double max_wait;
+
+#if HAVE_PTHREAD_H
+    pthread_mutex_lock(&throttle->mutex);
+#endif
+    now = aacenc_timer_usec();
+    if (throttle->empty_at < now - THROTTLE_BURST_USEC)
+        throttle->empty_at = now - THROTTLE_BURST_USEC;
+    throttle->empty_at += share;
+    max_wait = throttle->queued + share + THROTTLE_BURST_USEC;
+    if (throttle->empty_at - now > max_wait)
+        throttle->empty_at = now + max_wait;
+    wait = throttle->empty_at - now;
+    if (wait > 0) {
+        throttle->wait += wait;
+        throttle->queued += share;
+    }
+#if HAVE_PTHREAD_H
+    pthread_mutex_unlock(&throttle->mutex);
+#endif
+    if (wait <= 0)
+        return 0;
+    aacenc_sleep_usec(wait);
+#if HAVE_PTHREAD_H
+    pthread_mutex_lock(&throttle->mutex);
+#endif
+    throttle->queued -= share;
+#if HAVE_PTHREAD_H
+    pthread_mutex_unlock(&throttle->mutex);
+#endif
+    return wait;
+}
+
+int64_t aacenc_throttle_get_wait(aacenc_throttle_t *throttle)
+{
+    int64_t wait;
+
+#if HAVE_PTHREAD_H
+    pthread_mutex_lock(&throttle->mutex);
+#endif
+    wait = throttle->wait;
+#if HAVE_PTHREAD_H
+    pthread_mutex_unlock(&throttle->mutex);
+#endif
+    return wait;
+}
+
+/* input */
+
+typedef struct throttle_input_t {
+    aacenc_throttle_t *throttle;
+    pcm_io_context_t src;
+    int64_t wait;
+} throttle_input_t;
+
+static int throttle_read(void *cookie, void *data, uint32_t count)
+{
+    throttle_input_t *self = cookie;
+    int rc = self->src.vtbl->read(self->src.cookie, data, count);
+
+    if (rc > 0)
+        self->wait += aacenc_throttle_consume(self->throttle, rc);
+    return rc;
+}
+
+static int throttle_seek(void *cookie, int64_t off, int whence)
+{
+    throttle_input_t *self = cookie;
+    return pcm_seek(&self->src, off, whence);
+}
+
+static int64_t throttle_tell(void *cookie)
+{
+    throttle_input_t *self = cookie;
+    return pcm_tell(&self->src);
+}
+
+static int throttle_peek(void *cookie, const void **data, uint32_t count)
+{
+    throttle_input_t *self = cookie;
+    int rc = self->src.vtbl->peek(self->src.cookie, data, count);
+
+    if (rc > 0)
+        self->wait += aacenc_throttle_consume(self->throttle, rc);
+    return rc;
+}
+
+static pcm_io_vtbl_t throttle_input_vtbl = {
+    throttle_read, throttle_seek, throttle_tell
+};
+static pcm_io_vtbl_t throttle_input_vtbl_peek = {
+    throttle_read, throttle_seek, throttle_tell, throttle_peek
+};
+
+int aacenc_throttle_open_input(aacenc_throttle_t *throttle,
+                               pcm_io_context_t *io,
+                               const pcm_io_context_t *src)
+{
+    throttle_input_t *self;
+
+    if ((self = calloc(1, sizeof(throttle_input_t))) == 0)
+        return -1;
+    self->throttle = throttle;
+    self->src = *src;
+    io->vtbl = src->vtbl->peek ? &throttle_input_vtbl_peek
+                               : &throttle_input_vtbl;
+    io->cookie = self;
+    return 0;
+}
+
+int64_t aacenc_throttle_get_input_wait(pcm_io_context_t *io)
+{
+    return ((throttle_input_t *)io->cookie)->wait;
+}
+
+void aacenc_throttle_close_input(pcm_io_context_t *io)
+{
+    free(io->cookie);
+    io->cookie = 0;
+}
+
+/* output */
+
+struct aacenc_throttle_output_t {
+    aacenc_throttle_t *throttle;
+    m4af_io_callbacks_t *io;
+    void *cookie;
+    int64_t wait;
+};
+
+static int throttle_output_read(void *cookie, void *data, uint32_t size)
+{
+    aacenc_throttle_output_t *self = cookie;
+
+    if (!self->io->read)
+        return -1;
+    return self->io->read(self->cookie, data, size);
+}
+
+static int throttle_write(void *cookie, const void *data, uint32_t size)
+{
+    aacenc_throttle_output_t *self = cookie;
+
+    self->wait += aacenc_throttle_consume(self->throttle, size);
+    return self->io->write(self->cookie, data, size);
+}
+
+static int throttle_output_seek(void *cookie, int64_t off, int whence)
+{
+    aacenc_throttle_output_t *self = cookie;
+
+    if (!self->io->seek)
+        return -1;
+    return self->io->seek(self->cookie, off, whence);
+}
+
+static int64_t throttle_output_tell(void *cookie)
+{
+    aacenc_throttle_output_t *self = cookie;
+
+    if (!self->io->tell)
+        return -1;
+    return self->io->tell(self->cookie);
+}
+
+static m4af_io_callbacks_t throttle_output_io = {
+    throttle_output_read, throttle_write, throttle_output_seek,
+    throttle_output_tell
+};
+
+aacenc_throttle_output_t *
+aacenc_throttle_open_output(aacenc_throttle_t *throttle,
+                            m4af_io_callbacks_t *io, void *cookie)
+{
+    aacenc_throttle_output_t *self;
+
+    if ((self = calloc(1, sizeof(aacenc_throttle_output_t))) == 0)
+        return 0;
+    self->throttle = throttle;
+    self->io = io;
+    self->cookie = cookie;
+    return self;
+}
+
+m4af_io_callbacks_t *aacenc_throttle_get_output_io(void)
+{
+    return &throttle_output_io;
+}
+
+int64_t aacenc_throttle_get_output_wait(aacenc_throttle_output_t *output)
+{
+    return output->wait;
+}
+
+void aacenc_throttle_close_output(aacenc_throttle_output_t **output)
+{
+    free(*output);
+    *output = 0;
+}
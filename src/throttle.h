@@ -0,0 +1,52 @@
+/* 
+ * Copyright (C) 2013 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include "pcm_reader.h"
+#include "m4af.h"
+
+/*
+ * Token bucket limiting I/O bandwidth, which can be shared by any number
+ * of inputs and outputs, used from any threads.
+ * Up to THROTTLE_BURST_USEC worth of bytes can be passed at once after
+ * being idle.
+ */
+#define THROTTLE_BURST_USEC 100000
+
+typedef struct aacenc_throttle_t aacenc_throttle_t;
+typedef struct aacenc_throttle_output_t aacenc_throttle_output_t;
+
+/* rate is in bytes per second */
+aacenc_throttle_t *aacenc_throttle_create(double rate);
+void aacenc_throttle_destroy(aacenc_throttle_t **throttle);
+
+/* waits until size bytes are allowed. returns the time waited in usec */
+int64_t aacenc_throttle_consume(aacenc_throttle_t *throttle, uint32_t size);
+
+/* total time waited by all users, in usec */
+int64_t aacenc_throttle_get_wait(aacenc_throttle_t *throttle);
+
+/*
+ * Sets up io to read src through the throttle. src must be kept open until
+ * aacenc_throttle_close_input().
+ */
+int aacenc_throttle_open_input(aacenc_throttle_t *throttle,
+                               pcm_io_context_t *io,
+                               const pcm_io_context_t *src);
+/* time waited by this input, in usec */
+int64_t aacenc_throttle_get_input_wait(pcm_io_context_t *io);
+void aacenc_throttle_close_input(pcm_io_context_t *io);
+
+/* writes to io/cookie through the throttle. reads are not throttled */
+aacenc_throttle_output_t *
+aacenc_throttle_open_output(aacenc_throttle_t *throttle,
+                            m4af_io_callbacks_t *io, void *cookie);
+m4af_io_callbacks_t *aacenc_throttle_get_output_io(void);
+/* time waited by this output, in usec */
+int64_t aacenc_throttle_get_output_wait(aacenc_throttle_output_t *output);
+void aacenc_throttle_close_output(aacenc_throttle_output_t **output);
+
+#endif
@@ -0,0 +1,657 @@
+/* 
+ * Copyright (C) 2013 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#if HAVE_CONFIG_H
+#  include "config.h"
+#endif
+#if HAVE_STDINT_H
+#  include <stdint.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "compat.h"
+#include "uring_io.h"
+
+#if HAVE_LINUX_IO_URING_H && HAVE_PTHREAD_H && HAVE_SYS_MMAN_H
+#  include <sys/syscall.h>
+#  if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#    define USE_IO_URING 1
+#  endif
+#endif
+
+#if USE_IO_URING
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 64
+
+struct aacenc_uring_t {
+    int fd;
+    unsigned depth;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int reaping;    /* a thread is waiting in io_uring_enter() */
+};
+
+/* user_data of a request. updated under the mutex of the ring */
+typedef struct uring_req_t {
+    int res;
+    int done;
+} uring_req_t;
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                       unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   0, 0);
+}
+
+/* route completions to requests. called with the mutex held */
+static int reap(aacenc_uring_t *ring)
+{
+    unsigned head = *ring->cq_head, count = 0;
+
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        uring_req_t *req = (uring_req_t *)(uintptr_t)cqe->user_data;
+        req->res = cqe->res;
+        req->done = 1;
+        ++head;
+        ++count;
+    }
+    if (count) {
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&ring->cond);
+    }
+    return count;
+}
+
+static int submit(aacenc_uring_t *ring, int opcode, int fd,
+                  const struct iovec *iov, int64_t offset, uring_req_t *req)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail, index;
+    int rc;
+
+    pthread_mutex_lock(&ring->mutex);
+    tail = *ring->sq_tail;
+    index = tail & *ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)iov;
+    sqe->len = 1;
+    sqe->off = offset;
+    sqe->user_data = (uintptr_t)req;
+    req->done = 0;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    /* EBUSY: completion queue is full, which has to be reaped first */
+    while ((rc = uring_enter(ring->fd, 1, 0, 0)) < 0 &&
+           (errno == EINTR || errno == EAGAIN || errno == EBUSY))
+        reap(ring);
+    if (rc < 0) {
+        /* take back the entry, since the kernel didn't */
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+        req->res = -errno;
+        req->done = 1;
+    }
+    pthread_mutex_unlock(&ring->mutex);
+    return rc < 0 ? -1 : 0;
+}
+
+/*
+ * Only one thread at a time waits in io_uring_enter(), and wakes up the
+ * others when anything has completed.
+ */
+static int wait_req(aacenc_uring_t *ring, uring_req_t *req)
+{
+    int res;
+
+    pthread_mutex_lock(&ring->mutex);
+    while (!req->done) {
+        if (reap(ring))
+            continue;
+        if (ring->reaping) {
+            pthread_cond_wait(&ring->cond, &ring->mutex);
+            continue;
+        }
+        ring->reaping = 1;
+        pthread_mutex_unlock(&ring->mutex);
+        uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+        pthread_mutex_lock(&ring->mutex);
+        ring->reaping = 0;
+        if (!reap(ring))
+            pthread_cond_broadcast(&ring->cond);
+    }
+    res = req->res;
+    pthread_mutex_unlock(&ring->mutex);
+    return res;
+}
+
+aacenc_uring_t *aacenc_uring_create(unsigned depth)
+{
+    aacenc_uring_t *ring;
+    struct io_uring_params p = { 0 };
+    void *sqes;
+
+    if ((ring = calloc(1, sizeof(aacenc_uring_t))) == 0)
+        return 0;
+    ring->sq_ptr = ring->cq_ptr = MAP_FAILED;
+    ring->depth = depth;
+    if ((ring->fd = uring_setup(URING_ENTRIES, &p)) < 0)
+        goto FAIL;
+    ring->sq_entries = p.sq_entries;
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes
+                  + p.cq_entries * sizeof(struct io_uring_cqe);
+#ifdef IORING_FEAT_SINGLE_MMAP
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size)
+            ring->sq_size = ring->cq_size;
+        ring->cq_size = 0;
+    }
+#endif
+    ring->sq_ptr = mmap(0, ring->sq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+        goto FAIL;
+    if (!ring->cq_size)
+        ring->cq_ptr = ring->sq_ptr;
+    else {
+        ring->cq_ptr = mmap(0, ring->cq_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+            goto FAIL;
+    }
+    sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe),
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring->fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+        goto FAIL;
+    ring->sqes = sqes;
+    ring->sq_head  = (unsigned *)((char *)ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail  = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask  = (unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+    ring->cq_head  = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail  = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask  = (unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr
+                                         + p.cq_off.cqes);
+    pthread_mutex_init(&ring->mutex, 0);
+    pthread_cond_init(&ring->cond, 0);
+    return ring;
+FAIL:
+    if (ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+    if (ring->sq_ptr != MAP_FAILED)
+        munmap(ring->sq_ptr, ring->sq_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    free(ring);
+    return 0;
+}
+
+void aacenc_uring_destroy(aacenc_uring_t **ring)
+{
+    aacenc_uring_t *self = *ring;
+
+    munmap(self->sqes, self->sq_entries * sizeof(struct io_uring_sqe));
+    if (self->cq_ptr != self->sq_ptr)
+        munmap(self->cq_ptr, self->cq_size);
+    munmap(self->sq_ptr, self->sq_size);
+    close(self->fd);
+    pthread_mutex_destroy(&self->mutex);
+    pthread_cond_destroy(&self->cond);
+    free(self);
+    *ring = 0;
+}
+
+typedef struct uring_block_t {
+    uint8_t *data;
+    int64_t offset;
+    uint32_t length;    /* requested */
+    uint32_t size;      /* read, or filled for write */
+    int pending;
+    struct iovec iov;
+    uring_req_t req;
+} uring_block_t;
+
+static int alloc_blocks(uring_block_t *blocks, unsigned n)
+{
+    unsigned i;
+
+    for (i = 0; i < n; ++i) {
+        void *p;
+        if (posix_memalign(&p, 4096, URING_BLOCK_SIZE))
+            return -1;
+        blocks[i].data = p;
+    }
+    return 0;
+}
+
+static void free_blocks(uring_block_t *blocks, unsigned n)
+{
+    unsigned i;
+
+    for (i = 0; i < n; ++i)
+        free(blocks[i].data);
+}
+
+/* returns result of the request, or 0 when nothing is pending */
+static int complete_block(aacenc_uring_t *ring, uring_block_t *block)
+{
+    if (!block->pending)
+        return 0;
+    block->pending = 0;
+    return wait_req(ring, &block->req);
+}
+
+/* input */
+
+typedef struct uring_input_t {
+    aacenc_uring_t *ring;
+    int fd;
+    int error;
+    int64_t file_size;
+    int64_t pos;
+    int64_t next_offset;    /* of the next block to be read */
+    unsigned nblocks;
+    unsigned cur;           /* block containing pos, when it's available */
+    uring_block_t blocks[1];
+} uring_input_t;
+
+static void issue_read(uring_input_t *self, uring_block_t *block)
+{
+    int64_t remaining = self->file_size - self->next_offset;
+
+    block->offset = self->next_offset;
+    block->length = remaining < URING_BLOCK_SIZE ? remaining
+                                                 : URING_BLOCK_SIZE;
+    block->size = 0;
+    if (!block->length)
+        return;
+    block->iov.iov_base = block->data;
+    block->iov.iov_len = block->length;
+    block->pending = 1;
+    if (submit(self->ring, IORING_OP_READV, self->fd, &block->iov,
+               block->offset, &block->req) < 0)
+        self->error = 1;
+    self->next_offset += block->length;
+}
+
+static int complete_read(uring_input_t *self, uring_block_t *block)
+{
+    int res;
+
+    if (!block->pending)
+        return 0;
+    if ((res = complete_block(self->ring, block)) < 0)
+        self->error = 1;
+    block->size = res < 0 ? 0 : res;
+    return self->error ? -1 : 0;
+}
+
+/* discard everything in flight, and start reading ahead from pos */
+static void restart(uring_input_t *self)
+{
+    unsigned i;
+
+    for (i = 0; i < self->nblocks; ++i)
+        complete_read(self, &self->blocks[i]);
+    self->error = 0;
+    self->next_offset = self->pos;
+    self->cur = 0;
+    for (i = 0; i < self->nblocks; ++i)
+        issue_read(self, &self->blocks[i]);
+}
+
+/* make blocks[cur] contain pos. returns 0 on EOF */
+static int fill(uring_input_t *self)
+{
+    uring_block_t *b;
+    int restarted = 0;
+
+    for (;;) {
+        b = &self->blocks[self->cur];
+        if (complete_read(self, b) < 0)
+            return -1;
+        if (self->pos >= b->offset && self->pos < b->offset + b->size)
+            return 1;
+        if (self->pos < self->next_offset && self->pos >= b->offset &&
+            b->size && b->size == b->length) {
+            /* consumed, and read-ahead continues in the next block */
+            issue_read(self, b);
+            self->cur = (self->cur + 1) % self->nblocks;
+            continue;
+        }
+        /* short read, or pos is out of the window */
+        if (restarted || self->pos >= self->file_size)
+            return 0;
+        restart(self);
+        restarted = 1;
+    }
+}
+
+static int uring_read(void *cookie, void *data, uint32_t count)
+{
+    uring_input_t *self = cookie;
+    uring_block_t *b;
+    int rc;
+
+    if ((rc = fill(self)) <= 0)
+        return rc;
+    b = &self->blocks[self->cur];
+    if (count > b->offset + b->size - self->pos)
+        count = b->offset + b->size - self->pos;
+    memcpy(data, b->data + (self->pos - b->offset), count);
+    self->pos += count;
+    return count;
+}
+
+static int uring_seek(void *cookie, int64_t off, int whence)
+{
+    uring_input_t *self = cookie;
+    int64_t pos;
+
+    switch (whence) {
+    case SEEK_SET: pos = off; break;
+    case SEEK_CUR: pos = self->pos + off; break;
+    case SEEK_END: pos = self->file_size + off; break;
+    default: return -1;
+    }
+    if (pos < 0)
+        return -1;
+    /* read-ahead moves on the next read */
+    self->pos = pos;
+    return 0;
+}
+
+static int64_t uring_tell(void *cookie)
+{
+    return ((uring_input_t *)cookie)->pos;
+}
+
+static pcm_io_vtbl_t uring_input_vtbl = { uring_read, uring_seek, uring_tell };
+
+int aacenc_uring_open_input(aacenc_uring_t *ring, pcm_io_context_t *io,
+                            FILE *fp)
+{
+    uring_input_t *self;
+    struct stat st;
+    int64_t pos;
+    unsigned n = ring->depth;
+
+    if (fstat(fileno(fp), &st) < 0 || !S_ISREG(st.st_mode) ||
+        st.st_size == 0 || (pos = ftello(fp)) < 0)
+        return -1;
+    self = calloc(1, sizeof(uring_input_t) + (n - 1) * sizeof(uring_block_t));
+    if (!self)
+        return -1;
+    self->ring = ring;
+    self->fd = fileno(fp);
+    self->file_size = st.st_size;
+    self->pos = pos;
+    self->nblocks = n;
+    if (alloc_blocks(self->blocks, n) < 0) {
+        free_blocks(self->blocks, n);
+        free(self);
+        return -1;
+    }
+    restart(self);
+    io->vtbl = &uring_input_vtbl;
+    io->cookie = self;
+    return 0;
+}
+
+void aacenc_uring_close_input(pcm_io_context_t *io)
+{
+    uring_input_t *self = io->cookie;
+    unsigned i;
+
+    /* buffers can't be freed until the kernel is done with them */
+    for (i = 0; i < self->nblocks; ++i)
+        complete_read(self, &self->blocks[i]);
+    free_blocks(self->blocks, self->nblocks);
+    free(self);
+    io->cookie = 0;
+}
+
+/* output */
+
+struct aacenc_uring_output_t {
+    aacenc_uring_t *ring;
+    int fd;
+    int error;
+    int64_t pos;
+    int64_t size;
+    unsigned nblocks;
+    unsigned cur;           /* block being filled */
+    uring_block_t blocks[1];
+};
+
+static void complete_write(aacenc_uring_output_t *self, uring_block_t *block)
+{
+    int res;
+    uint32_t done;
+
+    if (!block->pending)
+        return;
+    if ((res = complete_block(self->ring, block)) < 0) {
+        errno = -res;
+        self->error = 1;
+        return;
+    }
+    /* short write: rest is written synchronously */
+    for (done = res; done < block->length; done += res) {
+        res = pwrite(self->fd, block->data + done, block->length - done,
+                     block->offset + done);
+        if (res <= 0) {
+            self->error = 1;
+            return;
+        }
+    }
+}
+
+/* submit the current block, and move on to the next one */
+static void flush_block(aacenc_uring_output_t *self)
+{
+    uring_block_t *b = &self->blocks[self->cur];
+
+    if (!b->size)
+        return;
+    b->length = b->size;
+    b->iov.iov_base = b->data;
+    b->iov.iov_len = b->length;
+    b->pending = 1;
+    if (submit(self->ring, IORING_OP_WRITEV, self->fd, &b->iov, b->offset,
+               &b->req) < 0)
+        self->error = 1;
+    self->cur = (self->cur + 1) % self->nblocks;
+    b = &self->blocks[self->cur];
+    complete_write(self, b);
+    b->size = 0;
+}
+
+static void drain(aacenc_uring_output_t *self)
+{
+    unsigned i;
+
+    flush_block(self);
+    for (i = 0; i < self->nblocks; ++i)
+        complete_write(self, &self->blocks[i]);
+}
+
+static int uring_write(void *cookie, const void *data, uint32_t size)
+{
+    aacenc_uring_output_t *self = cookie;
+    const uint8_t *p = data;
+    uint32_t n, count = size;
+    uring_block_t *b;
+
+    while (count > 0 && !self->error) {
+        b = &self->blocks[self->cur];
+        if (!b->size)
+            b->offset = self->pos;
+        n = URING_BLOCK_SIZE - b->size;
+        if (n > count)
+            n = count;
+        memcpy(b->data + b->size, p, n);
+        b->size += n;
+        p += n;
+        count -= n;
+        self->pos += n;
+        if (self->size < self->pos)
+            self->size = self->pos;
+        if (b->size == URING_BLOCK_SIZE)
+            flush_block(self);
+    }
+    return self->error ? -1 : (int)size;
+}
+
+static int uring_output_read(void *cookie, void *data, uint32_t size)
+{
+    aacenc_uring_output_t *self = cookie;
+    ssize_t rc;
+
+    drain(self);
+    if ((rc = pread(self->fd, data, size, self->pos)) > 0)
+        self->pos += rc;
+    return rc;
+}
+
+static int uring_output_seek(void *cookie, int64_t off, int whence)
+{
+    aacenc_uring_output_t *self = cookie;
+    int64_t pos;
+
+    switch (whence) {
+    case SEEK_SET: pos = off; break;
+    case SEEK_CUR: pos = self->pos + off; break;
+    case SEEK_END: pos = self->size + off; break;
+    default: return -1;
+    }
+    if (pos < 0)
+        return -1;
+    if (pos != self->pos) {
+        drain(self);
+        self->pos = pos;
+    }
+    return 0;
+}
+
+static int64_t uring_output_tell(void *cookie)
+{
+    return ((aacenc_uring_output_t *)cookie)->pos;
+}
+
+static m4af_io_callbacks_t uring_output_io = {
+    uring_output_read, uring_write, uring_output_seek, uring_output_tell
+};
+
+m4af_io_callbacks_t *aacenc_uring_get_output_io(void)
+{
+    return &uring_output_io;
+}
+
+aacenc_uring_output_t *aacenc_uring_open_output(aacenc_uring_t *ring,
+                                                FILE *fp)
+{
+    aacenc_uring_output_t *self;
+    struct stat st;
+    unsigned n = ring->depth;
+
+    if (fstat(fileno(fp), &st) < 0 || !S_ISREG(st.st_mode))
+        return 0;
+    self = calloc(1, sizeof(aacenc_uring_output_t)
+                     + (n - 1) * sizeof(uring_block_t));
+    if (!self)
+        return 0;
+    self->ring = ring;
+    self->fd = fileno(fp);
+    self->pos = ftello(fp);
+    self->size = st.st_size;
+    self->nblocks = n;
+    if (alloc_blocks(self->blocks, n) < 0) {
+        free_blocks(self->blocks, n);
+        free(self);
+        return 0;
+    }
+    return self;
+}
+
+int aacenc_uring_close_output(aacenc_uring_output_t **output)
+{
+    aacenc_uring_output_t *self = *output;
+    int error;
+
+    drain(self);
+    error = self->error;
+    free_blocks(self->blocks, self->nblocks);
+    free(self);
+    *output = 0;
+    return error ? -1 : 0;
+}
+
+#else
+
+aacenc_uring_t *aacenc_uring_create(unsigned depth)
+{
+    return 0;
+}
+
+void aacenc_uring_destroy(aacenc_uring_t **ring)
+{
+}
+
+int aacenc_uring_open_input(aacenc_uring_t *ring, pcm_io_context_t *io,
+                            FILE *fp)
+{
+    return -1;
+}
+
+void aacenc_uring_close_input(pcm_io_context_t *io)
+{
+}
+
+aacenc_uring_output_t *aacenc_uring_open_output(aacenc_uring_t *ring,
+                                                FILE *fp)
+{
+    return 0;
+}
+
+m4af_io_callbacks_t *aacenc_uring_get_output_io(void)
+{
+    return 0;
+}
+
+int aacenc_uring_close_output(aacenc_uring_output_t **output)
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,56 @@
+/* 
+ * Copyright (C) 2013 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#ifndef URING_IO_H
+#define URING_IO_H
+
+#include <stdio.h>
+#include "pcm_reader.h"
+#include "m4af.h"
+
+/*
+ * Asynchronous file I/O on Linux io_uring.
+ *
+ * Input keeps up to depth reads of URING_BLOCK_SIZE in flight ahead of
+ * the reader.
+ * Output collects writes into blocks of URING_BLOCK_SIZE, and submits
+ * them without waiting for completion, keeping up to depth blocks in
+ * flight. seek (to another position) and read wait for all of them,
+ * so that they never overlap with later writes.
+ *
+ * A ring can be shared by any number of inputs and outputs, used from
+ * any threads.
+ */
+#define URING_BLOCK_SIZE (1 << 20)
+
+typedef struct aacenc_uring_t aacenc_uring_t;
+typedef struct aacenc_uring_output_t aacenc_uring_output_t;
+
+/* returns NULL when io_uring is not available */
+aacenc_uring_t *aacenc_uring_create(unsigned depth);
+
+/* all inputs and outputs must be closed beforehand */
+void aacenc_uring_destroy(aacenc_uring_t **ring);
+
+/*
+ * Sets up io to read a regular file from the current position of fp,
+ * like pcm_open_mmap_io(). Returns -1 when not applicable.
+ */
+int aacenc_uring_open_input(aacenc_uring_t *ring, pcm_io_context_t *io,
+                            FILE *fp);
+void aacenc_uring_close_input(pcm_io_context_t *io);
+
+/*
+ * Returns NULL when fp is not a regular file.
+ * fp must not be written by stdio while the output is open.
+ */
+aacenc_uring_output_t *aacenc_uring_open_output(aacenc_uring_t *ring,
+                                                FILE *fp);
+
+m4af_io_callbacks_t *aacenc_uring_get_output_io(void);
+
+/* waits for pending writes. returns -1 if any write has failed */
+int aacenc_uring_close_output(aacenc_uring_output_t **output);
+
+#endif
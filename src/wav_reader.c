@@ -25,6 +25,7 @@ typedef struct wav_reader_t {
     int64_t position;
     int32_t data_offset;
     int ignore_length;
+    unsigned acquired;
     pcm_io_context_t io;
 } wav_reader_t;
 
@@ -82,6 +83,38 @@ int wav_read_frames(pcm_reader_t *preader, void *buffer, unsigned nframes)
     return nframes;
 }
 
+static
+int wav_acquire_frames(pcm_reader_t *preader, const void **data,
+                       unsigned nframes)
+{
+    int rc;
+    wav_reader_t *reader = (wav_reader_t *)preader;
+    unsigned bpf = reader->sample_format.bytes_per_frame;
+
+    if (!reader->ignore_length && nframes > reader->length - reader->position)
+        nframes = reader->length - reader->position;
+    if (!nframes)
+        return 0;
+    if ((rc = reader->io.vtbl->peek(reader->io.cookie, data,
+                                    nframes * bpf)) < 0)
+        return -1;
+    reader->acquired = rc / bpf;
+    return reader->acquired;
+}
+
+static
+void wav_release_frames(pcm_reader_t *preader)
+{
+    wav_reader_t *reader = (wav_reader_t *)preader;
+    unsigned bpf = reader->sample_format.bytes_per_frame;
+
+    if (reader->acquired) {
+        pcm_seek(&reader->io, (int64_t)reader->acquired * bpf, SEEK_CUR);
+        reader->position += reader->acquired;
+        reader->acquired = 0;
+    }
+}
+
 static
 int riff_ds64(wav_reader_t *reader, int64_t *length)
 {
@@ -196,6 +229,31 @@ static pcm_reader_vtbl_t wav_vtable = {
     wav_teardown
 };
 
+static pcm_reader_vtbl_t wav_mapped_vtable = {
+    wav_get_format,
+    wav_get_length,
+    wav_get_position,
+    wav_read_frames,
+    wav_teardown,
+    wav_acquire_frames,
+    wav_release_frames
+};
+
+/*
+ * PCM is handed out in place when io can peek, and samples are aligned
+ * (24bit samples are read bytewise by the converter).
+ */
+static pcm_reader_vtbl_t *wav_select_vtable(wav_reader_t *reader)
+{
+    unsigned bpc = PCM_BYTES_PER_CHANNEL(&reader->sample_format);
+
+    if (!reader->io.vtbl->peek)
+        return &wav_vtable;
+    if (bpc != 3 && reader->data_offset % bpc)
+        return &wav_vtable;
+    return &wav_mapped_vtable;
+}
+
 pcm_reader_t *wav_open(pcm_io_context_t *io, int ignore_length)
 {
     wav_reader_t *reader = 0;
@@ -224,7 +282,7 @@ pcm_reader_t *wav_open(pcm_io_context_t *io, int ignore_length)
             pcm_seek(&reader->io, reader->data_offset, SEEK_SET);
         }
     }
-    reader->vtbl = &wav_vtable;
+    reader->vtbl = wav_select_vtable(reader);
     return (pcm_reader_t *)reader;
 }
 
@@ -244,6 +302,6 @@ pcm_reader_t *raw_open(pcm_io_context_t *io,
         pcm_seek(&reader->io, 0, SEEK_SET);
     } else
         reader->length = INT64_MAX;
-    reader->vtbl = &wav_vtable;
+    reader->vtbl = wav_select_vtable(reader);
     return (pcm_reader_t *)reader;
 }